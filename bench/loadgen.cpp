@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+//=============================================================================
+// load generator for "crepl --serve SOCKET"
+// Every connection keeps --depth requests in flight: it pipelines them, and
+// sends a new request for each response. Requests cycle through the
+// expressions given by -e (or a default mix of reads and writes). The
+// latency of a request is the time from writing it to reading its response.
+// After --time seconds the result is reported as JSON on stdout:
+//   {"connections": 4, "depth": 16, ..., "rps": 1.2e5, "p50_us": 30.1, ...}
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+  const char *socket = nullptr;
+  int connections = 4;
+  int depth = 16;
+  double seconds = 2.0;
+  std::vector<std::string> exprs;
+};
+
+struct Result {
+  std::vector<uint32_t> latencies; // ns (saturated)
+  size_t errors = 0;               // "error: ..." responses
+  bool failed = false;             // connection failed
+};
+
+//-----------------------------------------------------------------------------
+static int connect_to(const char *path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool write_all(int fd, const std::string &buf) {
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t n = send(fd, buf.data() + done, buf.size() - done, MSG_NOSIGNAL);
+    if (n < 0 && errno != EINTR) {
+      return false;
+    }
+    done += n > 0 ? static_cast<size_t>(n) : 0;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// client - one connection
+static void client(const Options &opt, int id, Clock::time_point deadline,
+                   Result &result) {
+  int fd = connect_to(opt.socket);
+  if (fd < 0) {
+    result.failed = true;
+    return;
+  }
+  std::deque<Clock::time_point> inflight;
+  size_t next = static_cast<size_t>(id); // spread the mix over connections
+  std::string out;
+  auto request = [&](Clock::time_point now) {
+    out += opt.exprs[next++ % opt.exprs.size()];
+    out += '\n';
+    inflight.push_back(now);
+  };
+
+  for (int i = 0; i < opt.depth; i++) {
+    request(Clock::now());
+  }
+  char buf[1 << 16];
+  bool first = true; // first byte of a response line
+  while (!inflight.empty()) {
+    if (!out.empty()) {
+      if (!write_all(fd, out)) {
+        result.failed = true;
+        break;
+      }
+      out.clear();
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      result.failed = true;
+      break;
+    }
+    auto now = Clock::now();
+    bool sending = now < deadline;
+    for (ssize_t i = 0; i < n; i++) {
+      if (first && buf[i] == 'e') {
+        result.errors++;
+      }
+      first = buf[i] == '\n';
+      if (!first) {
+        continue;
+      }
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    now - inflight.front())
+                    .count();
+      result.latencies.push_back(
+          static_cast<uint32_t>(std::min<long long>(ns, UINT32_MAX)));
+      inflight.pop_front();
+      if (sending) {
+        request(now);
+      }
+    }
+  }
+  close(fd);
+}
+
+//-----------------------------------------------------------------------------
+static double percentile(const std::vector<uint32_t> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[i] / 1e3;
+}
+
+static void usage() {
+  fputs("usage: loadgen SOCKET [-c CONNECTIONS] [-d DEPTH] [-t SECONDS]\n"
+        "               [-e EXPR]...\n",
+        stderr);
+}
+
+//=============================================================================
+// main
+int main(int argc, char **argv) {
+  Options opt;
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg == "-c" && i + 1 < argc) {
+      opt.connections = atoi(argv[++i]);
+    } else if (arg == "-d" && i + 1 < argc) {
+      opt.depth = atoi(argv[++i]);
+    } else if (arg == "-t" && i + 1 < argc) {
+      opt.seconds = atof(argv[++i]);
+    } else if (arg == "-e" && i + 1 < argc) {
+      opt.exprs.push_back(argv[++i]);
+    } else if (arg[0] != '-' && !opt.socket) {
+      opt.socket = argv[i];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (!opt.socket || opt.connections <= 0 || opt.depth <= 0 ||
+      opt.seconds <= 0) {
+    usage();
+    return 1;
+  }
+  if (opt.exprs.empty()) {
+    opt.exprs = {"a * 3 + b", "(a + b) % 7 == 0 ? a : b", "n = n + 1",
+                 "a < b && b != 0", "b = a ^ n"};
+  }
+
+  std::vector<Result> results(opt.connections);
+  std::vector<std::thread> threads;
+  auto start = Clock::now();
+  auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+                              std::chrono::duration<double>(opt.seconds));
+  for (int i = 0; i < opt.connections; i++) {
+    threads.emplace_back(client, std::cref(opt), i, deadline,
+                         std::ref(results[i]));
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<uint32_t> all;
+  size_t errors = 0;
+  int failed = 0;
+  for (auto &result : results) {
+    all.insert(all.end(), result.latencies.begin(), result.latencies.end());
+    errors += result.errors;
+    failed += result.failed;
+  }
+  std::sort(all.begin(), all.end());
+
+  printf("{\n");
+  printf("  \"connections\": %d,\n", opt.connections);
+  printf("  \"depth\": %d,\n", opt.depth);
+  printf("  \"seconds\": %.3f,\n", elapsed);
+  printf("  \"requests\": %zu,\n", all.size());
+  printf("  \"errors\": %zu,\n", errors);
+  printf("  \"failed_connections\": %d,\n", failed);
+  printf("  \"rps\": %.1f,\n", all.size() / elapsed);
+  printf("  \"p50_us\": %.1f,\n", percentile(all, 0.50));
+  printf("  \"p99_us\": %.1f,\n", percentile(all, 0.99));
+  printf("  \"p999_us\": %.1f,\n", percentile(all, 0.999));
+  printf("  \"max_us\": %.1f\n", all.empty() ? 0.0 : all.back() / 1e3);
+  printf("}\n");
+  return failed ? 1 : 0;
+}
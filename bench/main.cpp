@@ -0,0 +1,367 @@
+#include "arith.h"
+#include "expr.h"
+#include "optimize.h"
+#include "program.h"
+#include "trace.h"
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+//=============================================================================
+// benchmark
+// Every case runs one operation per corpus line (cycling through the corpus)
+// until --min-time seconds have passed, and reports the rate as JSON on
+// stdout:
+//   {"context": {...}, "benchmarks": [{"name": "lexer/short", ...}, ...]}
+
+//-----------------------------------------------------------------------------
+// corpus
+struct Corpus {
+  const char *name;
+  std::vector<std::string> lines;
+};
+
+//-----------------------------------------------------------------------------
+static std::vector<Corpus> corpora() {
+  std::vector<Corpus> result;
+
+  // short REPL lines
+  result.push_back(Corpus{"short",
+                          {
+                              "1 + 2",
+                              "a = 10",
+                              "b = a * 3 + 1",
+                              "a < b ? a : b",
+                              "%r1 + 0x10",
+                              "~a & 0xff",
+                              "c += b >> 2",
+                              "a == 10 && b != 0",
+                              "(a + b) * (a - b)",
+                              "-a % 7",
+                              "0b1010 | 1 << 4",
+                              "!c || a >= b",
+                          }});
+
+  // long generated chain: v0 + v1 * 3 - v2 ^ v3 ...
+  {
+    static const char *ops[] = {" + ", " * 3 - ", " ^ ", " & ", " | "};
+    std::string line = "v0";
+    for (int i = 1; i < 1000; i++) {
+      line += ops[i % 5] + std::string("v") + std::to_string(i % 64);
+    }
+    result.push_back(Corpus{"chain", {line}});
+  }
+
+  // deep nesting: (1 + (2 - (3 + ...)))
+  {
+    std::string line;
+    for (int i = 0; i < 256; i++) {
+      line += "(" + std::to_string(i) + (i % 2 ? " - " : " + ");
+    }
+    line += "1" + std::string(256, ')');
+    result.push_back(Corpus{"nested", {line}});
+  }
+
+  // literal heavy
+  {
+    std::string line = "0";
+    for (int i = 0; i < 1000; i++) {
+      switch (i % 3) {
+      case 0:
+        line += " + " + std::to_string(i * 7919 % 100000);
+        break;
+      case 1:
+        line += " ^ 0x" + std::string("deadbeef").substr(i % 4, 4);
+        break;
+      default:
+        line += " | 0b1011";
+        break;
+      }
+    }
+    result.push_back(Corpus{"literal", {line}});
+  }
+
+  // variable heavy: many distinct names
+  {
+    std::string line = "var0";
+    for (int i = 1; i < 1000; i++) {
+      line += (i % 2 ? " + var" : " - var") + std::to_string(i);
+    }
+    result.push_back(Corpus{"variable", {line}});
+  }
+
+  // division heavy: by literals and by an invariant variable
+  {
+    static const char *ops[] = {" / 7", " % 10", " * 8", " / d", " % 1000"};
+    std::string line = "v0";
+    for (int i = 1; i < 200; i++) {
+      line += " + v" + std::to_string(i % 16) + ops[i % 5];
+    }
+    result.push_back(Corpus{"divide", {line}});
+  }
+
+  // conditions: costly, rarely deciding tests before cheap, deciding ones
+  {
+    std::vector<std::string> lines;
+    for (int i = 0; i < 8; i++) {
+      std::string v = "v" + std::to_string(i);
+      lines.push_back("popcnt(" + v + " * 3) + clz(" + v + ") + ctz(" + v +
+                      " | 1) + bswap(" + v + ") != 12345 && " + v + " * " +
+                      v + " + 7 != -1 && (" + v + " < 0 || w == 0)");
+    }
+    result.push_back(Corpus{"condition", lines});
+  }
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// result
+struct Result {
+  std::string name;
+  size_t iterations;
+  double seconds;
+  double items; // tokens per operation (0: none)
+  double bytes; // source bytes per operation (with items)
+};
+
+static volatile int sink; // keeps results alive
+
+//-----------------------------------------------------------------------------
+// measure - run op(i) for i = 0, 1, ... until min_time has passed
+static Result measure(const std::string &name, double min_time,
+                      std::function<void(size_t)> op) {
+  typedef std::chrono::steady_clock clock;
+  op(0); // warm up
+  size_t n = 1;
+  for (;;) {
+    auto start = clock::now();
+    for (size_t i = 0; i < n; i++) {
+      op(i);
+    }
+    std::chrono::duration<double> elapsed = clock::now() - start;
+    if (elapsed.count() >= min_time || n >= (size_t(1) << 40)) {
+      return Result{name, n, elapsed.count(), 0, 0};
+    }
+    // aim 20% past min_time, at most 10x per round
+    double scale = elapsed.count() > 0 ? min_time * 1.2 / elapsed.count() : 10;
+    n = static_cast<size_t>(n * (scale < 10 ? scale : 10)) + 1;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void run(const Corpus &corpus, double min_time, const char *filter,
+                std::vector<Result> &results) {
+  const std::vector<std::string> &lines = corpus.lines;
+  size_t count = lines.size();
+  double tokens = 0;
+  double bytes = 0;
+  for (auto &line : lines) {
+    tokens += expr::lexer(line).size();
+    bytes += line.size();
+  }
+  tokens /= count;
+  bytes /= count;
+
+  auto selected = [&](const std::string &name) {
+    return !filter || name.find(filter) != std::string::npos;
+  };
+  auto add = [&](Result result, double items) {
+    result.items = items;
+    result.bytes = bytes;
+    results.push_back(result);
+  };
+  std::string suffix = std::string("/") + corpus.name;
+
+  if (selected("lexer" + suffix)) {
+    add(measure("lexer" + suffix, min_time,
+                [&](size_t i) {
+                  sink = static_cast<int>(expr::lexer(lines[i % count]).size());
+                }),
+        tokens);
+  }
+  if (selected("parser" + suffix)) {
+    add(measure("parser" + suffix, min_time,
+                [&](size_t i) {
+                  sink = expr::parser(lines[i % count])->type;
+                }),
+        tokens);
+  }
+
+  std::vector<std::unique_ptr<expr::ExprAST>> asts;
+  std::vector<std::unique_ptr<expr::Program>> progs;
+  for (auto &line : lines) {
+    asts.push_back(expr::parser(line));
+    progs.push_back(expr::compile(*asts.back()));
+  }
+  expr::SymbolTable symbols;
+  for (auto &ast : asts) { // create and initialize every symbol
+    for (int id : expr::references(*ast).reads) {
+      symbols.ref(id) = id % 13 + 1;
+    }
+  }
+
+  if (selected("eval" + suffix)) {
+    add(measure("eval" + suffix, min_time,
+                [&](size_t i) { sink = asts[i % count]->eval(symbols); }),
+        0);
+  }
+  if (selected("optimized" + suffix)) {
+    std::vector<std::unique_ptr<expr::ExprAST>> optimized;
+    for (auto &line : lines) {
+      optimized.push_back(expr::parser(line));
+      expr::optimize(optimized.back());
+      expr::prepare(*optimized.back(), symbols);
+    }
+    add(measure("optimized" + suffix, min_time,
+                [&](size_t i) { sink = optimized[i % count]->eval(symbols); }),
+        0);
+  }
+  if (selected("adaptive" + suffix)) {
+    std::vector<std::unique_ptr<expr::ExprAST>> adaptive;
+    for (auto &line : lines) {
+      adaptive.push_back(expr::parser(line));
+      expr::optimize(adaptive.back());
+      expr::adapt(adaptive.back());
+    }
+    add(measure("adaptive" + suffix, min_time,
+                [&](size_t i) { sink = adaptive[i % count]->eval(symbols); }),
+        0);
+  }
+  if (selected("program" + suffix)) {
+    add(measure("program" + suffix, min_time,
+                [&](size_t i) { sink = progs[i % count]->eval(symbols); }),
+        0);
+  }
+
+  // the same with overflow checks (no corpus line overflows)
+  if (selected("eval_checked" + suffix)) {
+    expr::Checked scope(true);
+    add(measure("eval_checked" + suffix, min_time,
+                [&](size_t i) { sink = asts[i % count]->eval(symbols); }),
+        0);
+  }
+  if (selected("program_checked" + suffix)) {
+    for (auto &prog : progs) {
+      prog->set_checked(true);
+    }
+    add(measure("program_checked" + suffix, min_time,
+                [&](size_t i) { sink = progs[i % count]->eval(symbols); }),
+        0);
+    for (auto &prog : progs) {
+      prog->set_checked(false);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// trace : one operation scans a block of 6-byte records
+// (flags u1, delta s1, value 4) with each condition, one record at a time
+// ("records"), by columns of 32-bit lanes ("lanes32") and by columns of the
+// narrowest lanes ("lanes")
+static void run_trace(double min_time, const char *filter,
+                      std::vector<Result> &results) {
+  static const char *conditions[] = {
+      "((value >> 8) & 0xFF) == 3",
+      "(flags & 0x80) && delta < -3",
+      "((flags >> 4) ^ (flags & 15)) + delta * 2 > 20",
+  };
+  const size_t records = 1 << 12;
+  auto layout = expr::parse_layout("flags=0:1,delta=1:s1,value=2:4");
+  std::vector<char> data(records * layout.record_size);
+  uint32_t x = 2463534242u;
+  for (auto &c : data) {
+    x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+    c = static_cast<char>(x);
+  }
+  std::vector<uint64_t> matches;
+  for (int lanes : {0, 32, 8}) {
+    std::string name = lanes == 0 ? "trace/records"
+                       : lanes == 32 ? "trace/lanes32"
+                                     : "trace/lanes";
+    if (filter && name.find(filter) == std::string::npos) {
+      continue;
+    }
+    std::vector<std::unique_ptr<expr::TraceFilter>> filters;
+    for (auto cond : conditions) {
+      filters.emplace_back(new expr::TraceFilter(layout, cond, lanes));
+    }
+    Result r = measure(name, min_time, [&](size_t i) {
+      matches.clear();
+      filters[i % filters.size()]->scan(data.data(), 0, records, matches);
+      sink = static_cast<int>(matches.size());
+    });
+    r.items = records;
+    r.bytes = static_cast<double>(data.size());
+    results.push_back(r);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [--filter STR] [--min-time SEC] [-o FILE]\n",
+          name);
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
+  const char *filter = nullptr;
+  const char *output = nullptr;
+  double min_time = 0.2;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+      min_time = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<Result> results;
+  for (auto &corpus : corpora()) {
+    run(corpus, min_time, filter, results);
+  }
+  run_trace(min_time, filter, results);
+
+  FILE *fp = output ? fopen(output, "w") : stdout;
+  if (!fp) {
+    perror(output);
+    return 1;
+  }
+  fprintf(fp, "{\n  \"context\": {\n");
+#ifdef __VERSION__
+  fprintf(fp, "    \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+#ifdef DEBUG
+  fprintf(fp, "    \"build\": \"debug\",\n");
+#else
+  fprintf(fp, "    \"build\": \"release\",\n");
+#endif
+  fprintf(fp, "    \"min_time\": %g\n  },\n  \"benchmarks\": [", min_time);
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    double ops = r.iterations / r.seconds;
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"iterations\": %zu, ",
+            i ? "," : "", r.name.c_str(), r.iterations);
+    fprintf(fp, "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f",
+            r.seconds * 1e9 / r.iterations, ops);
+    if (r.items > 0) {
+      fprintf(fp, ", \"tokens_per_sec\": %.0f, \"bytes_per_sec\": %.0f",
+              ops * r.items, ops * r.bytes);
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  if (fp != stdout) {
+    fclose(fp);
+  }
+  return 0;
+}
@@ -0,0 +1,145 @@
+#include "aggregate.h"
+#include "expr.h"
+#include <algorithm>
+#include <limits.h>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+AggregateQuery parse_aggregate(const std::string &src) {
+    static const struct {
+        const char *name;
+        AggregateKind kind;
+    } functions[] = {
+        {"count", AGG_COUNT}, {"sum", AGG_SUM}, {"min", AGG_MIN},
+        {"max", AGG_MAX},     {"hist", AGG_HIST},
+    };
+    size_t begin = src.find_first_not_of(" \t");
+    size_t end = src.find_last_not_of(" \t");
+    size_t paren = src.find('(');
+    if (begin == std::string::npos || paren == std::string::npos ||
+        src[end] != ')') {
+        throw expr_error("expected count(), sum(), min(), max() or hist()");
+    }
+    std::string name = src.substr(begin, paren - begin);
+    name.erase(name.find_last_not_of(" \t") + 1);
+
+    // the parenthesis after the name must close at the end
+    int depth = 0;
+    for (size_t i = paren; i < end; i++) {
+        depth += src[i] == '(' ? 1 : src[i] == ')' ? -1 : 0;
+        if (depth == 0) {
+            throw expr_error("an aggregate must enclose the whole expression");
+        }
+    }
+    for (auto &f : functions) {
+        if (name == f.name) {
+            return AggregateQuery{f.kind,
+                                  src.substr(paren + 1, end - paren - 1)};
+        }
+    }
+    throw expr_error("unknown aggregate '" + name + "'");
+}
+
+//=============================================================================
+// Accumulator
+
+//-----------------------------------------------------------------------------
+Accumulator::Accumulator(AggregateKind kind)
+    : k(kind), n(0), total(0), lo(INT_MAX), hi(INT_MIN) {
+    if (k == AGG_HIST) {
+        dense.assign(HIST_DENSE, 0);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// add - one loop per kind, without branches in the loop body except for
+// hist, so that the compiler vectorizes them. n is at most a block, so the
+// per-call count and sum cannot overflow their types.
+void Accumulator::add(const int *values, size_t count) {
+    n += count;
+    switch (k) {
+    case AGG_COUNT: {
+        uint32_t c = 0;
+        for (size_t i = 0; i < count; i++) {
+            c += values[i] != 0;
+        }
+        total += c;
+        break;
+    }
+    case AGG_SUM: {
+        int64_t s = 0;
+        for (size_t i = 0; i < count; i++) {
+            s += values[i];
+        }
+        total += static_cast<uint64_t>(s);
+        break;
+    }
+    case AGG_MIN: {
+        int m = lo;
+        for (size_t i = 0; i < count; i++) {
+            m = std::min(m, values[i]);
+        }
+        lo = m;
+        break;
+    }
+    case AGG_MAX: {
+        int m = hi;
+        for (size_t i = 0; i < count; i++) {
+            m = std::max(m, values[i]);
+        }
+        hi = m;
+        break;
+    }
+    case AGG_HIST:
+        for (size_t i = 0; i < count; i++) {
+            uint32_t v = static_cast<uint32_t>(values[i]);
+            if (v < HIST_DENSE) {
+                dense[v]++;
+            } else {
+                sparse[values[i]]++;
+            }
+        }
+        break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+void Accumulator::merge(const Accumulator &other) {
+    n += other.n;
+    total += other.total;
+    lo = std::min(lo, other.lo);
+    hi = std::max(hi, other.hi);
+    for (size_t i = 0; i < dense.size() && i < other.dense.size(); i++) {
+        dense[i] += other.dense[i];
+    }
+    for (auto &itr : other.sparse) {
+        sparse[itr.first] += itr.second;
+    }
+}
+
+//-----------------------------------------------------------------------------
+int64_t Accumulator::value() const {
+    switch (k) {
+    case AGG_MIN:
+        return n ? lo : 0;
+    case AGG_MAX:
+        return n ? hi : 0;
+    default:
+        return static_cast<int64_t>(total);
+    }
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::pair<int, uint64_t>> Accumulator::histogram() const {
+    std::vector<std::pair<int, uint64_t>> result(sparse.begin(), sparse.end());
+    for (size_t v = 0; v < dense.size(); v++) {
+        if (dense[v]) {
+            result.emplace_back(static_cast<int>(v), dense[v]);
+        }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+} // namespace expr
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "parallel.h"
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace expr {
+
+//=============================================================================
+// aggregate - reduce the values of an expression over a set of records.
+//   count(e)  number of records where e != 0
+//   sum(e)    sum of e as a 64-bit integer (wraps around modulo 2^64)
+//   min(e)    smallest value of e (0 if there are no records)
+//   max(e)    largest value of e (0 if there are no records)
+//   hist(e)   number of records for each value of e
+// Records are evaluated in blocks into an int array, and each block is
+// folded into the accumulator of its worker with plain loops over that
+// array, which the compiler turns into SIMD code. The partial results are
+// merged in worker order at the end.
+
+enum AggregateKind { AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_HIST };
+
+struct AggregateQuery {
+    AggregateKind kind;
+    std::string expression; // argument of the function
+};
+
+// split "max(r1 - r2)" into function and argument (expr_error if src is not
+// one aggregate function applied to the whole expression)
+AggregateQuery parse_aggregate(const std::string &src);
+
+enum {
+    AGGREGATE_BLOCK = 4096, // records evaluated at a time
+    HIST_DENSE = 256,       // hist values [0, HIST_DENSE) use an array
+};
+
+//-----------------------------------------------------------------------------
+// Accumulator - partial result of an aggregate
+class Accumulator {
+  public:
+    explicit Accumulator(AggregateKind kind);
+
+    void add(const int *values, size_t n);
+    void merge(const Accumulator &other);
+
+    AggregateKind kind() const { return k; }
+    uint64_t records() const { return n; }
+    // count, sum, min or max
+    int64_t value() const;
+    // hist : (value, records) sorted by value
+    std::vector<std::pair<int, uint64_t>> histogram() const;
+
+  private:
+    AggregateKind k;
+    uint64_t n;
+    uint64_t total; // count or sum, modulo 2^64
+    int lo, hi;
+    std::vector<uint64_t> dense;
+    std::unordered_map<int, uint64_t> sparse;
+};
+
+//-----------------------------------------------------------------------------
+// reduce - aggregate records [0, count) on workers.
+// eval(begin, end, values) stores the value of records [begin, end) to
+// values[0, end - begin); it is called from several threads at once.
+template <class Eval>
+Accumulator reduce(AggregateKind kind, uint64_t count, size_t workers,
+                   Eval eval) {
+    workers = std::max<size_t>(1, std::min<uint64_t>(workers, count));
+    std::vector<Accumulator> parts(workers, Accumulator(kind));
+    parallel_for(count, workers, [&](size_t begin, size_t end, size_t w) {
+        std::vector<int> values(AGGREGATE_BLOCK);
+        for (uint64_t i = begin; i < end; i += AGGREGATE_BLOCK) {
+            uint64_t last = std::min<uint64_t>(end, i + AGGREGATE_BLOCK);
+            eval(i, last, values.data());
+            parts[w].add(values.data(), static_cast<size_t>(last - i));
+        }
+    });
+    for (size_t w = 1; w < workers; w++) {
+        parts[0].merge(parts[w]);
+    }
+    return parts[0];
+}
+
+} // namespace expr
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "expr.h"
+#include <limits.h>
+#include <stdint.h>
+
+namespace expr {
+
+//=============================================================================
+// arithmetic of + - * / % << >> and unary -
+// Every result is defined: + - * << and unary - wrap around at 32 bits, a
+// shift amount is taken modulo 32 (as x86 does), and INT_MIN / -1 is
+// INT_MIN. Division and remainder by zero fail with expr_error.
+// Checked evaluation is an option of whatever evaluates: with it, a result
+// that wraps around or a shift amount outside [0, 31] fails with expr_error
+// as well, e.g.
+//   "overflow in 'x * y' (65536 * 65536)"
+// The tests are the compiler's overflow intrinsics, one branch per
+// operation that is not taken; the error is built out of line. Program
+// runs a variant of its loop without them unless it is checked.
+
+//-----------------------------------------------------------------------------
+// Checked - checked evaluation of trees (ExprAST::eval) on this thread while
+// an instance made with on is alive; off by default:
+//   Checked scope(true);
+//   ast->eval(symbols);
+// Program, BlockEval and TraceFilter carry the option themselves (see
+// Program::set_checked), as do adapt() and specialize(), which decide by it
+// what may fail.
+class Checked {
+  public:
+    explicit Checked(bool on) : saved(current) { current = on; }
+    ~Checked() { current = saved; }
+    Checked(const Checked &) = delete;
+    Checked &operator=(const Checked &) = delete;
+
+    static bool on() { return current; }
+
+  private:
+    bool saved;
+    static thread_local bool current;
+};
+
+// throw expr_error for op on a and b (a only for unary -). node is the node
+// being evaluated, named in the message; nullptr if there is none (e.g. in
+// bytecode).
+[[noreturn]] void overflow(Type op, int a, int b, ExprAST *node);
+[[noreturn]] void division_by_zero(ExprAST *node);
+
+// a op b wrapped around; true if the exact result differs
+inline bool add_overflow(int a, int b, int *r) {
+#if defined(_MSC_VER)
+    int64_t v = int64_t(a) + b;
+    *r = static_cast<int>(v);
+    return v != *r;
+#else
+    return __builtin_add_overflow(a, b, r);
+#endif
+}
+
+inline bool sub_overflow(int a, int b, int *r) {
+#if defined(_MSC_VER)
+    int64_t v = int64_t(a) - b;
+    *r = static_cast<int>(v);
+    return v != *r;
+#else
+    return __builtin_sub_overflow(a, b, r);
+#endif
+}
+
+inline bool mul_overflow(int a, int b, int *r) {
+#if defined(_MSC_VER)
+    int64_t v = int64_t(a) * b;
+    *r = static_cast<int>(v);
+    return v != *r;
+#else
+    return __builtin_mul_overflow(a, b, r);
+#endif
+}
+
+// also true for an amount outside [0, 31]
+inline bool shl_overflow(int a, int b, int *r) {
+    int s = b & 31;
+    *r = static_cast<int>(static_cast<uint32_t>(a) << s);
+    return s != b || (*r >> s) != a;
+}
+
+//-----------------------------------------------------------------------------
+// exact - *r = a op b for op ADD, SUB, MUL, DIV, MOD, SFTL or SFTR, and -a
+// for MINUS (b unused), wrapped around. false if that is not the exact
+// result or the shift amount is outside [0, 31]. node names the operation in
+// errors.
+inline bool exact(Type op, int a, int b, int *r, ExprAST *node) {
+    switch (op) {
+    case ADD:
+        return !add_overflow(a, b, r);
+    case SUB:
+        return !sub_overflow(a, b, r);
+    case MUL:
+        return !mul_overflow(a, b, r);
+    case MINUS:
+        return !sub_overflow(0, a, r);
+    case DIV:
+    case MOD:
+        if (b == 0) {
+            division_by_zero(node);
+        }
+        if (b == -1) { // INT_MIN / -1 traps on x86
+            *r = op == DIV ? static_cast<int>(0u - static_cast<uint32_t>(a))
+                           : 0;
+            return op == MOD || a != INT_MIN;
+        }
+        *r = op == DIV ? a / b : a % b;
+        return true;
+    case SFTL:
+        return !shl_overflow(a, b, r);
+    case SFTR:
+        *r = a >> (b & 31);
+        return (b & 31) == b;
+    default:
+        throw expr_error("unknown operator");
+    }
+}
+
+// arith_wrap - the same, only division by zero fails. Plain instructions
+// for everything else.
+inline int arith_wrap(Type op, int a, int b, ExprAST *node = nullptr) {
+    uint32_t ua = static_cast<uint32_t>(a), ub = static_cast<uint32_t>(b);
+    switch (op) {
+    case ADD:
+        return static_cast<int>(ua + ub);
+    case SUB:
+        return static_cast<int>(ua - ub);
+    case MUL:
+        return static_cast<int>(ua * ub);
+    case MINUS:
+        return static_cast<int>(0u - ua);
+    case SFTL:
+        return static_cast<int>(ua << (b & 31));
+    case SFTR:
+        return a >> (b & 31);
+    default: {
+        int r;
+        exact(op, a, b, &r, node);
+        return r;
+    }
+    }
+}
+
+// arith_check - the same, and anything but the exact result fails
+inline int arith_check(Type op, int a, int b, ExprAST *node = nullptr) {
+    int r;
+    if (!exact(op, a, b, &r, node)) {
+        overflow(op, a, b, node);
+    }
+    return r;
+}
+
+// arith - arith_check or arith_wrap as chosen by Checked::on(). The test is
+// made on every operation and the option is read only when it fires, for
+// callers that cannot pick a variant up front (the tree evaluators);
+// Program picks one per evaluation with arith<Checked>.
+inline int arith(Type op, int a, int b, ExprAST *node = nullptr) {
+    int r;
+    if (!exact(op, a, b, &r, node) && Checked::on()) {
+        overflow(op, a, b, node);
+    }
+    return r;
+}
+
+template <bool Checked>
+inline int arith(Type op, int a, int b, ExprAST *node = nullptr) {
+    return Checked ? arith_check(op, a, b, node) : arith_wrap(op, a, b, node);
+}
+
+//-----------------------------------------------------------------------------
+// Divisor - signed 32bit division by an invariant d as a multiplication.
+// With l = ceil(log2 |d|) and magic = ceil(2^(32+l) / |d|),
+// |n| / |d| = (|n| * magic) >> (32 + l) for every |n| < 2^32
+// (Granlund, Montgomery: "Division by Invariant Integers using
+// Multiplication"); since |n| <= 2^31 the product fits in 64 bits.
+// The signs are applied afterwards, so the results truncate toward zero like
+// / and %. |d| < 2 has no magic number and is divided by the hardware.
+struct Divisor {
+    int d;
+    uint32_t abs;
+    uint64_t magic; // 0 : hardware division
+    int shift;
+
+    explicit Divisor(int d = 0) : d(d), abs(abs_of(d)), magic(0), shift(0) {
+        if (abs > 1) {
+            int l = 0;
+            while ((uint64_t(1) << l) < abs) {
+                l++;
+            }
+            shift = 32 + l;
+            magic = ((uint64_t(1) << shift) + abs - 1) / abs;
+        }
+    }
+
+    int div(int n) const {
+        if (!magic) {
+            return n / d;
+        }
+        uint32_t q = quotient(abs_of(n));
+        return (n ^ d) < 0 ? -static_cast<int>(q) : static_cast<int>(q);
+    }
+    int mod(int n) const {
+        if (!magic) {
+            return n % d;
+        }
+        uint32_t an = abs_of(n);
+        uint32_t r = an - quotient(an) * abs;
+        return n < 0 ? -static_cast<int>(r) : static_cast<int>(r);
+    }
+
+  private:
+    static uint32_t abs_of(int n) {
+        return n < 0 ? 0u - static_cast<uint32_t>(n) : n;
+    }
+    uint32_t quotient(uint32_t an) const {
+        return static_cast<uint32_t>((an * magic) >> shift);
+    }
+};
+
+// divide - n / d for op DIV, n % d for MOD: by the magic number of divisor
+// while d is divisor.d, otherwise by arith<Checked>
+template <bool Checked>
+inline int divide(Type op, int n, int d, const Divisor &divisor) {
+    if (d != divisor.d || !divisor.magic) {
+        return arith<Checked>(op, n, d);
+    }
+    return op == DIV ? divisor.div(n) : divisor.mod(n);
+}
+
+//-----------------------------------------------------------------------------
+// operator of a compound assignment (ADD for ASSIGN_ADD), INVALID for the
+// others
+inline Type assign_op(Type type) {
+    switch (type) {
+    case ASSIGN_SL:
+        return SFTL;
+    case ASSIGN_SR:
+        return SFTR;
+    case ASSIGN_ADD:
+        return ADD;
+    case ASSIGN_SUB:
+        return SUB;
+    case ASSIGN_MUL:
+        return MUL;
+    case ASSIGN_DIV:
+        return DIV;
+    case ASSIGN_MOD:
+        return MOD;
+    default:
+        return INVALID;
+    }
+}
+
+} // namespace expr
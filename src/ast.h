@@ -0,0 +1,469 @@
+#pragma once
+
+#include "arith.h"
+#include "bitops.h"
+#include "expr.h"
+#include "macro.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// AST node classes shared by the parser and the passes over the tree.
+// Each node class has its own set of node types, so a pass can switch on
+// ExprAST::type and static_cast to the node class.
+//   IMM            : IntegerExprAST
+//   VAR            : VariableExprAST
+//   REG            : RegisterExprAST
+//   PLUS .. NOT    : UnaryExprAST
+//   BINOP_BIGIN .. : BinaryExprAST (DIVM, MODM : DivideExprAST,
+//                    LAND, LOR : maybe AdaptiveExprAST)
+//   QUESTION       : ConditionalExprAST
+//   ASSIGN_BIGIN ..: AssignExprAST
+//   CALL_BIGIN ..  : CallExprAST
+
+namespace expr {
+
+//=============================================================================
+// AST (Abstract Syntax Tree)
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+// IntegerExprAST - Expression class for integer literals like "1".
+// IntegerExprAST - "1"のような整数数値リテラルのための式クラス。
+class IntegerExprAST : public ExprAST {
+  public:
+    const int Val;
+    explicit IntegerExprAST(int val) : ExprAST(IMM), Val(val) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        UNUSED(fp);
+        return Val;
+    }
+    int eval(SymbolTable &symbols) override {
+        UNUSED(symbols);
+        return Val;
+    }
+};
+
+//-----------------------------------------------------------------------------
+// VariableExprAST - Expression class for referencing a variable, like "a".
+// VariableExprAST - "a"のような変数を参照するための式クラス。
+// The name is not copied into the node; it refers to the interned string.
+class VariableExprAST : public ExprAST {
+  public:
+    const int Id;
+    const std::string &Name;
+    explicit VariableExprAST(int id)
+        : ExprAST(VAR), Id(id), Name(interner().name(id)) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        return fp ? fp(Name) : 0;
+    }
+    int eval(SymbolTable &symbols) override { return symbols.cref(Id); }
+
+    int *ref(std::function<int &(const std::string &)> &fp) {
+        return fp ? &fp(Name) : nullptr;
+    }
+    int *ref(SymbolTable &symbols) { return &symbols.ref(Id); }
+};
+
+//-----------------------------------------------------------------------------
+// RegisterExprAST - Expression class for a register operand, like "%r12".
+// Bank letter and index are decoded at parse time. Once bound to a host
+// register file (see expr::bind), eval reads the register directly;
+// until then it resolves the name like a variable.
+class RegisterExprAST : public ExprAST {
+  public:
+    const int Id;
+    const std::string &Name;
+    const char Bank;
+    const size_t Index;
+    int *Reg; // bound register, nullptr if unbound
+    RegisterExprAST(int id, char bank, size_t index)
+        : ExprAST(REG), Id(id), Name(interner().name(id)), Bank(bank),
+          Index(index), Reg(nullptr) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        return Reg ? *Reg : fp ? fp(Name) : 0;
+    }
+    int eval(SymbolTable &symbols) override {
+        return Reg ? *Reg : symbols.cref(Id);
+    }
+
+    int *ref(std::function<int &(const std::string &)> &fp) {
+        return Reg ? Reg : fp ? &fp(Name) : nullptr;
+    }
+    int *ref(SymbolTable &symbols) { return Reg ? Reg : &symbols.ref(Id); }
+};
+
+//-----------------------------------------------------------------------------
+// UnaryExprAST - Expression class for a unary operator.
+class UnaryExprAST : public ExprAST {
+  public:
+    std::unique_ptr<ExprAST> rhs;
+
+    UnaryExprAST(Type type, std::unique_ptr<ExprAST> rhs)
+        : ExprAST(type), rhs(std::move(rhs)) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        return eval_(fp);
+    }
+    int eval(SymbolTable &symbols) override { return eval_(symbols); }
+
+  private:
+    template <class Env> int eval_(Env &fp) {
+        switch (type) {
+        case (PLUS):
+            return +rhs->eval(fp);
+        case (MINUS):
+            return arith(MINUS, rhs->eval(fp), 0, this);
+        case (INV):
+            return ~rhs->eval(fp);
+        case (NOT):
+            return !rhs->eval(fp);
+        default:
+            throw expr_error("unknown operator");
+        }
+        return 0;
+    }
+};
+
+//-----------------------------------------------------------------------------
+// BinaryExprAST - Expression class for a binary operator.
+// BinaryExprAST - 二項演算子のための式クラス。
+class BinaryExprAST : public ExprAST {
+  public:
+    std::unique_ptr<ExprAST> lhs, rhs;
+
+    BinaryExprAST(Type type, std::unique_ptr<ExprAST> lhs,
+                  std::unique_ptr<ExprAST> rhs)
+        : ExprAST(type), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        return eval_(fp);
+    }
+    int eval(SymbolTable &symbols) override { return eval_(symbols); }
+
+  private:
+    template <class Env> int eval_(Env &fp) {
+        switch (type) {
+        case (ADD):
+            return arith_<ADD>(fp);
+        case (SUB):
+            return arith_<SUB>(fp);
+        case (MUL):
+            return arith_<MUL>(fp);
+        case (DIV):
+            return arith_<DIV>(fp);
+        case (MOD):
+            return arith_<MOD>(fp);
+        case (AND):
+            return lhs->eval(fp) & rhs->eval(fp);
+        case (OR):
+            return lhs->eval(fp) | rhs->eval(fp);
+        case (XOR):
+            return lhs->eval(fp) ^ rhs->eval(fp);
+        case (LAND):
+            return lhs->eval(fp) && rhs->eval(fp);
+        case (LOR):
+            return lhs->eval(fp) || rhs->eval(fp);
+        case (SFTL):
+            return arith_<SFTL>(fp);
+        case (SFTR):
+            return arith_<SFTR>(fp);
+        case (EQ):
+            return lhs->eval(fp) == rhs->eval(fp);
+        case (NE):
+            return lhs->eval(fp) != rhs->eval(fp);
+        case (LT):
+            return lhs->eval(fp) < rhs->eval(fp);
+        case (LE):
+            return lhs->eval(fp) <= rhs->eval(fp);
+        case (GT):
+            return lhs->eval(fp) > rhs->eval(fp);
+        case (GE):
+            return lhs->eval(fp) >= rhs->eval(fp);
+        default:
+            throw expr_error("unknown operator");
+        }
+        return 0;
+    };
+    // op as a constant, so that arith() inlines to its case
+    template <Type op, class Env> int arith_(Env &fp) {
+        int a = lhs->eval(fp);
+        return arith(op, a, rhs->eval(fp), this);
+    }
+};
+
+//-----------------------------------------------------------------------------
+// DivideExprAST - "/" and "%" by an invariant divisor (see expr::optimize).
+// rhs is a literal or a symbol. While it evaluates to divisor.d the
+// division is done by multiplications, otherwise (and for |d| < 2) by
+// arith(), which checks for division by zero.
+class DivideExprAST : public BinaryExprAST {
+  public:
+    Divisor divisor;
+
+    DivideExprAST(Type type, std::unique_ptr<ExprAST> lhs,
+                  std::unique_ptr<ExprAST> rhs, Divisor divisor)
+        : BinaryExprAST(type, std::move(lhs), std::move(rhs)),
+          divisor(divisor) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        int n = lhs->eval(fp);
+        return apply(n, rhs->type == IMM ? divisor.d : rhs->eval(fp));
+    }
+    int eval(SymbolTable &symbols) override {
+        int n = lhs->eval(symbols);
+        return apply(n, rhs->type == IMM ? divisor.d : rhs->eval(symbols));
+    }
+
+    int apply(int n, int d) {
+        if (d != divisor.d || !divisor.magic) {
+            return arith(type == DIVM ? DIV : MOD, n, d, this);
+        }
+        return type == DIVM ? divisor.div(n) : divisor.mod(n);
+    }
+};
+
+//-----------------------------------------------------------------------------
+// AdaptiveExprAST - "&&" / "||" chain that reorders its operands by their
+// observed cost and selectivity (see expr::adapt).
+// lhs / rhs keep the chain as written, so the passes over the tree see an
+// ordinary LAND / LOR node; eval runs the operands in the order packed in
+// `packed`, 4 bits per position. The order is replaced as a whole, so
+// concurrent evaluations always run a complete permutation.
+// About one evaluation in SAMPLE_PERIOD (per thread) is sampled: it times
+// every operand up to the next barrier, also those after the deciding one,
+// and counts how often each would decide the result. Every REORDER_PERIOD
+// samples each run of operands between barriers is sorted by cycles per
+// decision, and the counters are halved to follow changing data.
+// A barrier operand (one that assigns or may fail) never moves and no
+// operand moves across it, so "d != 0 && x / d > 2" keeps its guard.
+class AdaptiveExprAST : public BinaryExprAST {
+  public:
+    enum { OPERANDS_MAX = 16, SAMPLE_PERIOD = 64, REORDER_PERIOD = 32 };
+    struct Operand {
+        std::unique_ptr<ExprAST> *slot = nullptr; // in the chain below
+        bool barrier = true;
+        std::atomic<uint64_t> decisions{0};
+        std::atomic<uint64_t> cycles{0};
+    };
+
+    // the operands are the chain of type below lhs and rhs, from left to
+    // right, at most OPERANDS_MAX (a longer chain ends in a LAND / LOR
+    // operand); all are barriers until the caller says otherwise
+    AdaptiveExprAST(Type type, std::unique_ptr<ExprAST> lhs,
+                    std::unique_ptr<ExprAST> rhs);
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        return sample_now() ? sample(fp) : eval_(fp);
+    }
+    int eval(SymbolTable &symbols) override {
+        return sample_now() ? sample(symbols) : eval_(symbols);
+    }
+
+    size_t size() const { return count; }
+    Operand &operand(size_t i) { return operands[i]; }
+    // operand indices in evaluation order
+    std::vector<size_t> order() const;
+
+  private:
+    std::unique_ptr<Operand[]> operands;
+    size_t count;
+    std::atomic<uint64_t> packed;  // operand index of position i at bit 4i
+    std::atomic<uint64_t> samples; // since construction
+    std::mutex reordering;
+
+    template <class Env> int eval_(Env &fp) {
+        bool stop = type == LOR; // value that decides the chain
+        uint64_t ord = packed.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; i++, ord >>= 4) {
+            if ((operands[ord & 15].slot->get()->eval(fp) != 0) == stop) {
+                return stop;
+            }
+        }
+        return !stop;
+    }
+    static bool sample_now() {
+        static thread_local uint32_t x = 2463534242u; // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return (x & (SAMPLE_PERIOD - 1)) == 0;
+    }
+    int sample(std::function<int &(const std::string &)> &fp);
+    int sample(SymbolTable &symbols);
+    template <class Env> int sample_(Env &fp);
+    void reorder();
+};
+
+//-----------------------------------------------------------------------------
+// ConditionalExprAST - Expression class for a conditinal operator.
+class ConditionalExprAST : public ExprAST {
+  public:
+    std::unique_ptr<ExprAST> cond, lhs, rhs;
+
+    ConditionalExprAST(std::unique_ptr<ExprAST> cond,
+                       std::unique_ptr<ExprAST> lhs,
+                       std::unique_ptr<ExprAST> rhs)
+        : ExprAST(QUESTION), cond(std::move(cond)), lhs(std::move(lhs)),
+          rhs(std::move(rhs)) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        return cond->eval(fp) ? lhs->eval(fp) : rhs->eval(fp);
+    };
+    int eval(SymbolTable &symbols) override {
+        return cond->eval(symbols) ? lhs->eval(symbols) : rhs->eval(symbols);
+    };
+};
+
+//-----------------------------------------------------------------------------
+// AssignExprAST
+class AssignExprAST : public ExprAST {
+  public:
+    std::unique_ptr<ExprAST> lhs, rhs;
+
+    AssignExprAST(Type type, std::unique_ptr<ExprAST> lhs,
+                  std::unique_ptr<ExprAST> rhs)
+        : ExprAST(type), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        return eval_(fp);
+    };
+    int eval(SymbolTable &symbols) override { return eval_(symbols); };
+
+  private:
+    template <class Env> int eval_(Env &fp) {
+        int *lhs_ref;
+        if (lhs->type == VAR) {
+            lhs_ref = static_cast<VariableExprAST *>(lhs.get())->ref(fp);
+        } else if (lhs->type == REG) {
+            lhs_ref = static_cast<RegisterExprAST *>(lhs.get())->ref(fp);
+        } else {
+            throw expr_error("cannot assign to except for variables");
+        }
+        if (!lhs_ref) {
+            return 0;
+        }
+
+        if (type == ASSIGN) {
+            return *lhs_ref = rhs->eval(fp);
+        }
+        int rhs_val = rhs->eval(fp); // before *lhs_ref is read, as in "+="
+        switch (type) {
+        case (ASSIGN_OR):
+            return *lhs_ref |= rhs_val;
+        case (ASSIGN_XOR):
+            return *lhs_ref ^= rhs_val;
+        case (ASSIGN_AND):
+            return *lhs_ref &= rhs_val;
+        case (ASSIGN_SL):
+            return *lhs_ref = arith(SFTL, *lhs_ref, rhs_val, this);
+        case (ASSIGN_SR):
+            return *lhs_ref = arith(SFTR, *lhs_ref, rhs_val, this);
+        case (ASSIGN_ADD):
+            return *lhs_ref = arith(ADD, *lhs_ref, rhs_val, this);
+        case (ASSIGN_SUB):
+            return *lhs_ref = arith(SUB, *lhs_ref, rhs_val, this);
+        case (ASSIGN_MUL):
+            return *lhs_ref = arith(MUL, *lhs_ref, rhs_val, this);
+        case (ASSIGN_DIV):
+            return *lhs_ref = arith(DIV, *lhs_ref, rhs_val, this);
+        case (ASSIGN_MOD):
+            return *lhs_ref = arith(MOD, *lhs_ref, rhs_val, this);
+        default:
+            throw expr_error("unknown operator");
+        }
+        return 0;
+    };
+};
+
+//-----------------------------------------------------------------------------
+// builtin functions
+struct Builtin {
+    Type type;
+    const char *name;
+    int arity; // number of arguments (at most BUILTIN_ARGS)
+};
+enum { BUILTIN_ARGS = 4 };
+
+// builtin of a node type / of a name, nullptr if there is none
+const Builtin *builtin(Type type);
+const Builtin *builtin(const char *name, size_t len);
+
+// call - builtin type applied to args (expr_error if a bit range is invalid)
+inline int call(Type type, const int *args) {
+    switch (type) {
+    case (POPCNT):
+        return popcnt(args[0]);
+    case (CLZ):
+        return clz(args[0]);
+    case (CTZ):
+        return ctz(args[0]);
+    case (BSWAP):
+        return bswap(args[0]);
+    case (BITS):
+        if (!bit_range(args[1], args[2])) {
+            throw expr_error("invalid bit range");
+        }
+        return bits(args[0], args[1], args[2]);
+    case (SETBITS):
+        if (!bit_range(args[1], args[2])) {
+            throw expr_error("invalid bit range");
+        }
+        return setbits(args[0], args[1], args[2], args[3]);
+    default:
+        throw expr_error("unknown operator");
+    }
+}
+
+//-----------------------------------------------------------------------------
+// CallExprAST - Expression class for a builtin function call, like
+// "bits(x, 7, 4)". The arguments are evaluated from left to right.
+class CallExprAST : public ExprAST {
+  public:
+    std::vector<std::unique_ptr<ExprAST>> args;
+
+    CallExprAST(Type type, std::vector<std::unique_ptr<ExprAST>> args)
+        : ExprAST(type), args(std::move(args)) {}
+    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
+        return eval_(fp);
+    }
+    int eval(SymbolTable &symbols) override { return eval_(symbols); }
+
+  private:
+    template <class Env> int eval_(Env &fp) {
+        int values[BUILTIN_ARGS];
+        for (size_t i = 0; i < args.size(); i++) {
+            values[i] = args[i]->eval(fp);
+        }
+        return call(type, values);
+    }
+};
+
+//=============================================================================
+// tree walk
+
+//-----------------------------------------------------------------------------
+// for_each_child - call fn(std::unique_ptr<ExprAST> &) for each child of ast
+// in evaluation order. fn may replace the child it is given.
+template <class F> void for_each_child(ExprAST &ast, F fn) {
+    if (ast.type == PLUS || ast.type == MINUS || ast.type == INV ||
+        ast.type == NOT) {
+        fn(static_cast<UnaryExprAST &>(ast).rhs);
+    } else if (BINOP_BIGIN < ast.type && ast.type < BINOP_END) {
+        auto &node = static_cast<BinaryExprAST &>(ast);
+        fn(node.lhs);
+        fn(node.rhs);
+    } else if (ast.type == QUESTION) {
+        auto &node = static_cast<ConditionalExprAST &>(ast);
+        fn(node.cond);
+        fn(node.lhs);
+        fn(node.rhs);
+    } else if (ASSIGN_BIGIN < ast.type && ast.type < ASSIGN_END) {
+        auto &node = static_cast<AssignExprAST &>(ast);
+        fn(node.lhs);
+        fn(node.rhs);
+    } else if (CALL_BIGIN < ast.type && ast.type < CALL_END) {
+        for (auto &arg : static_cast<CallExprAST &>(ast).args) {
+            fn(arg);
+        }
+    }
+}
+
+} // namespace expr
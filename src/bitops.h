@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__BMI__)
+#include <immintrin.h>
+#endif
+
+namespace expr {
+
+//=============================================================================
+// bit manipulation on the 32 bits of an int (built-in functions)
+// Each is one instruction where the target has it: POPCNT, LZCNT / BSR,
+// TZCNT / BSF, BSWAP, and BEXTR for bits() when built with BMI (e.g.
+// -march=native). Bit ranges are [hi:lo] with 0 <= lo <= hi <= 31; the
+// caller checks them with bit_range().
+
+inline bool bit_range(int hi, int lo) { return 0 <= lo && lo <= hi && hi < 32; }
+
+// number of 1 bits
+inline int popcnt(int x) {
+#if defined(_MSC_VER)
+    return static_cast<int>(__popcnt(static_cast<uint32_t>(x)));
+#else
+    return __builtin_popcount(static_cast<uint32_t>(x));
+#endif
+}
+
+// leading / trailing zero bits (32 for 0, like LZCNT / TZCNT)
+inline int clz(int x) {
+    if (!x) {
+        return 32;
+    }
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanReverse(&i, static_cast<uint32_t>(x));
+    return 31 - static_cast<int>(i);
+#else
+    return __builtin_clz(static_cast<uint32_t>(x));
+#endif
+}
+
+inline int ctz(int x) {
+    if (!x) {
+        return 32;
+    }
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, static_cast<uint32_t>(x));
+    return static_cast<int>(i);
+#else
+    return __builtin_ctz(static_cast<uint32_t>(x));
+#endif
+}
+
+// byte order reversed
+inline int bswap(int x) {
+#if defined(_MSC_VER)
+    return static_cast<int>(_byteswap_ulong(static_cast<uint32_t>(x)));
+#else
+    return static_cast<int>(__builtin_bswap32(static_cast<uint32_t>(x)));
+#endif
+}
+
+// bits [hi:lo] of x, zero extended
+inline int bits(int x, int hi, int lo) {
+#if defined(__BMI__) && !defined(_MSC_VER)
+    return static_cast<int>(_bextr_u32(static_cast<uint32_t>(x),
+                                       static_cast<unsigned>(lo),
+                                       static_cast<unsigned>(hi - lo + 1)));
+#else
+    return static_cast<int>((static_cast<uint32_t>(x) >> lo) &
+                            (~0u >> (31 - hi + lo)));
+#endif
+}
+
+// x with bits [hi:lo] replaced by the low bits of v
+inline int setbits(int x, int hi, int lo, int v) {
+    uint32_t mask = (~0u >> (31 - hi)) & (~0u << lo);
+    return static_cast<int>((static_cast<uint32_t>(x) & ~mask) |
+                            ((static_cast<uint32_t>(v) << lo) & mask));
+}
+
+} // namespace expr
@@ -0,0 +1,385 @@
+#include "block_eval.h"
+#include "ast.h"
+#include <algorithm>
+
+namespace expr {
+
+enum { // ops of steps that are not node types
+    BLOCK_INPUT = 2000,
+    BLOCK_CONST,
+    BLOCK_CONVERT, // to the lanes of the step
+    BLOCK_BOOL,    // a != 0
+    BLOCK_SELECT,  // a ? b : c
+};
+
+//=============================================================================
+// compiler
+
+//-----------------------------------------------------------------------------
+// supported - ast can be evaluated by columns (in place of checked
+// evaluation if checked)
+static bool supported(ExprAST &ast, const SymbolRange &symbol, bool checked) {
+    Type type = ast.type;
+    if (type == REG) {
+        return !static_cast<RegisterExprAST &>(ast).Reg;
+    }
+    if (type == IMM || type == VAR) {
+        return true;
+    }
+    if (type == PLUS || type == MINUS || type == INV || type == NOT) {
+        auto &rhs = *static_cast<UnaryExprAST &>(ast).rhs;
+        if (type == MINUS && checked) {
+            Range a = range(rhs, symbol);
+            if (may_fail(MINUS, a, a)) {
+                return false;
+            }
+        }
+        return supported(rhs, symbol, checked);
+    }
+    if (BINOP_BIGIN < type && type < BINOP_END && type != DIV &&
+        type != MOD && type != DIVM && type != MODM) {
+        auto &node = static_cast<BinaryExprAST &>(ast);
+        if (type == SFTL || type == SFTR) {
+            Range amount = range(*node.rhs, symbol);
+            if (amount.lo < 0 || amount.hi > 31) {
+                return false;
+            }
+        }
+        // the lanes wrap around without a trace
+        if (checked && may_fail(type, range(*node.lhs, symbol),
+                                range(*node.rhs, symbol))) {
+            return false;
+        }
+        return supported(*node.lhs, symbol, checked) &&
+               supported(*node.rhs, symbol, checked);
+    }
+    if (type == QUESTION) {
+        auto &node = static_cast<ConditionalExprAST &>(ast);
+        return supported(*node.cond, symbol, checked) &&
+               supported(*node.lhs, symbol, checked) &&
+               supported(*node.rhs, symbol, checked);
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+class BlockCompiler {
+  public:
+    BlockCompiler(BlockEval &block, const SymbolRange &symbol, bool narrow)
+        : block(block), symbol(symbol), narrow(narrow) {}
+    int emit(ExprAST &ast);
+
+  private:
+    BlockEval &block;
+    const SymbolRange &symbol;
+    bool narrow;
+
+    int add(int op, int width, int a = -1, int b = -1, int c = -1,
+            int imm = 0) {
+        block.steps.push_back(BlockEval::Step{op, width, a, b, c, imm});
+        return static_cast<int>(block.steps.size() - 1);
+    }
+    int width(const Range &r) const { return narrow ? r.width() : 32; }
+    // step k in lanes of width bits
+    int at(int k, int width) {
+        auto &s = block.steps[k];
+        if (s.width == width) {
+            return k;
+        }
+        if (s.op == BLOCK_CONST) {
+            return add(BLOCK_CONST, width, -1, -1, -1, s.imm);
+        }
+        return add(BLOCK_CONVERT, width, k);
+    }
+    int lanes(int k) const { return block.steps[k].width; }
+    int input(int id);
+};
+
+int BlockCompiler::input(int id) {
+    auto &ids = block.ids;
+    size_t i = std::find(ids.begin(), ids.end(), id) - ids.begin();
+    if (i == ids.size()) {
+        ids.push_back(id);
+        block.inputs.push_back(
+            add(BLOCK_INPUT, width(symbol ? symbol(id) : Range::all()), -1,
+                -1, -1, static_cast<int>(i)));
+    }
+    return block.inputs[i];
+}
+
+//-----------------------------------------------------------------------------
+int BlockCompiler::emit(ExprAST &ast) {
+    Type type = ast.type;
+    Range r = range(ast, symbol);
+    int w = width(r);
+    if (r.is_constant()) { // e.g. "(x & 0xFF) < 256"
+        return add(BLOCK_CONST, w, -1, -1, -1, r.lo);
+    }
+    if (type == VAR || type == REG) {
+        return input(type == VAR ? static_cast<VariableExprAST &>(ast).Id
+                                 : static_cast<RegisterExprAST &>(ast).Id);
+    }
+    if (type == PLUS) {
+        return emit(*static_cast<UnaryExprAST &>(ast).rhs);
+    }
+    if (type == MINUS || type == INV) {
+        int a = emit(*static_cast<UnaryExprAST &>(ast).rhs);
+        return add(type, w, at(a, w));
+    }
+    if (type == NOT) {
+        int a = emit(*static_cast<UnaryExprAST &>(ast).rhs);
+        return add(NOT, lanes(a), a);
+    }
+    if (type == QUESTION) {
+        auto &node = static_cast<ConditionalExprAST &>(ast);
+        int c = emit(*node.cond);
+        c = add(BLOCK_BOOL, lanes(c), c);
+        int a = emit(*node.lhs);
+        int b = emit(*node.rhs);
+        return add(BLOCK_SELECT, w, at(c, w), at(a, w), at(b, w));
+    }
+
+    auto &node = static_cast<BinaryExprAST &>(ast);
+    int a = emit(*node.lhs);
+    int b = emit(*node.rhs);
+    switch (type) {
+    case LAND:
+    case LOR: {
+        a = add(BLOCK_BOOL, lanes(a), a);
+        b = add(BLOCK_BOOL, lanes(b), b);
+        int v = std::max(lanes(a), lanes(b));
+        return add(type == LAND ? AND : OR, v, at(a, v), at(b, v));
+    }
+    case ADD:
+    case SUB:
+    case MUL:
+    case AND:
+    case OR:
+    case XOR:
+    case SFTL: // low bits from low bits
+        return add(type, w, at(a, w), at(b, w));
+    case SFTR: {
+        int v = std::max(lanes(a), w);
+        return add(type, v, at(a, v), at(b, v));
+    }
+    default: { // comparison of whole values
+        int v = std::max(lanes(a), lanes(b));
+        return add(type, v, at(a, v), at(b, v));
+    }
+    }
+}
+
+//-----------------------------------------------------------------------------
+std::unique_ptr<BlockEval> BlockEval::create(ExprAST &ast,
+                                             const SymbolRange &symbol,
+                                             bool narrow, bool checked) {
+    if (!supported(ast, symbol, checked)) {
+        return nullptr;
+    }
+    std::unique_ptr<BlockEval> block(new BlockEval);
+    BlockCompiler compiler(*block, symbol, narrow);
+    compiler.emit(ast);
+    return block;
+}
+
+//-----------------------------------------------------------------------------
+std::vector<int> BlockEval::widths() const {
+    std::vector<int> result;
+    for (auto &s : steps) {
+        result.push_back(s.width);
+    }
+    return result;
+}
+
+//=============================================================================
+// evaluation
+// Wrapping arithmetic is done on uint32_t and truncated to the lanes; the
+// compiler narrows it back to the lane width.
+
+template <class T> struct Imm {
+    T v;
+    T operator[](size_t) const { return v; }
+};
+
+template <class T, class B>
+static void binary(int op, const T *a, B b, T *r, size_t n) {
+    switch (op) {
+    case ADD:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = static_cast<T>(uint32_t(a[i]) + uint32_t(b[i]));
+        }
+        break;
+    case SUB:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = static_cast<T>(uint32_t(a[i]) - uint32_t(b[i]));
+        }
+        break;
+    case MUL:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = static_cast<T>(uint32_t(a[i]) * uint32_t(b[i]));
+        }
+        break;
+    case AND:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] & b[i];
+        }
+        break;
+    case OR:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] | b[i];
+        }
+        break;
+    case XOR:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] ^ b[i];
+        }
+        break;
+    case SFTL:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = static_cast<T>(uint32_t(a[i]) << b[i]);
+        }
+        break;
+    case SFTR:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = static_cast<T>(a[i] >> b[i]);
+        }
+        break;
+    case EQ:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] == b[i];
+        }
+        break;
+    case NE:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] != b[i];
+        }
+        break;
+    case LT:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] < b[i];
+        }
+        break;
+    case LE:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] <= b[i];
+        }
+        break;
+    case GT:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] > b[i];
+        }
+        break;
+    case GE:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] >= b[i];
+        }
+        break;
+    }
+}
+
+template <class T>
+static void unary(int op, const T *a, T *r, size_t n) {
+    switch (op) {
+    case MINUS:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = static_cast<T>(0u - uint32_t(a[i]));
+        }
+        break;
+    case INV:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = ~a[i];
+        }
+        break;
+    case NOT:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] == 0;
+        }
+        break;
+    case BLOCK_BOOL:
+        for (size_t i = 0; i < n; i++) {
+            r[i] = a[i] != 0;
+        }
+        break;
+    }
+}
+
+template <class D, class S> static void convert(const void *s, D *d, size_t n) {
+    auto src = static_cast<const S *>(s);
+    for (size_t i = 0; i < n; i++) {
+        d[i] = static_cast<D>(src[i]);
+    }
+}
+
+template <class D> static void convert(int width, const void *s, D *d, size_t n) {
+    if (width == 8) {
+        convert<D, int8_t>(s, d, n);
+    } else if (width == 16) {
+        convert<D, int16_t>(s, d, n);
+    } else {
+        convert<D, int32_t>(s, d, n);
+    }
+}
+
+//-----------------------------------------------------------------------------
+template <class T>
+void BlockEval::run(const Step &s, const void *const *cols, size_t n,
+                    T *r) const {
+    auto col = [&](int k) { return static_cast<const T *>(cols[k]); };
+    switch (s.op) {
+    case BLOCK_CONST:
+        std::fill(r, r + n, static_cast<T>(s.imm));
+        break;
+    case BLOCK_CONVERT:
+        convert(steps[s.a].width, cols[s.a], r, n);
+        break;
+    case BLOCK_SELECT: {
+        const T *c = col(s.a), *a = col(s.b), *b = col(s.c);
+        for (size_t i = 0; i < n; i++) {
+            r[i] = c[i] ? a[i] : b[i];
+        }
+        break;
+    }
+    case MINUS:
+    case INV:
+    case NOT:
+    case BLOCK_BOOL:
+        unary(s.op, col(s.a), r, n);
+        break;
+    default:
+        if (steps[s.b].op == BLOCK_CONST) {
+            binary(s.op, col(s.a), Imm<T>{static_cast<T>(steps[s.b].imm)}, r,
+                   n);
+        } else {
+            binary(s.op, col(s.a), col(s.b), r, n);
+        }
+        break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+void BlockEval::eval(const void *const *columns, size_t n,
+                     int *results) const {
+    static thread_local std::vector<int32_t> scratch; // grows once per thread
+    static thread_local std::vector<const void *> cols;
+    if (scratch.size() < steps.size() * BLOCK) {
+        scratch.resize(steps.size() * BLOCK);
+    }
+    cols.resize(steps.size());
+    for (size_t k = 0; k < steps.size(); k++) {
+        const Step &s = steps[k];
+        void *out = &scratch[k * BLOCK];
+        cols[k] = out;
+        if (s.op == BLOCK_INPUT) {
+            cols[k] = columns[s.imm];
+        } else if (s.width == 8) {
+            run(s, cols.data(), n, static_cast<int8_t *>(out));
+        } else if (s.width == 16) {
+            run(s, cols.data(), n, static_cast<int16_t *>(out));
+        } else {
+            run(s, cols.data(), n, static_cast<int32_t *>(out));
+        }
+    }
+    convert(steps.back().width, cols.back(), results, n);
+}
+
+} // namespace expr
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "range.h"
+#include <memory>
+#include <vector>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// BlockEval - evaluate an expression for a block of records at once.
+// Every node becomes one loop over a column of its values in the block.
+// The loops have no branches, so the compiler vectorizes them. Each column
+// uses the narrowest lanes (8, 16 or 32 bits) that the range analysis
+// proves exact:
+//   - + - * & | ^ << ~ and ?: run in lanes as wide as their result. The low
+//     bits of their result depend only on the low bits of the operands, so
+//     wider operands may be truncated.
+//   - >> and comparisons run in lanes that hold their operands whole.
+// For example, "((r0 >> 8) & 0xFF) == 3" shifts in 32-bit lanes, then masks
+// and compares in 16-bit lanes, twice as many per vector.
+// Only expressions that cannot fail and do not assign are supported: no
+// assignment, division, function call, bound register, or shift by an
+// amount that may be outside [0, 31]. For checked evaluation, neither is
+// arithmetic that the ranges of its operands do not keep from overflowing.
+class BlockEval {
+  public:
+    enum { BLOCK = 1024 }; // records per eval() at most
+
+    // nullptr if ast is not supported. symbol gives the range of each
+    // symbol, which decides the lanes of its input column. With narrow
+    // false, every column has 32-bit lanes. checked : the blocks stand in
+    // for checked evaluation (see arith.h).
+    static std::unique_ptr<BlockEval> create(ExprAST &ast,
+                                             const SymbolRange &symbol,
+                                             bool narrow = true,
+                                             bool checked = false);
+
+    // interned id of each input column
+    const std::vector<int> &symbols() const { return ids; }
+    // bits of the lanes of input column i (8, 16 or 32)
+    int width(size_t i) const { return steps[inputs[i]].width; }
+    // bits of the lanes of each step, in evaluation order
+    std::vector<int> widths() const;
+
+    // results[i] = value for record i < n <= BLOCK, where columns[k] holds
+    // the n values of symbols()[k] as int8_t, int16_t or int32_t, following
+    // width(k). Safe to call from several threads.
+    void eval(const void *const *columns, size_t n, int *results) const;
+
+    struct Step {
+        int op;
+        int width;   // bits of the lanes of the result
+        int a, b, c; // operand steps, -1 if none
+        int imm;     // constant, or input column
+    };
+
+  private:
+    BlockEval() = default;
+    friend class BlockCompiler;
+
+    std::vector<Step> steps; // the last one is the result
+    std::vector<int> ids;
+    std::vector<int> inputs; // step of each input column
+
+    template <class T>
+    void run(const Step &s, const void *const *cols, size_t n, T *r) const;
+};
+
+} // namespace expr
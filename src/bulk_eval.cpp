@@ -0,0 +1,70 @@
+#include "bulk_eval.h"
+#include <algorithm>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// unique names of ids, in order of first occurrence
+static std::vector<std::string> unique_names(const std::vector<int> &ids) {
+    std::vector<int> seen;
+    std::vector<std::string> result;
+    for (int id : ids) {
+        if (std::find(seen.begin(), seen.end(), id) == seen.end()) {
+            seen.push_back(id);
+            result.push_back(interner().name(id));
+        }
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+BulkEval::BulkEval(ExprAST &ast) : prog(compile(ast)) {
+    auto refs = references(ast);
+    read_names = unique_names(refs.reads);
+    write_names = unique_names(refs.writes);
+    auto &ids = prog->symbols();
+    for (size_t i = 0; i < ids.size(); i++) {
+        names.push_back(interner().name(ids[i]));
+        if (std::find(refs.writes.begin(), refs.writes.end(), ids[i]) !=
+            refs.writes.end()) {
+            written.push_back(i);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+int BulkEval::eval(const Fetch &fetch, const Store &store) const {
+    size_t n = names.size();
+    size_t w = written.size();
+    int small[32];
+    std::vector<int> large;
+    int *slots = small;
+    if (n + w > sizeof(small) / sizeof(small[0])) {
+        large.resize(n + w);
+        slots = large.data();
+    }
+    int *before = slots + n; // values of the written slots
+
+    if (n) {
+        fetch(names, slots);
+    }
+    for (size_t i = 0; i < w; i++) {
+        before[i] = slots[written[i]];
+    }
+    int val = prog->eval(slots);
+
+    std::vector<std::string> changed;
+    std::vector<int> values;
+    for (size_t i = 0; i < w; i++) {
+        if (slots[written[i]] != before[i]) {
+            changed.push_back(names[written[i]]);
+            values.push_back(slots[written[i]]);
+        }
+    }
+    if (!changed.empty()) {
+        store(changed, values.data());
+    }
+    return val;
+}
+
+} // namespace expr
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "program.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// BulkEval - evaluation against a host that resolves symbols in bulk.
+// When every symbol access is a round trip to the host (e.g. a debugger
+// reading target registers), a per-name callback costs one trip per
+// reference. BulkEval compiles the expression once, knows every symbol it
+// may read or assign, and calls the host at most twice per evaluation: one
+// fetch of all of them before, one store of the assigned ones that changed
+// after.
+// Symbols that are only assigned are fetched too, since an assignment may
+// not run ("c ? (a = 1) : 0" leaves a as it was). Register operands are
+// symbols named like "%r12". eval() may run on several threads at once.
+class BulkEval {
+  public:
+    // fill values[i] with the value of names[i]
+    typedef std::function<void(const std::vector<std::string> &names,
+                               int *values)>
+        Fetch;
+    // assign values[i] to names[i]
+    typedef std::function<void(const std::vector<std::string> &names,
+                               const int *values)>
+        Store;
+
+    // expr_error if ast cannot be compiled (e.g. "1 = 2")
+    explicit BulkEval(ExprAST &ast);
+
+    // symbols read / assigned by the expression, each once, in order of
+    // first reference
+    const std::vector<std::string> &reads() const { return read_names; }
+    const std::vector<std::string> &writes() const { return write_names; }
+    // symbols fetched before each evaluation (reads and writes)
+    const std::vector<std::string> &symbols() const { return names; }
+
+    // fetch symbols(), evaluate, and store the assigned symbols whose value
+    // changed (store is not called if there are none)
+    int eval(const Fetch &fetch, const Store &store) const;
+
+  private:
+    std::unique_ptr<Program> prog;
+    std::vector<std::string> names; // of each slot of prog
+    std::vector<std::string> read_names;
+    std::vector<std::string> write_names;
+    std::vector<size_t> written; // slots assigned by the expression
+};
+
+} // namespace expr
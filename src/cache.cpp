@@ -0,0 +1,103 @@
+#include "cache.h"
+#include "mapped_file.h"
+#include <stdio.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define mkdir(path, mode) _mkdir(path)
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// FNV-1a 64bit
+static uint64_t fnv1a(const void *data, size_t len, uint64_t hash) {
+    auto p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+//-----------------------------------------------------------------------------
+ProgramCache::ProgramCache(std::string dir)
+    : dir(std::move(dir)), counts{0, 0, 0} {
+    mkdir(this->dir.c_str(), 0777); // may already exist
+}
+
+//-----------------------------------------------------------------------------
+std::string ProgramCache::normalize(const std::string &src) {
+    std::string result;
+    result.reserve(src.size());
+    bool space = false;
+    for (char c : src) {
+        if (c == ' ' || c == '\t') {
+            space = true;
+            continue;
+        }
+        if (space && !result.empty()) {
+            result += ' ';
+        }
+        space = false;
+        result += c;
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+std::string ProgramCache::path(const std::string &normalized) const {
+    uint32_t version = PROGRAM_VERSION;
+    uint64_t hash = fnv1a(&version, sizeof(version), 0xcbf29ce484222325ull);
+    hash = fnv1a(normalized.data(), normalized.size(), hash);
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.expc",
+             static_cast<unsigned long long>(hash));
+    return dir + name;
+}
+
+//-----------------------------------------------------------------------------
+std::shared_ptr<const Program> ProgramCache::get(const std::string &src) {
+    std::string normalized = normalize(src);
+    std::string file = path(normalized);
+
+    std::shared_ptr<MappedFile> map;
+    try {
+        map = std::make_shared<MappedFile>(file);
+    } catch (const expr_error &) {
+        map = nullptr; // no entry
+    }
+    if (map) {
+        std::shared_ptr<const Program> prog = Program::load(map, normalized);
+        if (prog) {
+            counts.hits++;
+            return prog;
+        }
+        counts.invalid++;
+    } else {
+        counts.misses++;
+    }
+
+    auto ast = parser(src);
+    std::shared_ptr<const Program> prog = compile(*ast);
+
+    // write a temporary file and rename it, so readers never see a partial
+    // entry
+    std::string image = prog->serialize(normalized);
+    std::string tmp = file + "." + std::to_string(getpid()) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp) {
+        bool ok = fwrite(image.data(), 1, image.size(), fp) == image.size();
+        ok = fclose(fp) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), file.c_str()) != 0) {
+            remove(tmp.c_str());
+        }
+    }
+    return prog;
+}
+
+} // namespace expr
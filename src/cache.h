@@ -0,0 +1,44 @@
+#pragma once
+
+#include "program.h"
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// ProgramCache - on-disk cache of compiled expressions.
+// An entry is the binary image of a Program (see Program::serialize) stored
+// as DIR/<hash>.expc, where hash covers the normalized source and
+// PROGRAM_VERSION. A hit maps the entry and runs its code in place, so the
+// source is neither lexed nor parsed. A missing, stale or corrupt entry is
+// parsed and compiled as usual and the entry is rewritten.
+// Writing the cache is best effort: if DIR is not writable, get() still
+// returns the compiled program.
+class ProgramCache {
+  public:
+    struct Stats {
+        size_t hits;
+        size_t misses;  // no entry
+        size_t invalid; // stale or corrupt entry
+    };
+
+    explicit ProgramCache(std::string dir);
+
+    // compiled program of src (expr_error on syntax error)
+    std::shared_ptr<const Program> get(const std::string &src);
+
+    const Stats &stats() const { return counts; }
+
+    // whitespace runs collapsed to one space, leading/trailing removed
+    static std::string normalize(const std::string &src);
+    // entry file of a normalized source
+    std::string path(const std::string &normalized) const;
+
+  private:
+    std::string dir;
+    Stats counts;
+};
+
+} // namespace expr
@@ -0,0 +1,74 @@
+#include "completion.h"
+#include <algorithm>
+
+namespace expr {
+
+enum { MERGE_MIN = 32 }; // more pending names are merged in one pass
+
+//-----------------------------------------------------------------------------
+static bool by_name(int a, int b) {
+    return interner().name(a) < interner().name(b);
+}
+
+//-----------------------------------------------------------------------------
+void SymbolIndex::update(const SymbolTable &symbols) {
+    if (symbols.generation() != generation) { // symbols were removed
+        sorted.clear();
+        pending.clear();
+        seen = 0;
+        generation = symbols.generation();
+    }
+    for (size_t n = symbols.size(); seen < n; seen++) {
+        pending.push_back(symbols.id(seen));
+    }
+}
+
+//-----------------------------------------------------------------------------
+void SymbolIndex::merge() {
+    if (pending.empty()) {
+        return;
+    }
+    std::sort(pending.begin(), pending.end(), by_name);
+    if (pending.size() <= MERGE_MIN) {
+        // a few names (e.g. one assignment) : moving ids is cheaper than
+        // comparing every name in a merge
+        for (int id : pending) {
+            sorted.insert(
+                std::upper_bound(sorted.begin(), sorted.end(), id, by_name),
+                id);
+        }
+        pending.clear();
+        return;
+    }
+    size_t mid = sorted.size();
+    sorted.insert(sorted.end(), pending.begin(), pending.end());
+    std::inplace_merge(sorted.begin(), sorted.begin() + mid, sorted.end(),
+                       by_name);
+    pending.clear();
+}
+
+//-----------------------------------------------------------------------------
+std::pair<size_t, size_t> SymbolIndex::range(const std::string &prefix) {
+    merge();
+    auto first = std::lower_bound(
+        sorted.begin(), sorted.end(), prefix,
+        [](int id, const std::string &p) { return interner().name(id) < p; });
+    auto last = std::upper_bound(
+        first, sorted.end(), prefix, [](const std::string &p, int id) {
+            return interner().name(id).compare(0, p.size(), p) > 0;
+        });
+    return std::make_pair(first - sorted.begin(), last - sorted.begin());
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::string> SymbolIndex::complete(const std::string &prefix,
+                                               size_t limit) {
+    auto r = range(prefix);
+    std::vector<std::string> result;
+    for (size_t i = r.first; i < r.second && result.size() < limit; i++) {
+        result.push_back(name(i));
+    }
+    return result;
+}
+
+} // namespace expr
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "symbol.h"
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// SymbolIndex - names of the symbols of a table in sorted order, for prefix
+// queries such as tab completion.
+// update() takes the symbols added to the table since the previous call.
+// A table whose generation() changed had symbols removed (clear(), or
+// erase() by :rollback or an aborted transaction) and is reindexed as a
+// whole. New names are appended to a pending list and merged into the
+// sorted list by the next query, so a bulk import costs one sort instead of
+// one insertion per symbol. A query is two binary searches.
+class SymbolIndex {
+  public:
+    SymbolIndex() : seen(0), generation(0) {}
+
+    void update(const SymbolTable &symbols);
+
+    // [first, last) : positions of the names starting with prefix
+    std::pair<size_t, size_t> range(const std::string &prefix);
+    // name at a position of range()
+    const std::string &name(size_t pos) const {
+        return interner().name(sorted[pos]);
+    }
+    size_t size() const { return sorted.size() + pending.size(); }
+
+    // names starting with prefix, at most limit of them
+    std::vector<std::string> complete(const std::string &prefix,
+                                      size_t limit = static_cast<size_t>(-1));
+
+  private:
+    std::vector<int> sorted;  // ids ordered by name
+    std::vector<int> pending; // ids not merged yet
+    size_t seen;              // symbols indexed so far
+    uint64_t generation;      // of the table when they were indexed
+
+    void merge();
+};
+
+} // namespace expr
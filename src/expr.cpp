@@ -1,14 +1,19 @@
 ﻿#include "macro.h"
 #include "expr.h"
+#include "ast.h"
+#include "stats.h"
 #include <assert.h>
+#include <errno.h>
 #include <iostream>
+#include <limits.h>
 #include <list>
 #include <map>
 #include <memory>
-#include <regex>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <unordered_map>
 
 namespace expr {
 
@@ -24,290 +29,247 @@ namespace expr {
 //=============================================================================
 // lexer
 
+//-----------------------------------------------------------------------------
+// character classes of the lexer (ASCII only, independent of locale)
+static inline bool is_digit(char c) { return '0' <= c && c <= '9'; }
+static inline bool is_bin(char c) { return c == '0' || c == '1'; }
+static inline bool is_hex(char c) {
+    return is_digit(c) || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F');
+}
+static inline bool is_alpha(char c) {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
+static inline bool is_alnum(char c) { return is_alpha(c) || is_digit(c); }
+
+//-----------------------------------------------------------------------------
+// operators, tried in this order (the first match wins)
+struct Operator {
+    Type type;
+    const char *str;
+    size_t len;
+};
+static const Operator operators[] = {
+    {ASSIGN_SL, "<<=", 3},
+    {ASSIGN_SR, ">>=", 3},
+    {ASSIGN_OR, "|=", 2},
+    {ASSIGN_XOR, "^=", 2},
+    {ASSIGN_AND, "&=", 2},
+    {ASSIGN_ADD, "+=", 2},
+    {ASSIGN_SUB, "-=", 2},
+    {ASSIGN_MUL, "*=", 2},
+    {ASSIGN_DIV, "/=", 2},
+    {ASSIGN_MOD, "%=", 2},
+    {SFTL, "<<", 2},
+    {SFTR, ">>", 2},
+    {EQ, "==", 2},
+    {NE, "!=", 2},
+    {LE, "<=", 2},
+    {GE, ">=", 2},
+    {LAND, "&&", 2},
+    {LOR, "||", 2},
+    {LT, "<", 1},
+    {GT, ">", 1},
+    {ADD, "+", 1},
+    {SUB, "-", 1},
+    {MUL, "*", 1},
+    {DIV, "/", 1},
+    {MOD, "%", 1},
+    {AND, "&", 1},
+    {OR, "|", 1},
+    {XOR, "^", 1},
+    {INV, "~", 1},
+    {NOT, "!", 1},
+    {PARL, "(", 1},
+    {PARR, ")", 1},
+    {SEMICOLON, ";", 1},
+    {COLON, ":", 1},
+    {QUESTION, "?", 1},
+    {ASSIGN, "=", 1},
+    {COMMA, ",", 1},
+};
+
+//-----------------------------------------------------------------------------
+// builtin functions
+static const Builtin builtins[] = {
+    {POPCNT, "popcnt", 1}, {CLZ, "clz", 1},   {CTZ, "ctz", 1},
+    {BSWAP, "bswap", 1},   {BITS, "bits", 3}, {SETBITS, "setbits", 4},
+};
+
+const Builtin *builtin(Type type) {
+    for (auto &b : builtins) {
+        if (b.type == type) {
+            return &b;
+        }
+    }
+    return nullptr;
+}
+
+const Builtin *builtin(const char *name, size_t len) {
+    for (auto &b : builtins) {
+        if (strlen(b.name) == len && memcmp(b.name, name, len) == 0) {
+            return &b;
+        }
+    }
+    return nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// intern - Interner::intern with a thread-local cache in front of it, so
+// lexers running on several threads do not serialize on the interner lock.
+static int intern(const std::string &name) {
+    thread_local std::unordered_map<std::string, int> cache;
+    auto itr = cache.find(name);
+    if (itr != cache.end()) {
+        return itr->second;
+    }
+    int id = interner().intern(name);
+    cache.emplace(name, id);
+    return id;
+}
+
 //-----------------------------------------------------------------------------
 // Lexer
 // lineの文字列をtokenに分割する。
-std::list<Token> lexer(const std::string &line) {
-    std::list<Token> tokens;
-    auto itr = line.cbegin();
-    auto ite = line.cend();
-
-    std::vector<Token> keywords = {
-        {IMMX, R"(^0[xX][0-9a-fA-F]+)"},
-        {IMMB, R"(^0[bB][0-1]+)"},
-        {IMM, R"(^[0-9]+)"},
-        {VAR, R"(^[a-zA-Z][a-zA-Z0-9]*)"},
-        {REG, R"(^\%[a-zA-Z][0-9]+)"},
-        {ASSIGN_SL, R"(^\<\<\=)"},
-        {ASSIGN_SR, R"(^\>\>\=)"},
-        {ASSIGN_OR, R"(^\|\=)"},
-        {ASSIGN_XOR, R"(^\^\=)"},
-        {ASSIGN_AND, R"(^\&\=)"},
-        {ASSIGN_ADD, R"(^\+\=)"},
-        {ASSIGN_SUB, R"(^\-\=)"},
-        {ASSIGN_MUL, R"(^\*\=)"},
-        {ASSIGN_DIV, R"(^\/\=)"},
-        {ASSIGN_MOD, R"(^\%\=)"},
-        {SFTL, R"(^\<\<)"},
-        {SFTR, R"(^\>\>)"},
-        {EQ, R"(^\=\=)"},
-        {NE, R"(^\!\=)"},
-        {LE, R"(^\<\=)"},
-        {GE, R"(^\>\=)"},
-        {LAND, R"(^\&\&)"},
-        {LOR, R"(^\|\|)"},
-        {LT, R"(^\<)"},
-        {GT, R"(^\>)"},
-        {ADD, R"(^\+)"},
-        {SUB, R"(^\-)"},
-        {MUL, R"(^\*)"},
-        {DIV, R"(^\/)"},
-        {MOD, R"(^\%)"},
-        {AND, R"(^\&)"},
-        {OR, R"(^\|)"},
-        {XOR, R"(^\^)"},
-        {INV, R"(^\~)"},
-        {NOT, R"(^\!)"},
-        {PARL, R"(^\()"},
-        {PARR, R"(^\))"},
-        {SEMICOLON, R"(^\;)"},
-        {COLON, R"(^\:)"},
-        {QUESTION, R"(^\?)"},
-        {ASSIGN, R"(^\=)"},
-    };
+// token                          pattern
+//   IMMX                         0[xX][0-9a-fA-F]+
+//   IMMB                         0[bB][0-1]+
+//   IMM                          [0-9]+
+//   FUNC                         builtin name followed by '('
+//   VAR                          [a-zA-Z][a-zA-Z0-9]*
+//   REG                          %[a-zA-Z][0-9]+
+//   operators                    see operators[]
+static bool lex(const std::string &line, std::list<Token> &tokens,
+                ParseError &err) {
+    const char *itr = line.data();
+    const char *ite = itr + line.size();
 
     while (itr != ite) {
-        std::smatch m;
-
         // skip white spcae
-        if (regex_search(itr, ite, m, std::regex(R"(^[ \t]+)"))) {
-            itr = m[0].second;
+        if (*itr == ' ' || *itr == '\t') {
+            itr++;
             continue;
         }
 
-        Token token;
-        size_t i;
-        for (i = 0; i < keywords.size(); i++) {
-            if (regex_search(itr, ite, m, std::regex(keywords[i].str))) {
-                itr = m[0].second;
-                token.str = m[0];
-                token.type = keywords[i].type;
-                break;
+        const char *p = itr;
+        Type type = EOL;
+        if (*p == '0' && ite - p > 2 && (p[1] == 'x' || p[1] == 'X') &&
+            is_hex(p[2])) {
+            for (p += 2; p != ite && is_hex(*p); p++) {
+            }
+            type = IMMX;
+        } else if (*p == '0' && ite - p > 2 && (p[1] == 'b' || p[1] == 'B') &&
+                   is_bin(p[2])) {
+            for (p += 2; p != ite && is_bin(*p); p++) {
+            }
+            type = IMMB;
+        } else if (is_digit(*p)) {
+            for (; p != ite && is_digit(*p); p++) {
+            }
+            type = IMM;
+        } else if (is_alpha(*p)) {
+            for (; p != ite && is_alnum(*p); p++) {
+            }
+            // a builtin name is a variable unless it is called
+            const char *q = p;
+            while (q != ite && (*q == ' ' || *q == '\t')) {
+                q++;
+            }
+            if (q != ite && *q == '(' && builtin(itr, p - itr)) {
+                type = FUNC;
+            } else {
+                type = VAR;
+            }
+        } else if (*p == '%' && ite - p > 2 && is_alpha(p[1]) &&
+                   is_digit(p[2])) {
+            for (p += 2; p != ite && is_digit(*p); p++) {
+            }
+            type = REG;
+        } else {
+            for (auto &op : operators) {
+                if (static_cast<size_t>(ite - p) >= op.len &&
+                    memcmp(p, op.str, op.len) == 0) {
+                    p += op.len;
+                    type = op.type;
+                    break;
+                }
             }
         }
 
-        if (token.type) {
-            tokens.push_back(token);
+        if (type) {
+            Token token(type, std::string(itr, p));
+            if (type == VAR || type == REG) {
+                token.id = intern(token.str);
+            }
+            token.pos = itr - line.data();
+            tokens.push_back(std::move(token));
+            itr = p;
         } else { //見つからなかった場合は、残りをすべてtokensに入れる
 #if 1
-            throw expr_error("invalid token");
+            err.code = PARSE_INVALID_TOKEN;
+            err.offset = itr - line.data();
+            err.token.assign(itr, 1);
+            return false;
 #else
-            token.str = std::string(itr, ite);
-            token.type = INVALID;
-            tokens.push_back(token);
+            tokens.push_back(Token(INVALID, std::string(itr, ite)));
             break;
 #endif
         }
     }
 
     tokens.push_back(Token(EOL, std::string("")));
-    return tokens;
+    tokens.back().pos = line.size();
+    return true;
 }
 
-//=============================================================================
-// AST (Abstract Syntax Tree)
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-// IntegerExprAST - Expression class for integer literals like "1".
-// IntegerExprAST - "1"のような整数数値リテラルのための式クラス。
-class IntegerExprAST : public ExprAST {
-  public:
-    const int Val;
-    explicit IntegerExprAST(int val) : ExprAST(IMM), Val(val) {}
-    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
-        UNUSED(fp);
-        return Val;
-    }
-};
-
-//-----------------------------------------------------------------------------
-// VariableExprAST - Expression class for referencing a variable, like "a".
-// VariableExprAST - "a"のような変数を参照するための式クラス。
-class VariableExprAST : public ExprAST {
-  public:
-    const std::string Name;
-    explicit VariableExprAST(std::string Name)
-        : ExprAST(VAR), Name(std::move(Name)) {}
-    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
-        return fp ? fp(Name) : 0;
-    }
-};
-
-//-----------------------------------------------------------------------------
-// UnaryExprAST - Expression class for a unary operator.
-class UnaryExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> rhs;
-
-  public:
-    UnaryExprAST(Type type, std::unique_ptr<ExprAST> rhs)
-        : ExprAST(type), rhs(std::move(rhs)) {}
-    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
-        switch (type) {
-        case (ADD):
-            return +rhs->eval(fp);
-        case (SUB):
-            return -rhs->eval(fp);
-        case (INV):
-            return ~rhs->eval(fp);
-        case (NOT):
-            return !rhs->eval(fp);
-        default:
-            throw expr_error("unknown operator");
-        }
-        return 0;
+std::list<Token> lexer(const std::string &line) {
+    std::list<Token> tokens;
+    ParseError err;
+    if (!lex(line, tokens, err)) {
+        throw expr_error(err.message());
     }
-};
-
-//-----------------------------------------------------------------------------
-// BinaryExprAST - Expression class for a binary operator.
-// BinaryExprAST - 二項演算子のための式クラス。
-class BinaryExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> lhs, rhs;
-
-  public:
-    BinaryExprAST(Type type, std::unique_ptr<ExprAST> lhs,
-                  std::unique_ptr<ExprAST> rhs)
-        : ExprAST(type), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
-    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
-        switch (type) {
-        case (ADD):
-            return lhs->eval(fp) + rhs->eval(fp);
-        case (SUB):
-            return lhs->eval(fp) - rhs->eval(fp);
-        case (MUL):
-            return lhs->eval(fp) * rhs->eval(fp);
-        case (DIV):
-            return lhs->eval(fp) / rhs->eval(fp);
-        case (MOD):
-            return lhs->eval(fp) % rhs->eval(fp);
-        case (AND):
-            return lhs->eval(fp) & rhs->eval(fp);
-        case (OR):
-            return lhs->eval(fp) | rhs->eval(fp);
-        case (XOR):
-            return lhs->eval(fp) ^ rhs->eval(fp);
-        case (LAND):
-            return lhs->eval(fp) && rhs->eval(fp);
-        case (LOR):
-            return lhs->eval(fp) || rhs->eval(fp);
-        case (SFTL):
-            return lhs->eval(fp) << rhs->eval(fp);
-        case (SFTR):
-            return lhs->eval(fp) >> rhs->eval(fp);
-        case (EQ):
-            return lhs->eval(fp) == rhs->eval(fp);
-        case (NE):
-            return lhs->eval(fp) != rhs->eval(fp);
-        case (LT):
-            return lhs->eval(fp) < rhs->eval(fp);
-        case (LE):
-            return lhs->eval(fp) <= rhs->eval(fp);
-        case (GT):
-            return lhs->eval(fp) > rhs->eval(fp);
-        case (GE):
-            return lhs->eval(fp) >= rhs->eval(fp);
-        default:
-            throw expr_error("unknown operator");
-        }
-        return 0;
-    };
-};
-
-//-----------------------------------------------------------------------------
-// ConditionalExprAST - Expression class for a conditinal operator.
-class ConditionalExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> cond, lhs, rhs;
-
-  public:
-    ConditionalExprAST(std::unique_ptr<ExprAST> cond,
-                       std::unique_ptr<ExprAST> lhs,
-                       std::unique_ptr<ExprAST> rhs)
-        : ExprAST(QUESTION), cond(std::move(cond)), lhs(std::move(lhs)),
-          rhs(std::move(rhs)) {}
-    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
-        return cond->eval(fp) ? lhs->eval(fp) : rhs->eval(fp);
-    };
-};
-
-//-----------------------------------------------------------------------------
-// AssignExprAST
-class AssignExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> lhs, rhs;
-
-  public:
-    AssignExprAST(Type type, std::unique_ptr<ExprAST> lhs,
-                  std::unique_ptr<ExprAST> rhs)
-        : ExprAST(type), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
-    int eval(std::function<int&(const std::string &)> fp = nullptr) override {
-        if (lhs->type != VAR) {
-            throw expr_error("cannot assign to except for variables");
-        }
-        if (!fp) {
-            return 0;
-        }
-
-        VariableExprAST *lhs_ast = static_cast<VariableExprAST *>(lhs.get());
-        int &lhs_ref = fp(lhs_ast->Name);
-        switch (type) {
-        case (ASSIGN):
-            return lhs_ref = rhs->eval(fp);
-        case (ASSIGN_OR):
-            return lhs_ref |= rhs->eval(fp);
-        case (ASSIGN_XOR):
-            return lhs_ref ^= rhs->eval(fp);
-        case (ASSIGN_AND):
-            return lhs_ref &= rhs->eval(fp);
-        case (ASSIGN_SL):
-            return lhs_ref <<= rhs->eval(fp);
-        case (ASSIGN_SR):
-            return lhs_ref >>= rhs->eval(fp);
-        case (ASSIGN_ADD):
-            return lhs_ref += rhs->eval(fp);
-        case (ASSIGN_SUB):
-            return lhs_ref -= rhs->eval(fp);
-        case (ASSIGN_MUL):
-            return lhs_ref *= rhs->eval(fp);
-        case (ASSIGN_DIV):
-            return lhs_ref /= rhs->eval(fp);
-        case (ASSIGN_MOD):
-            return lhs_ref %= rhs->eval(fp);
-        default:
-            throw expr_error("unknown operator");
-        }
-        return 0;
- 
-    };
-};
+    return tokens;
+}
 
 //=============================================================================
 // Parser
-
-static std::unique_ptr<ExprAST> primary_expression(std::list<Token> &tokens);
-static std::unique_ptr<ExprAST> expression(std::list<Token> &tokens);
+// Syntax errors are not thrown here: a function that fails records the
+// error in err and returns nullptr, and its callers return nullptr too.
+
+static std::unique_ptr<ExprAST> primary_expression(std::list<Token> &tokens,
+                                                   ParseError &err);
+static std::unique_ptr<ExprAST> expression(std::list<Token> &tokens,
+                                           ParseError &err);
+
+// fail - record a syntax error at token
+static std::nullptr_t fail(ParseError &err, ParseCode code,
+                           const Token &token) {
+    err.code = code;
+    err.offset = token.pos;
+    err.token = token.str;
+    return nullptr;
+}
 
 /*-----------------------------------------------------------------------------
 unary_expression
 */
-static std::unique_ptr<ExprAST> unary_expression(std::list<Token> &tokens) {
+static std::unique_ptr<ExprAST> unary_expression(std::list<Token> &tokens,
+                                                 ParseError &err) {
     FUNCTION_CALL_TRACE(tokens.front().str);
     Type op = tokens.front().type;
     if (op == ADD || op == SUB || op == INV || op == NOT) {
         tokens.pop_front(); // eat op
-        auto rhs = primary_expression(tokens);
-        assert(rhs);
+        auto rhs = primary_expression(tokens, err);
+        if (!rhs) {
+            return nullptr;
+        }
+        if (op == ADD) {
+            op = PLUS;
+        } else if (op == SUB) {
+            op = MINUS;
+        }
         return std::make_unique<UnaryExprAST>(op, std::move(rhs));
     }
-    return primary_expression(tokens);
+    return primary_expression(tokens, err);
 }
 
 #if 0
@@ -544,13 +506,16 @@ binary_expression(std::list<Token> &tokens, std::unique_ptr<ExprAST> lhs) {
 /*-----------------------------------------------------------------------------
 binary_expression
 */
-static std::unique_ptr<ExprAST>
-binary_expression(std::list<Token> &tokens, std::unique_ptr<ExprAST> lhs) {
+static std::unique_ptr<ExprAST> binary_expression(std::list<Token> &tokens,
+                                                  ParseError &err,
+                                                  std::unique_ptr<ExprAST> lhs) {
     FUNCTION_CALL_TRACE(tokens.front().str);
     if (!lhs) {
-        lhs = unary_expression(tokens);
+        lhs = unary_expression(tokens, err);
+        if (!lhs) {
+            return nullptr;
+        }
     }
-    assert(lhs);
     while (1) {
         Type type = tokens.front().type;
         // 現在のトークンが、2項演算子でない場合は、lhsを返す。
@@ -559,14 +524,18 @@ binary_expression(std::list<Token> &tokens, std::unique_ptr<ExprAST> lhs) {
         }
 
         tokens.pop_front(); // eat op
-        auto rhs = unary_expression(tokens);
-        assert(rhs);
+        auto rhs = unary_expression(tokens, err);
+        if (!rhs) {
+            return nullptr;
+        }
 
         //現在の演算優先度が、rhsの後の二項演算の優先度より低い場合は、
         //現在のrhsを初期ノードとした、二項演算ツリーを作る。
         if (type < tokens.front().type) {
-            rhs = binary_expression(tokens, std::move(rhs));
-            assert(rhs);
+            rhs = binary_expression(tokens, err, std::move(rhs));
+            if (!rhs) {
+                return nullptr;
+            }
         }
 
         // merge lhs/rhs
@@ -587,34 +556,39 @@ conditional_expression
 
 */
 static std::unique_ptr<ExprAST>
-conditional_expression(std::list<Token> &tokens,
+conditional_expression(std::list<Token> &tokens, ParseError &err,
                        std::unique_ptr<ExprAST> cond) {
     FUNCTION_CALL_TRACE(tokens.front().str);
     if (!cond) {
-        cond = binary_expression(tokens, nullptr);
+        cond = binary_expression(tokens, err, nullptr);
+        if (!cond) {
+            return nullptr;
+        }
     }
-    assert(cond);
     Type op = tokens.front().type;
     if (op != QUESTION) {
         return cond;
     }
 
     tokens.pop_front(); // eat ?
-    auto lhs = expression(tokens);
-    assert(lhs);
+    auto lhs = expression(tokens, err);
+    if (!lhs) {
+        return nullptr;
+    }
 
     op = tokens.front().type;
-    if (op == COLON) {
-        tokens.pop_front(); // eat :
-        auto rhs = conditional_expression(tokens, nullptr);
-        assert(rhs);
-        return conditional_expression(
-            tokens, std::make_unique<ConditionalExprAST>(
-                        std::move(cond), std::move(lhs), std::move(rhs)));
-    } else {
-        throw expr_error("expected ':'\n");
+    if (op != COLON) {
+        return fail(err, PARSE_EXPECTED_COLON, tokens.front());
     }
-    return lhs;
+    tokens.pop_front(); // eat :
+    auto rhs = conditional_expression(tokens, err, nullptr);
+    if (!rhs) {
+        return nullptr;
+    }
+    return conditional_expression(
+        tokens, err,
+        std::make_unique<ConditionalExprAST>(std::move(cond), std::move(lhs),
+                                             std::move(rhs)));
 }
 
 /*-----------------------------------------------------------------------------
@@ -623,13 +597,16 @@ assignment_expression
         | conditional_expression
 */
 static std::unique_ptr<ExprAST>
-assignment_expression(std::list<Token> &tokens, std::unique_ptr<ExprAST> lhs) {
+assignment_expression(std::list<Token> &tokens, ParseError &err,
+                      std::unique_ptr<ExprAST> lhs) {
     FUNCTION_CALL_TRACE(tokens.front().str);
 
     if (!lhs) {
-        lhs = conditional_expression(tokens, nullptr);
+        lhs = conditional_expression(tokens, err, nullptr);
+        if (!lhs) {
+            return nullptr;
+        }
     }
-    assert(lhs);
 
     Type opc = tokens.front().type;
     if (opc < ASSIGN_BIGIN || ASSIGN_END < opc) {
@@ -637,10 +614,12 @@ assignment_expression(std::list<Token> &tokens, std::unique_ptr<ExprAST> lhs) {
     }
 
     tokens.pop_front(); // eat opc
-    auto rhs = assignment_expression(tokens, nullptr);
-    assert(rhs);
+    auto rhs = assignment_expression(tokens, err, nullptr);
+    if (!rhs) {
+        return nullptr;
+    }
     return assignment_expression(
-        tokens,
+        tokens, err,
         std::make_unique<AssignExprAST>(opc, std::move(lhs), std::move(rhs)));
 }
 
@@ -648,27 +627,38 @@ assignment_expression(std::list<Token> &tokens, std::unique_ptr<ExprAST> lhs) {
 expression
 : equality_expression
 */
-static std::unique_ptr<ExprAST> expression(std::list<Token> &tokens) {
+static std::unique_ptr<ExprAST> expression(std::list<Token> &tokens,
+                                           ParseError &err) {
     FUNCTION_CALL_TRACE(tokens.front().str);
     //	return conditional_expression(tokens, nullptr);
-    return assignment_expression(tokens, nullptr);
+    return assignment_expression(tokens, err, nullptr);
 }
 
 /*-----------------------------------------------------------------------------
 integer_expression (terminate)
 : number
+Decimal literals above INT_MAX are out of range; hexadecimal and binary
+ones keep their low 32 bits up to 64 bits.
 */
-static std::unique_ptr<ExprAST> integer_expression(std::list<Token> &tokens) {
+static std::unique_ptr<ExprAST> integer_expression(std::list<Token> &tokens,
+                                                   ParseError &err) {
     FUNCTION_CALL_TRACE(tokens.front().str);
+    const Token &token = tokens.front();
     int value = 0;
-    if (tokens.front().type == IMM) {
-        value = std::stoi(tokens.front().str, nullptr, 0);
-    } else if (tokens.front().type == IMMX) {
-        value = static_cast<int>(
-            std::stoul(tokens.front().str.substr(2), nullptr, 16));
-    } else if (tokens.front().type == IMMB) {
-        value = static_cast<int>(
-            std::stoul(tokens.front().str.substr(2), nullptr, 2));
+    errno = 0;
+    if (token.type == IMM) {
+        long long v = strtoll(token.str.c_str(), nullptr, 0);
+        if (errno == ERANGE || v < INT_MIN || v > INT_MAX) {
+            return fail(err, PARSE_OUT_OF_RANGE, token);
+        }
+        value = static_cast<int>(v);
+    } else if (token.type == IMMX || token.type == IMMB) {
+        unsigned long long v = strtoull(token.str.c_str() + 2, nullptr,
+                                        token.type == IMMX ? 16 : 2);
+        if (errno == ERANGE) {
+            return fail(err, PARSE_OUT_OF_RANGE, token);
+        }
+        value = static_cast<int>(v);
     } else {
         assert(0 && "illigal token type");
     }
@@ -683,36 +673,93 @@ variable_expression (terminate)
 */
 static std::unique_ptr<ExprAST> variable_expression(std::list<Token> &tokens) {
     FUNCTION_CALL_TRACE(tokens.front().str);
-    assert(tokens.front().type == VAR || tokens.front().type == REG);
-    auto Result = std::make_unique<VariableExprAST>(tokens.front().str);
+    assert(tokens.front().type == VAR);
+    auto Result = std::make_unique<VariableExprAST>(tokens.front().id);
     tokens.pop_front(); // eat variable
     return std::move(Result);
 }
 
+/*-----------------------------------------------------------------------------
+register_expression (terminate)
+: %[a-zA-Z][0-9]+
+*/
+static std::unique_ptr<ExprAST> register_expression(std::list<Token> &tokens) {
+    FUNCTION_CALL_TRACE(tokens.front().str);
+    const Token &token = tokens.front();
+    assert(token.type == REG);
+    // "%r12" : bank 'r', index 12 (saturates, rejected later by bind)
+    size_t index = strtoul(token.str.c_str() + 2, nullptr, 10);
+    auto Result =
+        std::make_unique<RegisterExprAST>(token.id, token.str[1], index);
+    tokens.pop_front(); // eat register
+    return Result;
+}
+
+/*-----------------------------------------------------------------------------
+call_expression
+: FUNC PARL expression (COMMA expression)* PARR
+*/
+static std::unique_ptr<ExprAST> call_expression(std::list<Token> &tokens,
+                                                ParseError &err) {
+    FUNCTION_CALL_TRACE(tokens.front().str);
+    Token name = tokens.front();
+    const Builtin *func = builtin(name.str.data(), name.str.size());
+    assert(name.type == FUNC && func);
+    tokens.pop_front(); // eat name
+    tokens.pop_front(); // eat (
+
+    std::vector<std::unique_ptr<ExprAST>> args;
+    while (1) {
+        args.push_back(expression(tokens, err));
+        if (!args.back()) {
+            return nullptr;
+        }
+        if (tokens.front().type != COMMA) {
+            break;
+        }
+        tokens.pop_front(); // eat ,
+    }
+    if (tokens.front().type != PARR) {
+        return fail(err, PARSE_EXPECTED_PARR, tokens.front());
+    }
+    tokens.pop_front(); // eat )
+    if (args.size() != static_cast<size_t>(func->arity)) {
+        return fail(err, PARSE_ARGUMENTS, name);
+    }
+    return std::make_unique<CallExprAST>(func->type, std::move(args));
+}
+
 /*-----------------------------------------------------------------------------
 primary_expression
 : integer_expression　(terminate)
+| call_expression
 | PARL expression PARR
 */
-static std::unique_ptr<ExprAST> primary_expression(std::list<Token> &tokens) {
+static std::unique_ptr<ExprAST> primary_expression(std::list<Token> &tokens,
+                                                   ParseError &err) {
     FUNCTION_CALL_TRACE(tokens.front().str);
     switch (tokens.front().type) {
     default:
-        throw expr_error("unknown token when expecting an expression");
+        return fail(err, PARSE_EXPECTED_EXPRESSION, tokens.front());
     case IMM:
     case IMMX:
     case IMMB:
-        return integer_expression(tokens);
+        return integer_expression(tokens, err);
     case VAR:
-    case REG:
         return variable_expression(tokens);
+    case REG:
+        return register_expression(tokens);
+    case FUNC:
+        return call_expression(tokens, err);
     case PARL: {
-        tokens.pop_front();          // eat (.
-        auto V = expression(tokens); // expression
-        assert(V);
+        tokens.pop_front();               // eat (.
+        auto V = expression(tokens, err); // expression
+        if (!V) {
+            return nullptr;
+        }
         //副次式を解析した後、”)”の出現がない可能性がある。
         if (tokens.front().type != PARR) {
-            throw expr_error("expected ')'");
+            return fail(err, PARSE_EXPECTED_PARR, tokens.front());
         }
         tokens.pop_front(); // eat ).
         return V;
@@ -720,35 +767,288 @@ static std::unique_ptr<ExprAST> primary_expression(std::list<Token> &tokens) {
     }
 }
 
+//-----------------------------------------------------------------------------
+// parse - the whole of tokens
+static std::unique_ptr<ExprAST> parse(std::list<Token> &tokens,
+                                      ParseError &err) {
+    auto V = expression(tokens, err);
+    if (!V || tokens.front().type == EOL) {
+        return V;
+    }
+    return fail(err,
+                tokens.front().type == PARR ? PARSE_EXPECTED_PARL
+                                            : PARSE_EXPECTED_OPERATOR,
+                tokens.front());
+}
+
 //=============================================================================
 std::unique_ptr<ExprAST> parser(std::list<Token> &tokens) {
-    auto V = expression(tokens);
-    if (tokens.front().type == EOL) {
-        return V;
+    ParseError err;
+    auto V = parse(tokens, err);
+    if (!V) {
+        throw expr_error(err.message());
     }
+    return V;
+}
 
-    if (tokens.front().type == PARR) {
-        throw expr_error("expected '('");
-    } else {
-        throw expr_error("unknown token when expecting an operator '" +
-                         tokens.front().str + "'");
+//-----------------------------------------------------------------------------
+std::string ParseError::message() const {
+    switch (code) {
+    case PARSE_OK:
+        break;
+    case PARSE_INVALID_TOKEN:
+        return "invalid token";
+    case PARSE_OUT_OF_RANGE:
+        return "integer literal out of range '" + token + "'";
+    case PARSE_EXPECTED_EXPRESSION:
+        return "unknown token when expecting an expression";
+    case PARSE_EXPECTED_OPERATOR:
+        return "unknown token when expecting an operator '" + token + "'";
+    case PARSE_EXPECTED_PARL:
+        return "expected '('";
+    case PARSE_EXPECTED_PARR:
+        return "expected ')'";
+    case PARSE_EXPECTED_COLON:
+        return "expected ':'";
+    case PARSE_ARGUMENTS: {
+        const Builtin *func = builtin(token.data(), token.size());
+        int arity = func ? func->arity : 0;
+        return token + "() takes " + std::to_string(arity) + " argument" +
+               (arity > 1 ? "s" : "");
     }
-    // unreachable
-    return nullptr;
+    }
+    return "";
 }
 
+//=============================================================================
+// bind REG operands to the host register file
+void bind(ExprAST &ast, const std::vector<RegisterBank> &regs) {
+    if (ast.type == REG) {
+        auto &node = static_cast<RegisterExprAST &>(ast);
+        node.Reg = nullptr;
+        for (auto &bank : regs) {
+            if (bank.name != node.Bank) {
+                continue;
+            }
+            if (node.Index >= bank.size) {
+                throw expr_error("register index out of range '" + node.Name +
+                                 "'");
+            }
+            node.Reg = &bank.regs[node.Index];
+            break;
+        }
+        return;
+    }
+    for_each_child(ast, [&](std::unique_ptr<ExprAST> &child) {
+        bind(*child, regs);
+    });
+}
+
+//=============================================================================
+// symbols read and written by ast
+
+//-----------------------------------------------------------------------------
+// symbol_id - interned id of a variable or unbound register, -1 otherwise
+static int symbol_id(const ExprAST &ast) {
+    if (ast.type == VAR) {
+        return static_cast<const VariableExprAST &>(ast).Id;
+    }
+    if (ast.type == REG) {
+        auto &node = static_cast<const RegisterExprAST &>(ast);
+        return node.Reg ? -1 : node.Id;
+    }
+    return -1;
+}
+
+static void references(ExprAST &ast, References &refs) {
+    if (ast.type == VAR || ast.type == REG) {
+        int id = symbol_id(ast);
+        if (id >= 0) {
+            refs.reads.push_back(id);
+        }
+        return;
+    }
+    if (ASSIGN_BIGIN < ast.type && ast.type < ASSIGN_END) {
+        auto &node = static_cast<AssignExprAST &>(ast);
+        int id = symbol_id(*node.lhs);
+        if (id >= 0) {
+            if (ast.type != ASSIGN) { // compound assignment reads lhs too
+                refs.reads.push_back(id);
+            }
+            refs.writes.push_back(id);
+        }
+        references(*node.rhs, refs);
+        return;
+    }
+    for_each_child(ast, [&](std::unique_ptr<ExprAST> &child) {
+        references(*child, refs);
+    });
+}
+
+References references(ExprAST &ast) {
+    References refs;
+    references(ast, refs);
+    return refs;
+}
+
+//=============================================================================
+// unparse
+
+//-----------------------------------------------------------------------------
+const char *op_str(Type type) {
+    if (type == PLUS) {
+        return "+";
+    }
+    if (type == MINUS) {
+        return "-";
+    }
+    if (type == DIVM) {
+        return "/";
+    }
+    if (type == MODM) {
+        return "%";
+    }
+    if (const Builtin *func = builtin(type)) {
+        return func->name;
+    }
+    for (auto &op : operators) {
+        if (op.type == type) {
+            return op.str;
+        }
+    }
+    return "";
+}
+
+//-----------------------------------------------------------------------------
+static std::string operand(ExprAST &ast) {
+    if (ast.type == IMM || ast.type == VAR || ast.type == REG ||
+        ast.type == PLUS || ast.type == MINUS || ast.type == INV ||
+        ast.type == NOT || (CALL_BIGIN < ast.type && ast.type < CALL_END)) {
+        return unparse(ast);
+    }
+    return "(" + unparse(ast) + ")";
+}
+
+std::string unparse(ExprAST &ast) {
+    switch (ast.type) {
+    case IMM:
+        return std::to_string(static_cast<IntegerExprAST &>(ast).Val);
+    case VAR:
+        return static_cast<VariableExprAST &>(ast).Name;
+    case REG:
+        return static_cast<RegisterExprAST &>(ast).Name;
+    case PLUS:
+    case MINUS:
+    case INV:
+    case NOT:
+        return op_str(ast.type) +
+               operand(*static_cast<UnaryExprAST &>(ast).rhs);
+    case QUESTION: {
+        auto &node = static_cast<ConditionalExprAST &>(ast);
+        return operand(*node.cond) + " ? " + operand(*node.lhs) + " : " +
+               operand(*node.rhs);
+    }
+    default:
+        break;
+    }
+    if (BINOP_BIGIN < ast.type && ast.type < BINOP_END) {
+        auto &node = static_cast<BinaryExprAST &>(ast);
+        return operand(*node.lhs) + " " + op_str(ast.type) + " " +
+               operand(*node.rhs);
+    }
+    if (ASSIGN_BIGIN < ast.type && ast.type < ASSIGN_END) {
+        auto &node = static_cast<AssignExprAST &>(ast);
+        return unparse(*node.lhs) + " " + op_str(ast.type) + " " +
+               operand(*node.rhs);
+    }
+    if (CALL_BIGIN < ast.type && ast.type < CALL_END) {
+        std::string result = op_str(ast.type);
+        const char *sep = "(";
+        for (auto &arg : static_cast<CallExprAST &>(ast).args) {
+            result += sep + unparse(*arg);
+            sep = ", ";
+        }
+        return result + ")";
+    }
+    throw expr_error("unknown operator");
+}
+
+//-----------------------------------------------------------------------------
+// checked arithmetic (see arith.h)
+thread_local bool Checked::current = false;
+
+// "overflow in 'x + 1' (2147483647 + 1)", "overflow in 2147483647 + 1"
+void overflow(Type op, int a, int b, ExprAST *node) {
+    std::string operation =
+        op == MINUS ? "-(" + std::to_string(a) + ")"
+                    : std::to_string(a) + " " + op_str(op) + " " +
+                          std::to_string(b);
+    bool shift = (op == SFTL || op == SFTR) && (b & 31) != b;
+    throw expr_error(
+        std::string(shift ? "shift out of range in " : "overflow in ") +
+        (node ? "'" + unparse(*node) + "' (" + operation + ")" : operation));
+}
+
+void division_by_zero(ExprAST *node) {
+    throw expr_error(node ? "division by zero in '" + unparse(*node) + "'"
+                          : "division by zero");
+}
+
+#if EXPR_STATS
+//-----------------------------------------------------------------------------
+// count_nodes - number of nodes of ast
+static uint64_t count_nodes(ExprAST &ast) {
+    uint64_t n = 1;
+    for_each_child(ast, [&](std::unique_ptr<ExprAST> &child) {
+        n += count_nodes(*child);
+    });
+    return n;
+}
+#endif
+
 //=============================================================================
 // evalute expr_str
+ParseResult try_parse(const std::string &expr_str) {
+    ParseResult result;
+    std::list<Token> tokens;
+    {
+        EXPR_STATS_PHASE(stats::LEX);
+        if (!lex(expr_str, tokens, result.error)) {
+            return result;
+        }
+    }
+    EXPR_STATS_ADD(tokens, tokens.size() - 1); // without EOL
+    {
+        EXPR_STATS_PHASE(stats::PARSE);
+        result.ast = parse(tokens, result.error);
+    }
+    if (result.ast) {
+        EXPR_STATS_ADD(nodes, count_nodes(*result.ast));
+    }
+    return result;
+}
+
 std::unique_ptr<ExprAST> parser(const std::string &expr_str) {
-    auto tokens = lexer(expr_str);
-    return parser(tokens);
+    auto result = try_parse(expr_str);
+    if (!result) {
+        throw expr_error(result.error.message());
+    }
+    return std::move(result.ast);
 }
 
 //=============================================================================
 // evalute expr_str
-int eval(const std::string expr_str,
+int eval(const std::string &expr_str,
         std::function<int&(const std::string &)> fp){
-    return parser(expr_str)->eval(fp);
+    auto ast = parser(expr_str);
+    EXPR_STATS_PHASE(stats::EVAL);
+    return ast->eval(fp);
+}
+
+int eval(const std::string &expr_str, SymbolTable &symbols) {
+    auto ast = parser(expr_str);
+    EXPR_STATS_PHASE(stats::EVAL);
+    return ast->eval(symbols);
 }
 
 } // namespace expr
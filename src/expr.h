@@ -2,8 +2,11 @@
 
 #include <list>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <vector>
 #include <functional>
+#include "symbol.h"
 
 //-----------------------------------------------------------------------------
 /*
@@ -27,6 +30,13 @@ b = (1 + 2 * 3) ? (4 * 5 + 6) : (7 + 8 * 9)
         int bar = expr::eval(symbol, getVar));		//bar = foo = 2
 ```
 
+## Evaluation of expressions (with symbol table)
+```cpp
+        expr::SymbolTable symbols;
+        symbols["foo"] = 2;
+        int bar = expr::eval("foo * 3", symbols);	//bar = 6
+```
+
 ## Create Abstract Syntax Tree
 ```cpp
         std::map<std::string, int> M;
@@ -38,6 +48,23 @@ b = (1 + 2 * 3) ? (4 * 5 + 6) : (7 + 8 * 9)
         auto myAST = expr::parser("r0>=100 && r1<10 || r2!= 5");
         int cond = myAST->eval(getVar);
 ```
+
+## Syntax errors without exceptions
+```cpp
+        auto result = expr::try_parse("(1 + 2");
+        if (!result) {
+                // result.error.code == expr::PARSE_EXPECTED_PARR
+                // result.error.offset == 6, result.error.message()
+        }
+```
+
+## Register operands
+```cpp
+        int R[16];
+        auto myAST = expr::parser("%r0 + %r1");
+        expr::bind(*myAST, {{'r', R, 16}});	// %r0 -> R[0], %r1 -> R[1]
+        int sum = myAST->eval();
+```
 */
 
 namespace expr {
@@ -96,12 +123,27 @@ enum Type {
     MUL,  // *  multiplicative_expression
     DIV,  // /  multiplicative_expression
     MOD,  // %  multiplicative_expression
+    DIVM, // /  division by an invariant divisor (node type only)
+    MODM, // %  modulo by an invariant divisor (node type only)
     BINOP_END,
 
     // unary_expression
-    INV, // ~  unary_expression
-    NOT, // !  unary_expression
+    INV,   // ~  unary_expression
+    NOT,   // !  unary_expression
+    PLUS,  // +  unary_expression (node type only)
+    MINUS, // -  unary_expression (node type only)
 
+    // builtin_function_call
+    COMMA, // ,  argument separator
+    FUNC,  //    builtin function name (token only)
+    CALL_BIGIN,
+    POPCNT,  // popcnt(x)             number of 1 bits
+    CLZ,     // clz(x)                leading zero bits
+    CTZ,     // ctz(x)                trailing zero bits
+    BSWAP,   // bswap(x)              byte swap
+    BITS,    // bits(x, hi, lo)       bits [hi:lo] of x
+    SETBITS, // setbits(x, hi, lo, v) x with bits [hi:lo] set to v
+    CALL_END,
 };
 
 //-----------------------------------------------------------------------------
@@ -109,8 +151,11 @@ enum Type {
 struct Token {
     Type type;       // token type
     std::string str; // token string
-    Token(void) : type(EOL), str(""){};
-    Token(Type _type, std::string _str) : type(_type), str(std::move(_str)){};
+    int id;          // interned symbol id (VAR/REG), -1 otherwise
+    size_t pos;      // byte offset in the line (set by lexer)
+    Token(void) : type(EOL), str(""), id(-1), pos(0){};
+    Token(Type _type, std::string _str, int _id = -1)
+        : type(_type), str(std::move(_str)), id(_id), pos(0){};
 };
 
 //-----------------------------------------------------------------------------
@@ -121,6 +166,15 @@ class ExprAST {
     explicit ExprAST(const Type _type) : type(_type) {}
     virtual ~ExprAST() = default;
     virtual int eval(std::function<int&(const std::string &)> fp = nullptr) = 0;
+    virtual int eval(SymbolTable &symbols) = 0;
+};
+
+//-----------------------------------------------------------------------------
+// register bank supplied by the host for REG operands ("%r12" : bank 'r')
+struct RegisterBank {
+    char name;   // bank letter
+    int *regs;   // contiguous register array
+    size_t size; // number of registers in regs
 };
 
 //-----------------------------------------------------------------------------
@@ -130,6 +184,35 @@ typedef std::runtime_error expr_error;
 // class expr_error : public std::runtime_error {
 //};
 
+//-----------------------------------------------------------------------------
+// syntax error without exception (see try_parse)
+enum ParseCode {
+    PARSE_OK = 0,
+    PARSE_INVALID_TOKEN,       // no token matches at offset
+    PARSE_OUT_OF_RANGE,        // integer literal does not fit
+    PARSE_EXPECTED_EXPRESSION, // e.g. "1 +"
+    PARSE_EXPECTED_OPERATOR,   // e.g. "1 2"
+    PARSE_EXPECTED_PARL,       // e.g. "1)"
+    PARSE_EXPECTED_PARR,       // e.g. "(1"
+    PARSE_EXPECTED_COLON,      // e.g. "a ? 1"
+    PARSE_ARGUMENTS,           // wrong number of arguments of a builtin
+};
+
+struct ParseError {
+    ParseCode code;
+    size_t offset;     // byte offset of token in the line
+    std::string token; // offending token ("" at end of line)
+    ParseError() : code(PARSE_OK), offset(0) {}
+    // text of the expr_error thrown by parser(), e.g. "expected ')'"
+    std::string message() const;
+};
+
+struct ParseResult {
+    std::unique_ptr<ExprAST> ast; // nullptr on error
+    ParseError error;
+    explicit operator bool() const { return ast != nullptr; }
+};
+
 //=============================================================================
 // functions
 
@@ -141,10 +224,38 @@ std::list<Token> lexer(const std::string &line);
 // parser
 std::unique_ptr<ExprAST> parser(std::list<Token> &tokens);
 std::unique_ptr<ExprAST> parser(const std::string &expr_str);
+// parser that reports syntax errors in the result instead of throwing,
+// for validating many lines of which a large share may be malformed
+ParseResult try_parse(const std::string &expr_str);
+
+//-----------------------------------------------------------------------------
+// bind REG operands of ast to the host register file.
+// Indices are checked here once (expr_error if out of range), so evaluation
+// reads registers without any lookup. Banks not in regs stay unbound and
+// are resolved like variables.
+void bind(ExprAST &ast, const std::vector<RegisterBank> &regs);
+
+//-----------------------------------------------------------------------------
+// symbols (interned ids) read and written by ast, in evaluation order.
+// Bound registers are not symbols and are not reported.
+struct References {
+    std::vector<int> reads;
+    std::vector<int> writes;
+};
+References references(ExprAST &ast);
+
+//-----------------------------------------------------------------------------
+// source text of an operator ("+" for ADD and PLUS) or the name of a builtin
+// function ("popcnt" for POPCNT), "" if type is neither
+const char *op_str(Type type);
+// source text of ast. Operands other than literals, symbols, unary
+// expressions and function calls are parenthesized.
+std::string unparse(ExprAST &ast);
 
 //-----------------------------------------------------------------------------
 // evalute expr_str
-int eval(const std::string expr_str,
+int eval(const std::string &expr_str,
         std::function<int&(const std::string &)> fp = nullptr);
+int eval(const std::string &expr_str, SymbolTable &symbols);
 
 } // namespace expr
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "format.h"
+#include <string.h>
+
+namespace expr {
+
+//=============================================================================
+// lookup tables
+
+//-----------------------------------------------------------------------------
+// "00" "01" ... "99"
+static const char dec_digits[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+//-----------------------------------------------------------------------------
+// "00" "01" ... "ff" (built at compile time)
+struct HexTable {
+    char digits[512];
+    constexpr HexTable() : digits{} {
+        const char hex[] = "0123456789abcdef";
+        for (int i = 0; i < 256; i++) {
+            digits[i * 2] = hex[i >> 4];
+            digits[i * 2 + 1] = hex[i & 0xF];
+        }
+    }
+};
+static constexpr HexTable hex_table;
+
+//-----------------------------------------------------------------------------
+// "0000" "0001" ... "1111"
+struct BinTable {
+    char digits[64];
+    constexpr BinTable() : digits{} {
+        for (int i = 0; i < 16; i++) {
+            for (int b = 0; b < 4; b++) {
+                digits[i * 4 + b] = (i >> (3 - b)) & 1 ? '1' : '0';
+            }
+        }
+    }
+};
+static constexpr BinTable bin_table;
+
+//=============================================================================
+// integer formatter
+
+//-----------------------------------------------------------------------------
+char *format_hex(char *out, uint32_t val) {
+    *out++ = '0';
+    *out++ = 'x';
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        memcpy(out, &hex_table.digits[((val >> shift) & 0xFF) * 2], 2);
+        out += 2;
+    }
+    return out;
+}
+
+//-----------------------------------------------------------------------------
+// write_dec - decimal digits of u
+template <class T> static char *write_dec(char *out, T u) {
+    // write two digits at a time from the end of a scratch buffer
+    char tmp[U64_MAX];
+    char *p = tmp + sizeof(tmp);
+    while (u >= 100) {
+        p -= 2;
+        memcpy(p, &dec_digits[(u % 100) * 2], 2);
+        u /= 100;
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, &dec_digits[u * 2], 2);
+    } else {
+        *--p = static_cast<char>('0' + u);
+    }
+
+    size_t len = static_cast<size_t>(tmp + sizeof(tmp) - p);
+    memcpy(out, p, len);
+    return out + len;
+}
+
+//-----------------------------------------------------------------------------
+char *format_dec(char *out, int val) {
+    uint32_t u = static_cast<uint32_t>(val);
+    if (val < 0) {
+        *out++ = '-';
+        u = 0u - u;
+    }
+    return write_dec(out, u);
+}
+
+//-----------------------------------------------------------------------------
+char *format_u64(char *out, uint64_t val) { return write_dec(out, val); }
+
+//-----------------------------------------------------------------------------
+char *format_bin(char *out, uint32_t val) {
+    *out++ = '0';
+    *out++ = 'b';
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        memcpy(out, &bin_table.digits[((val >> shift) & 0xF) * 4], 4);
+        out += 4;
+    }
+    return out;
+}
+
+//=============================================================================
+// Sink
+
+//-----------------------------------------------------------------------------
+void Sink::write(const char *str, size_t len) {
+    if (len > buf.size()) { // too large to buffer
+        drain();
+        fwrite(str, 1, len, fp);
+        return;
+    }
+    memcpy(reserve(len), str, len);
+    pos += len;
+}
+
+//-----------------------------------------------------------------------------
+Sink &Sink::operator<<(const char *str) {
+    write(str, strlen(str));
+    return *this;
+}
+
+//-----------------------------------------------------------------------------
+void Sink::drain() {
+    if (pos) {
+        fwrite(buf.data(), 1, pos, fp);
+        pos = 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+void Sink::flush() {
+    drain();
+    fflush(fp);
+}
+
+} // namespace expr
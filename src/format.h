@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace expr {
+
+//=============================================================================
+// integer formatter
+// Each function writes into out without a terminating '\0' and returns the
+// end of what it wrote. out must have room for the *_MAX characters.
+
+enum { HEX_MAX = 10, DEC_MAX = 11, BIN_MAX = 34, U64_MAX = 20 };
+
+// "0x%08x"
+char *format_hex(char *out, uint32_t val);
+// "%d"
+char *format_dec(char *out, int val);
+// "%llu"
+char *format_u64(char *out, uint64_t val);
+// "0b" + 32 binary digits
+char *format_bin(char *out, uint32_t val);
+
+//=============================================================================
+// Sink - buffered output to a FILE.
+// Nothing is written until the buffer is full, flush() is called or the sink
+// is destroyed.
+class Sink {
+  public:
+    explicit Sink(FILE *fp, size_t size = 1 << 16)
+        : fp(fp), buf(size), pos(0) {}
+    ~Sink() { flush(); }
+    Sink(const Sink &) = delete;
+    Sink &operator=(const Sink &) = delete;
+
+    // room for at least n bytes; write there, then advance with commit()
+    char *reserve(size_t n) {
+        if (buf.size() - pos < n) {
+            drain();
+            if (buf.size() < n) {
+                buf.resize(n);
+            }
+        }
+        return &buf[pos];
+    }
+    void commit(char *end) { pos = static_cast<size_t>(end - buf.data()); }
+
+    void write(const char *str, size_t len);
+    void write(const std::string &str) { write(str.data(), str.size()); }
+    void put(char c) { *reserve(1) = c, pos++; }
+
+    Sink &operator<<(const char *str);
+    Sink &operator<<(const std::string &str) {
+        write(str);
+        return *this;
+    }
+    Sink &operator<<(char c) {
+        put(c);
+        return *this;
+    }
+    Sink &operator<<(int val) {
+        commit(format_dec(reserve(DEC_MAX), val));
+        return *this;
+    }
+
+    void flush(); // write out the buffer and flush fp
+
+  private:
+    FILE *fp;
+    std::vector<char> buf;
+    size_t pos;
+    void drain(); // write out the buffer
+};
+
+} // namespace expr
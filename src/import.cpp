@@ -0,0 +1,269 @@
+#include "import.h"
+#include "expr.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include <algorithm>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// a line of a chunk that defines or may define a symbol
+struct ImportItem {
+    const char *text; // name (fast) or the whole line (expression)
+    uint32_t len;
+    uint32_t line; // line number in the chunk, from 0
+    int value;     // fast only
+    enum { FAST, EXPRESSION } kind;
+    bool comma; // expression with a comma before any '=': a header or an
+                // invalid record unless it parses
+};
+
+struct ImportChunk {
+    const char *begin;
+    const char *end;
+    uint32_t lines;
+    std::vector<ImportItem> items;
+};
+
+//-----------------------------------------------------------------------------
+static inline bool is_digit(char c) { return '0' <= c && c <= '9'; }
+static inline bool is_alpha(char c) {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
+static inline bool is_space(char c) { return c == ' ' || c == '\t'; }
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p != end && is_space(*p)) {
+        p++;
+    }
+    return p;
+}
+
+// scan_name - end of the VAR or REG token at p, p if there is none
+static const char *scan_name(const char *p, const char *end) {
+    const char *q = p;
+    if (q != end && is_alpha(*q)) {
+        for (q++; q != end && (is_alpha(*q) || is_digit(*q)); q++) {
+        }
+        return q;
+    }
+    if (end - q > 2 && *q == '%' && is_alpha(q[1]) && is_digit(q[2])) {
+        for (q += 2; q != end && is_digit(*q); q++) {
+        }
+        return q;
+    }
+    return p;
+}
+
+//-----------------------------------------------------------------------------
+// parse_literal - value of [p, end) if it is [-](decimal | 0x.. | 0b..).
+// Literals the parser would reject or truncate (too many digits, decimal
+// above INT_MAX) are left to the evaluator, so both give the same result.
+static bool parse_literal(const char *p, const char *end, int &value) {
+    bool neg = p != end && *p == '-';
+    if (neg) {
+        p++;
+    }
+    if (p == end) {
+        return false;
+    }
+    uint64_t v = 0;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        if (end - p > 2 + 8) {
+            return false;
+        }
+        for (p += 2; p != end; p++) {
+            int d;
+            if (is_digit(*p)) {
+                d = *p - '0';
+            } else if ('a' <= (*p | 0x20) && (*p | 0x20) <= 'f') {
+                d = (*p | 0x20) - 'a' + 10;
+            } else {
+                return false;
+            }
+            v = v * 16 + d;
+        }
+    } else if (end - p > 2 && p[0] == '0' && (p[1] == 'b' || p[1] == 'B')) {
+        if (end - p > 2 + 32) {
+            return false;
+        }
+        for (p += 2; p != end; p++) {
+            if (*p != '0' && *p != '1') {
+                return false;
+            }
+            v = v * 2 + (*p - '0');
+        }
+    } else {
+        if (end - p > 10) {
+            return false;
+        }
+        for (; p != end; p++) {
+            if (!is_digit(*p)) {
+                return false;
+            }
+            v = v * 10 + (*p - '0');
+        }
+        if (v > INT_MAX) {
+            return false;
+        }
+    }
+    uint32_t u = static_cast<uint32_t>(v);
+    value = static_cast<int>(neg ? 0u - u : u);
+    return true;
+}
+
+// unquote - strip spaces and one pair of double quotes around a CSV field
+static void unquote(const char *&p, const char *&end) {
+    p = skip_space(p, end);
+    while (end != p && is_space(end[-1])) {
+        end--;
+    }
+    if (end - p >= 2 && *p == '"' && end[-1] == '"') {
+        p++;
+        end--;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// scan_line - classify one line (without '\n')
+static void scan_line(const char *p, const char *end, uint32_t line,
+                      std::vector<ImportItem> &items) {
+    p = skip_space(p, end);
+    while (end != p && (is_space(end[-1]) || end[-1] == '\r')) {
+        end--;
+    }
+    if (p == end || *p == '#') {
+        return;
+    }
+
+    // CSV : name,value[,...]; any other line with a comma may be an
+    // expression, e.g. "bits(y, 7, 4) == 1 ? (z = 1) : (z = 2)"
+    const char *comma = static_cast<const char *>(memchr(p, ',', end - p));
+    const char *eq = static_cast<const char *>(memchr(p, '=', end - p));
+    bool record = comma && (!eq || comma < eq);
+    if (record) {
+        const char *name = p;
+        const char *name_end = comma;
+        unquote(name, name_end);
+        const char *field = comma + 1;
+        const char *field_end = static_cast<const char *>(
+            memchr(field, ',', end - field));
+        if (!field_end) {
+            field_end = end;
+        }
+        unquote(field, field_end);
+        int value;
+        if (name != name_end && scan_name(name, name_end) == name_end &&
+            parse_literal(field, field_end, value)) {
+            items.push_back(ImportItem{name, uint32_t(name_end - name), line,
+                                       value, ImportItem::FAST, false});
+            return;
+        }
+    }
+
+    // name = literal
+    const char *name_end = scan_name(p, end);
+    if (name_end != p) {
+        const char *q = skip_space(name_end, end);
+        int value;
+        if (q != end && *q == '=' && (q + 1 == end || q[1] != '=') &&
+            parse_literal(skip_space(q + 1, end), end, value)) {
+            items.push_back(ImportItem{p, uint32_t(name_end - p), line, value,
+                                       ImportItem::FAST, false});
+            return;
+        }
+    }
+    items.push_back(ImportItem{p, uint32_t(end - p), line, 0,
+                               ImportItem::EXPRESSION, record});
+}
+
+static void scan_chunk(ImportChunk &chunk) {
+    const char *p = chunk.begin;
+    uint32_t line = 0;
+    while (p != chunk.end) {
+        auto eol = static_cast<const char *>(memchr(p, '\n', chunk.end - p));
+        const char *next = eol ? eol + 1 : chunk.end;
+        scan_line(p, eol ? eol : chunk.end, line++, chunk.items);
+        p = next;
+    }
+    chunk.lines = line;
+}
+
+//-----------------------------------------------------------------------------
+ImportResult import_symbols(const std::string &path, SymbolTable &symbols,
+                            size_t workers) {
+    MappedFile file(path);
+    file.sequential();
+    const char *base = file.data();
+    size_t size = file.size();
+
+    // chunks start at line boundaries; a few per worker to balance them
+    workers = std::max<size_t>(1, workers);
+    size_t n = std::min<size_t>(workers * 4, size / 4096 + 1);
+    std::vector<ImportChunk> chunks(n);
+    size_t begin = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t end = i + 1 == n ? size : std::max(begin, size * (i + 1) / n);
+        if (end < size) {
+            auto eol =
+                static_cast<const char *>(memchr(base + end, '\n', size - end));
+            end = eol ? eol - base + 1 : size;
+        }
+        chunks[i].begin = base + begin;
+        chunks[i].end = base + end;
+        begin = end;
+    }
+    parallel_for(n, workers, [&](size_t first, size_t last, size_t) {
+        for (size_t i = first; i < last; i++) {
+            scan_chunk(chunks[i]);
+        }
+    });
+
+    // store in input order
+    size_t items = 0;
+    for (auto &chunk : chunks) {
+        items += chunk.items.size();
+    }
+    interner().reserve(interner().size() + items);
+    symbols.reserve(symbols.size() + items);
+
+    ImportResult result = {0, 0, 0, {}};
+    auto fail = [&](size_t line, const std::string &msg) {
+        result.error_count++;
+        if (result.errors.size() < IMPORT_ERRORS) {
+            result.errors.push_back("line " + std::to_string(line) + ": " +
+                                    msg);
+        }
+    };
+    size_t line0 = 1;
+    std::string text;
+    for (auto &chunk : chunks) {
+        for (auto &item : chunk.items) {
+            text.assign(item.text, item.len);
+            if (item.kind == ImportItem::FAST) {
+                symbols.ref(interner().intern(text)) = item.value;
+                result.fast++;
+            } else if (auto parsed = try_parse(text)) {
+                try {
+                    parsed.ast->eval(symbols);
+                    result.evaluated++;
+                } catch (const std::runtime_error &e) {
+                    fail(line0 + item.line, e.what());
+                }
+            } else if (item.comma) {
+                if (line0 + item.line > 1) { // a header is not an error
+                    fail(line0 + item.line, "invalid record '" + text + "'");
+                }
+            } else {
+                fail(line0 + item.line, parsed.error.message());
+            }
+        }
+        line0 += chunk.lines;
+    }
+    return result;
+}
+
+} // namespace expr
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "symbol.h"
+#include <string>
+#include <vector>
+
+namespace expr {
+
+//=============================================================================
+// import - define symbols from a text file, e.g. a register map dump.
+// Each line is one of
+//   name = literal           fast path (no lexer or parser)
+//   name,literal[,...]       CSV record; further fields are ignored
+//   any other expression     evaluated like a REPL line
+// where literal is a decimal, 0x or 0b integer with an optional '-'.
+// Empty lines and lines starting with '#' are skipped. A line with a comma
+// before any '=' that is neither a record nor an expression is an invalid
+// record, except on the first line (a header).
+//
+// The file is mapped and split into chunks that are scanned on all
+// workers; the fast lines are then stored in bulk. The result is the same
+// as evaluating the lines in order: an expression sees every symbol
+// defined above it.
+struct ImportResult {
+    size_t fast;        // lines stored on the fast path
+    size_t evaluated;   // lines evaluated as expressions
+    size_t error_count; // lines that failed
+    std::vector<std::string> errors; // "line N: message", the first few
+};
+
+enum { IMPORT_ERRORS = 10 }; // messages kept in ImportResult::errors
+
+// throws expr_error if path cannot be read
+ImportResult import_symbols(const std::string &path, SymbolTable &symbols,
+                            size_t workers);
+
+} // namespace expr
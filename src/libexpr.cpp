@@ -0,0 +1,242 @@
+#include "libexpr.h"
+#include "aggregate.h"
+#include "program.h"
+#include <algorithm>
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+// handle
+// index[i] is the element of the caller's array that holds slot i. Unless
+// every slot is at its own index, the slots are gathered into a local array
+// before evaluation and the assigned ones are scattered back after it.
+struct expr_program {
+    std::unique_ptr<expr::Program> prog;
+    std::vector<size_t> index;   // caller's index of each slot
+    std::vector<size_t> written; // slots assigned by the expression
+    bool identity;               // index[i] == i for every slot
+};
+
+static thread_local std::string last_error;
+
+static void fail(const char *what) { last_error = what; }
+static void succeed() {
+    if (!last_error.empty()) {
+        last_error.clear();
+    }
+}
+
+//-----------------------------------------------------------------------------
+// eval - evaluate with slots laid out as in prog->index, dividing by prepared
+// (see prepare below) or, if nullptr, by the literal divisors only
+static int eval(const expr_program *p, int *slots,
+                const expr::Divisor *prepared = nullptr) {
+    if (p->identity) {
+        return prepared ? p->prog->eval(slots, prepared)
+                        : p->prog->eval(slots);
+    }
+    size_t n = p->index.size();
+    int small[16];
+    static thread_local std::vector<int> large;
+    int *local = small;
+    if (n > sizeof(small) / sizeof(small[0])) {
+        if (large.size() < n) {
+            large.resize(n); // grows once per thread
+        }
+        local = large.data();
+    }
+    for (size_t i = 0; i < n; i++) {
+        local[i] = slots[p->index[i]];
+    }
+    int val = prepared ? p->prog->eval(local, prepared) : p->prog->eval(local);
+    for (size_t i : p->written) {
+        slots[p->index[i]] = local[i];
+    }
+    return val;
+}
+
+// prepare - divisors of p for a batch whose first record is slots, kept
+// until the next call on this thread; nullptr if p does not divide by
+// symbols or literals
+static const expr::Divisor *prepare(const expr_program *p,
+                                    const int *slots) {
+    size_t n = p->prog->divisions();
+    if (!n) {
+        return nullptr;
+    }
+    static thread_local std::vector<expr::Divisor> prepared;
+    static thread_local std::vector<int> local;
+    if (prepared.size() < n) {
+        prepared.resize(n); // grows once per thread
+    }
+    if (!p->identity) {
+        if (local.size() < p->index.size()) {
+            local.resize(p->index.size());
+        }
+        for (size_t i = 0; i < p->index.size(); i++) {
+            local[i] = slots[p->index[i]];
+        }
+        slots = local.data();
+    }
+    p->prog->prepare(slots, prepared.data());
+    return prepared.data();
+}
+
+//=============================================================================
+// C API
+extern "C" {
+
+int expr_abi_version(void) { return EXPR_ABI_VERSION; }
+
+//-----------------------------------------------------------------------------
+expr_program *expr_compile(const char *src, size_t len) {
+    try {
+        auto ast = expr::parser(std::string(src, len));
+        std::unique_ptr<expr_program> p(new expr_program);
+        p->prog = expr::compile(*ast);
+        auto &ids = p->prog->symbols();
+        for (size_t i = 0; i < ids.size(); i++) {
+            p->index.push_back(i);
+        }
+        for (int id : expr::references(*ast).writes) {
+            size_t slot = std::find(ids.begin(), ids.end(), id) - ids.begin();
+            if (slot < ids.size()) {
+                p->written.push_back(slot);
+            }
+        }
+        p->identity = true;
+        succeed();
+        return p.release();
+    } catch (const std::exception &e) {
+        fail(e.what());
+        return nullptr;
+    }
+}
+
+//-----------------------------------------------------------------------------
+const char *expr_last_error(void) { return last_error.c_str(); }
+
+size_t expr_slots(const expr_program *prog) { return prog->index.size(); }
+
+const char *expr_slot_name(const expr_program *prog, size_t slot) {
+    if (slot >= prog->index.size()) {
+        return nullptr;
+    }
+    return expr::interner().name(prog->prog->symbols()[slot]).c_str();
+}
+
+//-----------------------------------------------------------------------------
+int expr_bind(expr_program *prog, const char *name, size_t index) {
+    int id = expr::interner().find(name);
+    auto &ids = prog->prog->symbols();
+    auto itr = std::find(ids.begin(), ids.end(), id);
+    if (id < 0 || itr == ids.end()) {
+        fail("unknown symbol");
+        return -1;
+    }
+    prog->index[itr - ids.begin()] = index;
+    prog->identity = true;
+    for (size_t i = 0; i < prog->index.size(); i++) {
+        prog->identity = prog->identity && prog->index[i] == i;
+    }
+    succeed();
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+int expr_eval(const expr_program *prog, int *slots, int *result) {
+    try {
+        *result = eval(prog, slots);
+        succeed();
+        return 0;
+    } catch (const std::exception &e) { // e.g. division by zero
+        fail(e.what());
+        return -1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+size_t expr_eval_batch(const expr_program *prog, int *slots, size_t stride,
+                       size_t count, int *results) {
+    size_t i = 0;
+    try {
+        const expr::Divisor *prepared = count ? prepare(prog, slots) : nullptr;
+        for (; i < count; i++, slots += stride) {
+            results[i] = eval(prog, slots, prepared);
+        }
+        succeed();
+    } catch (const std::exception &e) {
+        fail(e.what());
+    }
+    return i;
+}
+
+//-----------------------------------------------------------------------------
+static expr::Accumulator reduce(const expr_program *prog,
+                                expr::AggregateKind kind, int *slots,
+                                size_t stride, size_t count, size_t workers) {
+    return expr::reduce(kind, count, workers ? workers : expr::concurrency(),
+                        [=](uint64_t begin, uint64_t end, int *values) {
+                            if (begin == end) {
+                                return;
+                            }
+                            auto prepared =
+                                prepare(prog, slots + begin * stride);
+                            for (uint64_t i = begin; i < end; i++) {
+                                values[i - begin] =
+                                    eval(prog, slots + i * stride, prepared);
+                            }
+                        });
+}
+
+int expr_aggregate(const expr_program *prog, int kind, int *slots,
+                   size_t stride, size_t count, size_t workers,
+                   long long *result) {
+    static const expr::AggregateKind kinds[] = {
+        expr::AGG_COUNT, expr::AGG_SUM, expr::AGG_MIN, expr::AGG_MAX};
+    if (kind < 0 || kind >= static_cast<int>(sizeof(kinds) / sizeof(kinds[0]))) {
+        fail("unknown aggregate");
+        return -1;
+    }
+    try {
+        *result =
+            reduce(prog, kinds[kind], slots, stride, count, workers).value();
+        succeed();
+        return 0;
+    } catch (const std::exception &e) {
+        fail(e.what());
+        return -1;
+    }
+}
+
+int expr_histogram(const expr_program *prog, int *slots, size_t stride,
+                   size_t count, size_t workers, int lo, size_t buckets,
+                   unsigned long long *counts, unsigned long long *outside) {
+    try {
+        auto acc = reduce(prog, expr::AGG_HIST, slots, stride, count, workers);
+        unsigned long long rest = 0;
+        for (auto &itr : acc.histogram()) {
+            int64_t i = static_cast<int64_t>(itr.first) - lo;
+            if (0 <= i && static_cast<uint64_t>(i) < buckets) {
+                counts[i] += itr.second;
+            } else {
+                rest += itr.second;
+            }
+        }
+        *outside = rest;
+        succeed();
+        return 0;
+    } catch (const std::exception &e) {
+        fail(e.what());
+        return -1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+void expr_set_checked(expr_program *prog, int on) {
+    prog->prog->set_checked(on != 0);
+}
+
+//-----------------------------------------------------------------------------
+void expr_free(expr_program *prog) { delete prog; }
+
+} // extern "C"
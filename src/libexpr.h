@@ -0,0 +1,111 @@
+#pragma once
+
+/*=============================================================================
+ * libexpr - C API of the expression compiler (libexpr.so)
+ *
+ * An expression is compiled once into a handle and then evaluated against
+ * an array of int, one element per symbol ("slot"). By default slot i is the
+ * i-th symbol of the expression (see expr_slot_name); expr_bind() maps a
+ * symbol to any index of the caller's array instead, e.g. to the layout of
+ * a register file. Assignments in the expression write back to the array.
+ *
+ *   expr_program *p = expr_compile("pc == 0x1000 && r0 < 0", 22);
+ *   expr_bind(p, "pc", 0);
+ *   expr_bind(p, "r0", 4);
+ *   int hit;
+ *   if (expr_eval(p, regs, &hit) != 0)
+ *       puts(expr_last_error());
+ *
+ * Evaluation does not allocate. A handle may be evaluated from several
+ * threads at once; expr_bind(), expr_set_checked() and expr_free() must not
+ * run concurrently with other calls on the same handle. Calls that evaluate
+ * return a status and pass their values out through pointers: division by
+ * zero fails (see expr_last_error); overflow wraps around unless the handle
+ * is checked (expr_set_checked).
+ *===========================================================================*/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define EXPR_API
+#else
+#define EXPR_API __attribute__((visibility("default")))
+#endif
+
+/* bumped on incompatible changes of this header */
+#define EXPR_ABI_VERSION 1
+
+typedef struct expr_program expr_program;
+
+/* EXPR_ABI_VERSION of the library */
+EXPR_API int expr_abi_version(void);
+
+/* compile src[0, len). returns NULL on error (see expr_last_error) */
+EXPR_API expr_program *expr_compile(const char *src, size_t len);
+
+/* message of the last failed call in this thread; "" if none, or if a
+ * later call succeeded */
+EXPR_API const char *expr_last_error(void);
+
+/* number of symbols of the expression, and the name of each */
+EXPR_API size_t expr_slots(const expr_program *prog);
+EXPR_API const char *expr_slot_name(const expr_program *prog, size_t slot);
+
+/* read and write symbol name at slots[index] from now on.
+ * returns 0, or -1 if the expression does not use name */
+EXPR_API int expr_bind(expr_program *prog, const char *name, size_t index);
+
+/* evaluate once and store the value to *result. returns 0, or -1 if
+ * evaluation fails (see expr_last_error; *result is not written) */
+EXPR_API int expr_eval(const expr_program *prog, int *slots, int *result);
+
+/* evaluate count times; record i uses slots + i * stride and its value is
+ * stored to results[i]. returns the number of records evaluated: count, or
+ * the index of the first record that failed (see expr_last_error), which
+ * stops the batch with results[] from there on not written */
+EXPR_API size_t expr_eval_batch(const expr_program *prog, int *slots,
+                                size_t stride, size_t count, int *results);
+
+/* aggregates of expr_aggregate */
+enum { EXPR_COUNT, EXPR_SUM, EXPR_MIN, EXPR_MAX };
+
+/* reduce the values of count records (laid out as in expr_eval_batch) on
+ * workers threads (0: one per core)
+ *   EXPR_COUNT          records whose value is not 0
+ *   EXPR_SUM            sum of the values, wraps around modulo 2^64
+ *   EXPR_MIN, EXPR_MAX  smallest / largest value (0 if count is 0)
+ * With several workers, records must not overlap if the expression
+ * assigns. Stores the aggregate to *result and returns 0, or returns -1
+ * for an unknown kind or if a record fails (see expr_last_error; *result
+ * is not written) */
+EXPR_API int expr_aggregate(const expr_program *prog, int kind, int *slots,
+                            size_t stride, size_t count, size_t workers,
+                            long long *result);
+
+/* add 1 to counts[v - lo] for every record whose value v is in
+ * [lo, lo + buckets), as expr_aggregate, and store the number of records
+ * outside that range to *outside. returns 0, or -1 if a record fails
+ * (counts and *outside are not written) */
+EXPR_API int expr_histogram(const expr_program *prog, int *slots,
+                            size_t stride, size_t count, size_t workers,
+                            int lo, size_t buckets, unsigned long long *counts,
+                            unsigned long long *outside);
+
+/* checked arithmetic for this handle (off by default): with on != 0,
+ * signed overflow of + - * << and unary -, INT_MIN / -1, and a shift amount
+ * outside [0, 31] fail like division by zero instead of wrapping around.
+ * Other handles are not affected. Not to be called concurrently with other
+ * calls on the same handle, like expr_bind */
+EXPR_API void expr_set_checked(expr_program *prog, int on);
+
+/* release a handle (NULL is ignored) */
+EXPR_API void expr_free(expr_program *prog);
+
+#ifdef __cplusplus
+}
+#endif
+
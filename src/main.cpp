@@ -1,13 +1,29 @@
+#include "aggregate.h"
+#include "arith.h"
+#include "completion.h"
 #include "expr.h"
+#include "format.h"
+#include "import.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "profile.h"
+#include "server.h"
+#include "session.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 #include "macro.h"
+#include <algorithm>
 #include <iostream>
 #include <list>
-#include <map>
 #include <memory>
-#include <regex>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <unistd.h>
+#include <vector>
 
 #define USE_EDITLINE
 
@@ -17,21 +33,39 @@
 #endif
 
 //-----------------------------------------------------------------------------
-#include <cstdarg>
-#include <utility>
-static std::string format_str(const char *fmt, ...) {
-    static char buf[2048];
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    va_end(args);
-    return std::string(buf);
-}
+// output
+static expr::Sink out(stdout);
+
+// display mode of results
+enum Display {
+    DISPLAY_HEX, // (0x00000006) 6
+    DISPLAY_DEC, // 6
+    DISPLAY_BIN, // (0b00000000000000000000000000000110) 6
+};
+static Display display = DISPLAY_HEX;
+
+// instrumentation
+static bool timing = false;     // ":time on" : print stats of every line
+static bool collecting = false; // ":stats on" : only collect
+
+// ":check on", "--checked" : checked arithmetic in every mode
+static bool checked = false;
+
+// ":adapt on", "--adaptive" : trace records evaluated by the adapted tree
+// (see TraceFilter)
+static bool adaptive = false;
+
+// worker threads of ":import" and ":aggregate" ("-j N")
+static size_t command_workers = 1;
+
+// ":trace FILE LAYOUT" : records of ":aggregate"
+static std::unique_ptr<expr::MappedFile> trace_file;
+static expr::Layout trace_layout;
 
 //-----------------------------------------------------------------------------
 static void version() {
     // clang-format off
-    std::cout <<
+    out <<
 "crepl (C-style Read Evalute Print Line) ver.0.0\n"
 "(:q to quit, :? to help)\n"
 ;
@@ -42,7 +76,7 @@ static void version() {
 static void help() {
     version();
     // clang-format off
-    std::cout <<
+    out <<
 "- Evalute equation\n"
 "> 1 + 2 + 3\n"
 "(0x00000006) 6\n"
@@ -52,83 +86,878 @@ static void help() {
 "- Show variable\n"
 "> a\n"
 "(0x00000003) 3\n"
+"- Bit functions\n"
+"> popcnt(x), clz(x), ctz(x), bswap(x)\n"
+"> bits(x, hi, lo), setbits(x, hi, lo, v)\n"
 "- Exit program\n"
 "> :q\n"
 "- print all variable\n"
 "> :p\n"
+"- Display results as hex (default), dec or bin\n"
+"> :format bin\n"
+"- Save / load all variables\n"
+"> :save FILE\n"
+"> :load FILE\n"
+"- Define symbols from a file of 'name = value' or 'name,value' lines\n"
+"> :import FILE\n"
+"- Open a trace, then count/sum/min/max/hist an expression over its records\n"
+"> :trace FILE pc=0:4,%r0=4:4\n"
+"> :aggregate max(%r0 - pc)\n"
+"- Snapshot all variables, roll back or show changes since snapshot N\n"
+"> :snapshot\n"
+"> :rollback [N]\n"
+"> :diff [N]\n"
+"- Fail on signed overflow and out of range shifts instead of wrapping\n"
+"> :check on|off\n"
+"- Reorder && / || operands of :aggregate by what the records decide\n"
+"> :adapt on|off\n"
+"- Print timings / allocations of each line, cumulative histograms\n"
+"> :time on|off\n"
+"> :stats [on|off|reset]\n"
+"- Profile N evaluations of an expression per node\n"
+"> :profile a > 0 && b x1000\n"
 "";
     // clang-format on
 }
 
 //-----------------------------------------------------------------------------
-static void print(std::map<std::string, int> &symbols) {
-    for (auto &itr : symbols) {
-        std::cout << itr.first << " = " << itr.second << "\n";
+static void print(expr::SymbolTable &symbols) {
+    for (auto &itr : symbols.sorted()) {
+        out << itr.first << " = " << itr.second << '\n';
+    }
+}
+
+//-----------------------------------------------------------------------------
+// format_value - write one result line at p, return its end
+enum { VALUE_MAX = expr::BIN_MAX + expr::DEC_MAX + 4 };
+static char *format_value(char *p, int val) {
+    if (display != DISPLAY_DEC) {
+        *p++ = '(';
+        if (display == DISPLAY_BIN) {
+            p = expr::format_bin(p, static_cast<uint32_t>(val));
+        } else {
+            p = expr::format_hex(p, static_cast<uint32_t>(val));
+        }
+        *p++ = ')';
+        *p++ = ' ';
+    }
+    p = expr::format_dec(p, val);
+    *p++ = '\n';
+    return p;
+}
+
+static void print_value(int val) {
+    out.commit(format_value(out.reserve(VALUE_MAX), val));
+}
+
+static void record_stats() {
+    if (expr::stats::enabled) {
+        expr::stats::record();
+    }
+}
+
+// A line is a transaction: when it fails, its assignments are undone.
+static void eval(const std::string &line, expr::SymbolTable &symbols) {
+    expr::stats::reset();
+    symbols.begin();
+    try {
+        int val = expr::eval(line, symbols);
+        symbols.commit();
+        record_stats(); // before printing, which is not part of the line
+        print_value(val);
+    } catch (const std::runtime_error &e) {
+        symbols.abort();
+        record_stats();
+        out << e.what() << '\n';
+    }
+    if (timing) {
+        out << expr::stats::format(expr::stats::current()) << '\n';
+    }
+}
+
+//-----------------------------------------------------------------------------
+// ":time on|off", ":stats on|off|reset"
+static bool on_off(const std::string &arg, bool &flag) {
+    if (arg == "on") {
+        flag = true;
+    } else if (arg == "off") {
+        flag = false;
+    } else {
+        return false;
+    }
+#if EXPR_STATS
+    expr::stats::enabled = timing || collecting;
+#else
+    if (flag) {
+        out << "stats are disabled in this build (EXPR_STATS=0)\n";
+    }
+#endif
+    return true;
+}
+
+static void set_time(const std::string &arg) {
+    if (!on_off(arg, timing)) {
+        out << "usage: :time on|off\n";
+    }
+}
+
+static void set_stats(const std::string &arg) {
+    if (arg == "reset") {
+        expr::stats::clear();
+    } else if (!on_off(arg, collecting)) {
+        out << "usage: :stats [on|off|reset]\n";
+    }
+}
+
+//-----------------------------------------------------------------------------
+// ":check on|off"
+static void set_check(const std::string &arg) {
+    if (arg == "on" || arg == "off") {
+        checked = arg == "on";
+    } else {
+        out << "usage: :check on|off\n";
+    }
+}
+
+//-----------------------------------------------------------------------------
+// ":adapt on|off"
+static void set_adapt(const std::string &arg) {
+    if (arg == "on" || arg == "off") {
+        adaptive = arg == "on";
+    } else {
+        out << "usage: :adapt on|off\n";
+    }
+}
+
+//-----------------------------------------------------------------------------
+// ":format hex|dec|bin"
+static void set_display(const std::string &mode) {
+    if (mode == "hex") {
+        display = DISPLAY_HEX;
+    } else if (mode == "dec") {
+        display = DISPLAY_DEC;
+    } else if (mode == "bin") {
+        display = DISPLAY_BIN;
+    } else {
+        out << "unknown format '" << mode << "'\n";
+    }
+}
+
+//-----------------------------------------------------------------------------
+// ":profile EXPR [xN]"
+// A trailing " xN" is a repeat count unless the rest is not an expression
+// (":profile a + x2" profiles "a + x2" once).
+static void profile(const std::string &arg, expr::SymbolTable &symbols) {
+    std::unique_ptr<expr::ExprAST> ast;
+    long count = 1;
+    size_t pos = arg.find_last_of(" \t");
+    if (pos != std::string::npos && arg.size() > pos + 2 &&
+        arg[pos + 1] == 'x' &&
+        arg.find_first_not_of("0123456789", pos + 2) == std::string::npos) {
+        try {
+            ast = expr::parser(arg.substr(0, pos));
+            count = atol(arg.c_str() + pos + 2);
+        } catch (const std::runtime_error &) {
+            ast.reset();
+        }
+    }
+    try {
+        if (!ast) {
+            ast = expr::parser(arg);
+        }
+        expr::Profile prof(*ast);
+        int val = 0;
+        for (long i = 0; i < count; i++) {
+            val = prof.eval(symbols);
+        }
+        print_value(val);
+        out << prof.report();
+    } catch (const std::runtime_error &e) {
+        out << e.what() << '\n';
+    }
+}
+
+//-----------------------------------------------------------------------------
+// ":import FILE"
+static void import(const std::string &path, expr::SymbolTable &symbols) {
+    try {
+        auto r = expr::import_symbols(path, symbols, command_workers);
+        out << static_cast<int>(r.fast + r.evaluated) << " symbols imported ("
+            << static_cast<int>(r.fast) << " fast, "
+            << static_cast<int>(r.evaluated) << " evaluated)\n";
+        for (auto &msg : r.errors) {
+            out << msg << '\n';
+        }
+        if (r.error_count > r.errors.size()) {
+            out << static_cast<int>(r.error_count - r.errors.size())
+                << " more errors\n";
+        }
+    } catch (const std::runtime_error &e) {
+        out << e.what() << '\n';
+    }
+}
+
+//-----------------------------------------------------------------------------
+// aggregate - reduce query over every record of file.
+// prints the value, or "value: records" per line for hist().
+static void aggregate(const expr::MappedFile &file, const expr::Layout &layout,
+                      const std::string &query, size_t workers) {
+    auto q = expr::parse_aggregate(query);
+    expr::TraceFilter filter(layout, q.expression, 8, checked, adaptive);
+    uint64_t count = file.size() / filter.record_size();
+    auto acc = expr::reduce(
+        q.kind, count, workers, [&](uint64_t begin, uint64_t end, int *values) {
+            filter.eval(file.data(), begin, end, values);
+        });
+    if (acc.kind() == expr::AGG_HIST) {
+        for (auto &itr : acc.histogram()) {
+            out << itr.first << ": " << std::to_string(itr.second) << '\n';
+        }
+    } else {
+        out << std::to_string(acc.value()) << '\n';
+    }
+}
+
+// ":trace FILE LAYOUT"
+static void open_trace(const std::string &arg) {
+    size_t space = arg.find(' ');
+    if (space == std::string::npos) {
+        out << "usage: :trace FILE LAYOUT\n";
+        return;
+    }
+    try {
+        auto layout = expr::parse_layout(arg.substr(space + 1));
+        std::unique_ptr<expr::MappedFile> file(
+            new expr::MappedFile(arg.substr(0, space)));
+        trace_file = std::move(file);
+        trace_layout = layout;
+        out << static_cast<int>(trace_file->size() / layout.record_size)
+            << " records\n";
+    } catch (const std::runtime_error &e) {
+        out << e.what() << '\n';
+    }
+}
+
+// ":aggregate QUERY"
+static void aggregate(const std::string &query) {
+    if (!trace_file) {
+        out << "no trace (:trace FILE LAYOUT)\n";
+        return;
+    }
+    try {
+        aggregate(*trace_file, trace_layout, query, command_workers);
+    } catch (const std::runtime_error &e) {
+        out << e.what() << '\n';
     }
 }
 
-static void eval(const std::string line, std::map<std::string, int> &symbols) {
-    auto get_symbol_ref = [&] (const std::string &symbol) -> int&{ 
-        return symbols[symbol];
+//-----------------------------------------------------------------------------
+// ":snapshot", ":rollback [N]", ":diff [N]" (N: latest snapshot by default)
+static expr::History &history(expr::SymbolTable &symbols) {
+    static expr::History instance(symbols);
+    return instance;
+}
+
+static bool snapshot_number(const std::string &arg, expr::History &hist,
+                            size_t &n) {
+    if (hist.size() == 0) {
+        out << "no snapshot\n";
+        return false;
+    }
+    n = hist.size();
+    if (!arg.empty()) {
+        n = arg.find_first_not_of("0123456789") == std::string::npos &&
+                    arg.size() < 10
+                ? static_cast<size_t>(atol(arg.c_str()))
+                : 0;
+        if (n < 1 || n > hist.size()) {
+            out << "no snapshot '" << arg << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+static void snapshot(expr::SymbolTable &symbols) {
+    size_t n = history(symbols).snapshot();
+    out << "snapshot " << static_cast<int>(n) << " ("
+        << static_cast<int>(symbols.size()) << " symbols)\n";
+}
+
+static void rollback(const std::string &arg, expr::SymbolTable &symbols) {
+    auto &hist = history(symbols);
+    size_t n;
+    if (snapshot_number(arg, hist, n)) {
+        size_t changed = hist.rollback(n);
+        out << "rolled back to snapshot " << static_cast<int>(n) << " ("
+            << static_cast<int>(changed) << " symbols changed)\n";
+    }
+}
+
+// "+ name = v" added, "- name = v" removed, "  name = old -> new" changed
+static void diff(const std::string &arg, expr::SymbolTable &symbols) {
+    auto &hist = history(symbols);
+    size_t n;
+    if (!snapshot_number(arg, hist, n)) {
+        return;
+    }
+    for (auto &c : hist.diff(n)) {
+        const std::string &name = expr::interner().name(c.id);
+        if (!c.had) {
+            out << "+ " << name << " = " << c.after << '\n';
+        } else if (!c.has) {
+            out << "- " << name << " = " << c.before << '\n';
+        } else {
+            out << "  " << name << " = " << c.before << " -> " << c.after
+                << '\n';
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// command - execute one input line. returns false on ":q".
+static bool command(const std::string &line, expr::SymbolTable &symbols) {
+    if (line == ":q") {
+        return false;
+    }
+    expr::Checked scope(checked); // trees evaluated by this line
+    if (line == ":?") {
+        help();
+    } else if (line == ":p") {
+        print(symbols);
+    } else if (line.compare(0, 6, ":time ") == 0) {
+        set_time(line.substr(6));
+    } else if (line == ":stats") {
+        out << expr::stats::report();
+    } else if (line.compare(0, 7, ":stats ") == 0) {
+        set_stats(line.substr(7));
+    } else if (line.compare(0, 7, ":check ") == 0) {
+        set_check(line.substr(7));
+    } else if (line.compare(0, 7, ":adapt ") == 0) {
+        set_adapt(line.substr(7));
+    } else if (line.compare(0, 9, ":profile ") == 0) {
+        profile(line.substr(9), symbols);
+    } else if (line.compare(0, 8, ":format ") == 0) {
+        set_display(line.substr(8));
+    } else if (line.compare(0, 6, ":save ") == 0) {
+        try {
+            expr::save_session(line.substr(6), symbols);
+        } catch (const std::runtime_error &e) {
+            out << e.what() << '\n';
+        }
+    } else if (line.compare(0, 6, ":load ") == 0) {
+        try {
+            size_t n = expr::load_session(line.substr(6), symbols);
+            out << static_cast<int>(n) << " symbols loaded\n";
+        } catch (const std::runtime_error &e) {
+            out << e.what() << '\n';
+        }
+    } else if (line.compare(0, 8, ":import ") == 0) {
+        import(line.substr(8), symbols);
+    } else if (line.compare(0, 7, ":trace ") == 0) {
+        open_trace(line.substr(7));
+    } else if (line.compare(0, 11, ":aggregate ") == 0) {
+        aggregate(line.substr(11));
+    } else if (line == ":snapshot") {
+        snapshot(symbols);
+    } else if (line == ":rollback" || line.compare(0, 10, ":rollback ") == 0) {
+        rollback(line.size() > 10 ? line.substr(10) : "", symbols);
+    } else if (line == ":diff" || line.compare(0, 6, ":diff ") == 0) {
+        diff(line.size() > 6 ? line.substr(6) : "", symbols);
+    } else { // evalute expresion
+        ::eval(line, symbols);
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// read_lines - call fn(line) for every line of fp until fn returns false.
+// Input is read in large blocks. A trailing '\r' is removed from each line.
+template <class F> static void read_lines(FILE *fp, F fn) {
+    std::vector<char> buf(1 << 20);
+    std::string line;
+    auto execute = [&]() {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        bool cont = fn(line);
+        line.clear();
+        return cont;
     };
-  
+
+    size_t len;
+    while ((len = fread(buf.data(), 1, buf.size(), fp)) > 0) {
+        const char *itr = buf.data();
+        const char *ite = itr + len;
+        while (itr != ite) {
+            auto eol = static_cast<const char *>(memchr(itr, '\n', ite - itr));
+            if (!eol) { // continued in the next block
+                line.append(itr, ite);
+                break;
+            }
+            line.append(itr, eol);
+            itr = eol + 1;
+            if (!execute()) {
+                return;
+            }
+        }
+    }
+    if (!line.empty()) {
+        execute(); // last line without '\n'
+    }
+}
+
+//-----------------------------------------------------------------------------
+// batch - evaluate every line of fp without editline and history.
+// Results are left in the output buffer instead of being flushed line by
+// line.
+static void batch(FILE *fp, expr::SymbolTable &symbols) {
+    read_lines(fp, [&](const std::string &line) {
+        return line.empty() || command(line, symbols);
+    });
+}
+
+//=============================================================================
+// parallel batch mode
+// Input is processed in blocks of lines. Every line of a block is lexed and
+// parsed on all workers. Lines that assign, and REPL commands, are barriers
+// and run in input order on the main thread. The lines between two barriers
+// only read symbols, so they are evaluated concurrently; each worker formats
+// a contiguous range into its own buffer and the buffers are written out in
+// order.
+
+struct Line {
+    std::string src;
+    std::unique_ptr<expr::ExprAST> ast; // nullptr : empty, command or error
+    std::string error;                  // parse error
+    std::vector<int> reads;             // symbols read by ast
+    bool barrier;                       // assignment or command
+    bool failed;                        // evaluation failed
+};
+
+enum {
+    BLOCK_LINES = 1 << 16, // lines parsed per block
+    PARALLEL_MIN = 256,    // shorter runs are evaluated on the main thread
+};
+
+//-----------------------------------------------------------------------------
+static void parse_line(Line &line) {
+    line.ast.reset();
+    line.error.clear();
+    line.reads.clear();
+    line.barrier = false;
+    line.failed = false;
+    if (line.src.empty()) {
+        return;
+    }
+    if (line.src[0] == ':') {
+        line.barrier = true;
+        return;
+    }
+    auto parsed = expr::try_parse(line.src);
+    if (!parsed) {
+        line.error = parsed.error.message();
+        return;
+    }
+    line.ast = std::move(parsed.ast);
+    auto refs = expr::references(*line.ast);
+    line.barrier = !refs.writes.empty();
+    line.reads = std::move(refs.reads);
+}
+
+//-----------------------------------------------------------------------------
+// eval_line - evaluate a line without side effects into buf (and mark it
+// failed when it fails)
+static void eval_line(Line &line, expr::SymbolTable &symbols,
+                      std::string &buf) {
+    if (!line.ast) {
+        if (!line.src.empty()) {
+            buf += line.error;
+            buf += '\n';
+        }
+        return;
+    }
     try {
-        int val = expr::eval(line, get_symbol_ref);
-        std::cout << format_str("(0x%08x) %d\n", val, val);
+        int val = line.ast->eval(symbols);
+        size_t len = buf.size();
+        buf.resize(len + VALUE_MAX);
+        buf.resize(format_value(&buf[len], val) - buf.data());
     } catch (const std::runtime_error &e) {
-        std::cout << e.what() << std::endl;
+        line.failed = true;
+        buf += e.what();
+        buf += '\n';
+    }
+}
+
+//-----------------------------------------------------------------------------
+// run_block - evaluate lines[0, n) in order. returns false on ":q".
+static bool run_block(std::vector<Line> &lines, size_t n,
+                      expr::SymbolTable &symbols, size_t workers) {
+    expr::Checked scope(checked); // also on every worker below
+    expr::parallel_for(n, workers, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            parse_line(lines[i]);
+        }
+    });
+
+    std::vector<std::string> chunks(workers);
+    for (size_t i = 0; i < n;) {
+        Line &line = lines[i];
+        if (line.barrier) {
+            if (!line.ast) {
+                if (!command(line.src, symbols)) {
+                    return false;
+                }
+            } else {
+                symbols.begin();
+                try {
+                    int val = line.ast->eval(symbols);
+                    symbols.commit();
+                    print_value(val);
+                } catch (const std::runtime_error &e) {
+                    symbols.abort();
+                    out << e.what() << '\n';
+                }
+            }
+            i++;
+            continue;
+        }
+
+        // [i, j) : run of lines without side effects
+        // Missing symbols are created up front, so that concurrent
+        // evaluation never inserts into the symbol table. Evaluated one by
+        // one, a line creates only the symbols it gets to (not those after
+        // a short circuit), and none if it fails (see eval). So afterwards
+        // the new symbols are erased and the lines that succeeded and may
+        // read one are evaluated again in order, to create them as that
+        // would.
+        size_t j = i;
+        size_t existing = symbols.size();
+        while (j < n && !lines[j].barrier) {
+            for (int id : lines[j].reads) {
+                symbols.cref(id);
+            }
+            j++;
+        }
+        size_t count = j - i;
+        size_t used = count < PARALLEL_MIN ? 1 : workers;
+        expr::parallel_for(count, used, [&](size_t begin, size_t end,
+                                            size_t worker) {
+            expr::Checked scope(checked);
+            auto &chunk = chunks[worker];
+            chunk.clear();
+            for (size_t k = i + begin; k < i + end; k++) {
+                eval_line(lines[k], symbols, chunk);
+            }
+        });
+        for (size_t w = 0; w < std::min(used, count); w++) {
+            out.write(chunks[w]);
+        }
+        if (symbols.size() > existing) {
+            std::vector<int> created;
+            while (symbols.size() > existing) { // from the last: none moves
+                created.push_back(symbols.id(symbols.size() - 1));
+                symbols.erase(created.back());
+            }
+            std::sort(created.begin(), created.end());
+            for (size_t k = i; k < j; k++) {
+                Line &again = lines[k];
+                if (again.ast && !again.failed &&
+                    std::any_of(again.reads.begin(), again.reads.end(),
+                                [&](int id) {
+                                    return std::binary_search(
+                                        created.begin(), created.end(), id);
+                                })) {
+                    again.ast->eval(symbols); // same value as before
+                }
+            }
+        }
+        i = j;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+static void batch_parallel(FILE *fp, expr::SymbolTable &symbols,
+                           size_t workers) {
+    std::vector<Line> lines(BLOCK_LINES);
+    size_t n = 0;
+    bool cont = true;
+    read_lines(fp, [&](const std::string &src) {
+        lines[n++].src.assign(src);
+        if (n == lines.size()) {
+            cont = run_block(lines, n, symbols, workers);
+            n = 0;
+        }
+        return cont;
+    });
+    if (cont && n) {
+        run_block(lines, n, symbols, workers);
     }
 }
 
+//=============================================================================
+// trace replay mode
+// The trace is mapped and split into blocks of records; each block is
+// scanned on all workers, and the matches are written out in order as
+// record indices or as the records themselves.
+
+struct Trace {
+    const char *file;
+    const char *layout;
+    const char *where;
+    const char *aggregate; // instead of where
+    size_t record_size;    // 0 : end of the last field
+    bool records;       // write matching records instead of indices
+};
+
+enum { TRACE_BLOCK = 1 << 20 }; // records per block
+
+//-----------------------------------------------------------------------------
+static int trace(const Trace &opt, size_t workers) {
+    try {
+        if (opt.aggregate) {
+            expr::MappedFile file(opt.file);
+            file.sequential();
+            aggregate(file, expr::parse_layout(opt.layout, opt.record_size),
+                      opt.aggregate, workers);
+            return 0;
+        }
+        expr::TraceFilter filter(
+            expr::parse_layout(opt.layout, opt.record_size), opt.where, 8,
+            checked, adaptive);
+        expr::MappedFile file(opt.file);
+        file.sequential();
+        size_t size = filter.record_size();
+        uint64_t count = file.size() / size;
+        if (file.size() % size) {
+            fprintf(stderr, "%s: ignored %zu trailing bytes\n", opt.file,
+                    static_cast<size_t>(file.size() % size));
+        }
+
+        std::vector<std::vector<uint64_t>> matches(workers);
+        for (uint64_t block = 0; block < count; block += TRACE_BLOCK) {
+            uint64_t n = std::min<uint64_t>(TRACE_BLOCK, count - block);
+            expr::parallel_for(n, workers, [&](size_t begin, size_t end,
+                                               size_t worker) {
+                matches[worker].clear();
+                filter.scan(file.data(), block + begin, block + end,
+                            matches[worker]);
+            });
+            for (size_t w = 0; w < std::min<uint64_t>(workers, n); w++) {
+                for (uint64_t i : matches[w]) {
+                    if (opt.records) {
+                        out.write(file.data() + i * size, size);
+                    } else {
+                        char *p = out.reserve(expr::U64_MAX + 1);
+                        p = expr::format_u64(p, i);
+                        *p++ = '\n';
+                        out.commit(p);
+                    }
+                }
+            }
+        }
+    } catch (const std::runtime_error &e) {
+        fprintf(stderr, "crepl: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+//=============================================================================
+// server mode
+static expr::Server *server = nullptr;
+
+static void stop_server(int) { server->stop(); }
+
+//-----------------------------------------------------------------------------
+static int serve(const char *path) {
+    try {
+        expr::SymbolTable symbols;
+        expr::Server srv(path, symbols, checked);
+        server = &srv;
+        signal(SIGINT, stop_server);
+        signal(SIGTERM, stop_server);
+        srv.run();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        server = nullptr;
+
+        auto &st = srv.stats();
+        fprintf(stderr,
+                "%zu connections, %zu requests in %zu batches, "
+                "cache %zu hits / %zu misses\n",
+                st.connections, st.requests, st.batches, st.hits, st.misses);
+    } catch (const std::runtime_error &e) {
+        fprintf(stderr, "crepl: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void usage() {
+    fputs("usage: crepl [--batch FILE] [--parallel] [-j JOBS]\n"
+          "       crepl --trace FILE --layout SPEC --where EXPR\n"
+          "             [--record-size N] [--records] [--adaptive] [-j JOBS]\n"
+          "       crepl --trace FILE --layout SPEC --aggregate QUERY\n"
+          "             [--record-size N] [--adaptive] [-j JOBS]\n"
+          "       crepl --serve SOCKET\n"
+          "--checked (any mode): fail on signed overflow instead of "
+          "wrapping around\n",
+          stderr);
+}
+
+#ifdef USE_EDITLINE
+//=============================================================================
+// tab completion of symbol names
+// The index is brought up to date after every line and before completing,
+// so only new symbols are indexed.
+static expr::SymbolIndex completion_index;
+static expr::SymbolTable *completion_symbols = nullptr;
+
+static bool is_symbol_char(char c) {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+           ('0' <= c && c <= '9') || c == '%';
+}
+
+//-----------------------------------------------------------------------------
+// complete_symbol - editline generator: the state-th name that completes
+// the last symbol in text (anything before it is kept)
+static char *complete_symbol(const char *text, int state) {
+    static std::pair<size_t, size_t> range;
+    static std::string head;
+    if (state == 0) {
+        const char *word = text + strlen(text);
+        while (word != text && is_symbol_char(word[-1])) {
+            word--;
+        }
+        head.assign(text, word);
+        completion_index.update(*completion_symbols);
+        range = completion_index.range(word);
+    }
+    if (range.first == range.second) {
+        return nullptr;
+    }
+    std::string match = head + completion_index.name(range.first++);
+    return strdup(match.c_str());
+}
+
+static char **complete(const char *text, int start, int end) {
+    UNUSED(start);
+    UNUSED(end);
+    rl_attempted_completion_over = 1; // no file names
+    return rl_completion_matches(text, complete_symbol);
+}
+#endif
+
 //=============================================================================
 // main
 int main(int argc, char **argv) {
-    UNUSED(argc);
-    UNUSED(argv);
-    version();
-    std::map<std::string, int> symbols;
+    const char *batch_file = nullptr;
+    bool parallel = false;
+    size_t workers = expr::concurrency();
+    const char *socket_path = nullptr;
+    Trace trace_opt = {nullptr, nullptr, nullptr, nullptr, 0, false};
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--batch" && i + 1 < argc) {
+            batch_file = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_opt.file = argv[++i];
+        } else if (arg == "--layout" && i + 1 < argc) {
+            trace_opt.layout = argv[++i];
+        } else if (arg == "--where" && i + 1 < argc) {
+            trace_opt.where = argv[++i];
+        } else if (arg == "--aggregate" && i + 1 < argc) {
+            trace_opt.aggregate = argv[++i];
+        } else if (arg == "--record-size" && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0) {
+            trace_opt.record_size = static_cast<size_t>(atoi(argv[++i]));
+        } else if (arg == "--records") {
+            trace_opt.records = true;
+        } else if (arg == "--checked") {
+            checked = true;
+        } else if (arg == "--adaptive") {
+            adaptive = true;
+        } else if (arg == "--parallel") {
+            parallel = true;
+        } else if (arg == "-j" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            workers = static_cast<size_t>(atoi(argv[++i]));
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    command_workers = workers;
+    if (socket_path) {
+        return serve(socket_path);
+    }
+    if (trace_opt.file || trace_opt.layout || trace_opt.where ||
+        trace_opt.aggregate) {
+        if (!trace_opt.file || !trace_opt.layout ||
+            !trace_opt.where == !trace_opt.aggregate) {
+            usage();
+            return 1;
+        }
+        return trace(trace_opt, workers);
+    }
+    expr::SymbolTable symbols;
 
+    // non-interactive : no banner, no prompt, no editline
+    if (batch_file || !isatty(fileno(stdin))) {
+        FILE *fp = batch_file ? fopen(batch_file, "rb") : stdin;
+        if (!fp) {
+            perror(batch_file);
+            return 1;
+        }
+        if (parallel) {
+            batch_parallel(fp, symbols, workers);
+        } else {
+            batch(fp, symbols);
+        }
+        if (fp != stdin) {
+            fclose(fp);
+        }
+        return 0;
+    }
+
+    version();
 #ifdef USE_EDITLINE
     using_history();
+    completion_symbols = &symbols;
+    rl_attempted_completion_function = complete;
     // read_history(".history"); // [ToDo]historyファイルが無いときの動作の検証
     while (1) {
+        out.flush();
         char *buf = readline("> ");
+        if (!buf) { // EOF
+            break;
+        }
         std::string line(buf);
         free(buf);
         if (line.empty()) {
             continue;
         }
         add_history(line.c_str());
-        if (line == ":q") {
+        if (!command(line, symbols)) {
             break;
         }
-        if (line == ":?") {
-            help();
-        }
-        if (line == ":p") {
-            print(symbols);
-        } else { // evalute expresion
-            eval(line, symbols);
-        }
+        completion_index.update(symbols);
     }
 // write_history(".history");
 #else
-
-    std::string s;
-    do {
-        if (s.empty()) { // dump all symbol & value
-            for (auto itr = symbols.begin(); itr != symbols.end(); ++itr) {
-                std::cout << itr->first << " = " << itr->second << "\n";
-            }
-        } else { // evalute expresion
-            try {
-                int val = expr::eval(s, get_symbol_ref);
-                std::cout << format_str("(0x%08x) %d\n", val, val);
-            } catch (const std::runtime_error &e) {
-                std::cout << e.what() << std::endl;
-            }
+    std::string line;
+    out << "> ";
+    out.flush();
+    while (std::getline(std::cin, line)) {
+        if (!line.empty() && !command(line, symbols)) {
+            break;
         }
-        std::cout << ">";
-    } while (std::getline(std::cin, s));
+        out << "> ";
+        out.flush();
+    }
 #endif
 }
@@ -0,0 +1,77 @@
+#include "mapped_file.h"
+#include "expr.h"
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+void MappedFile::open(const std::string &path) {
+    close();
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw expr_error("cannot open '" + path + "'");
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        len = static_cast<size_t>(st.st_size);
+        if (len == 0) { // nothing to map
+            ::close(fd);
+            return;
+        }
+        void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            ::close(fd);
+            addr = static_cast<const char *>(p);
+            mapped = true;
+            return;
+        }
+    }
+    ::close(fd);
+#endif
+
+    // not mappable (pipe, device, ...) : read it
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        throw expr_error("cannot open '" + path + "'");
+    }
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        copy.insert(copy.end(), buf, buf + n);
+    }
+    fclose(fp);
+    addr = copy.data();
+    len = copy.size();
+}
+
+//-----------------------------------------------------------------------------
+void MappedFile::sequential() const {
+#ifndef _WIN32
+    if (mapped) {
+        madvise(const_cast<char *>(addr), len, MADV_SEQUENTIAL);
+    }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+void MappedFile::close() {
+#ifndef _WIN32
+    if (mapped) {
+        munmap(const_cast<char *>(addr), len);
+    }
+#endif
+    copy.clear();
+    addr = nullptr;
+    len = 0;
+    mapped = false;
+}
+
+} // namespace expr
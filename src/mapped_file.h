@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// MappedFile - read-only view of a whole file.
+// The file is mmap'ed where available and read into memory otherwise.
+// open() throws expr_error if the file cannot be read.
+class MappedFile {
+  public:
+    MappedFile() : addr(nullptr), len(0), mapped(false) {}
+    explicit MappedFile(const std::string &path) : MappedFile() {
+        open(path);
+    }
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    void open(const std::string &path);
+    void close();
+    // hint that the file is read once from start to end
+    void sequential() const;
+
+    const char *data() const { return addr; }
+    size_t size() const { return len; }
+
+  private:
+    const char *addr;
+    size_t len;
+    bool mapped;            // addr is a mapping (not copy)
+    std::vector<char> copy; // fallback storage
+};
+
+} // namespace expr
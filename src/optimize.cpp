@@ -0,0 +1,611 @@
+#include "optimize.h"
+#include "ast.h"
+#include "profile.h" // cycles
+#include "range.h"
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
+#include <unordered_set>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// log2 of a literal power of two (2 .. 2^30), -1 otherwise
+static int power_of_two(const ExprAST &ast) {
+    if (ast.type != IMM) {
+        return -1;
+    }
+    int val = static_cast<const IntegerExprAST &>(ast).Val;
+    if (val < 2 || (val & (val - 1)) != 0) {
+        return -1;
+    }
+    int k = 0;
+    while ((1 << k) != val) {
+        k++;
+    }
+    return k;
+}
+
+//-----------------------------------------------------------------------------
+// copy of a symbol node (the lhs of an assignment)
+static std::unique_ptr<ExprAST> clone_symbol(const ExprAST &ast) {
+    if (ast.type == VAR) {
+        auto &var = static_cast<const VariableExprAST &>(ast);
+        return std::make_unique<VariableExprAST>(var.Id);
+    }
+    auto &reg = static_cast<const RegisterExprAST &>(ast);
+    auto copy = std::make_unique<RegisterExprAST>(reg.Id, reg.Bank, reg.Index);
+    copy->Reg = reg.Reg;
+    return copy;
+}
+
+//-----------------------------------------------------------------------------
+// divide - x / rhs or x % rhs by an invariant divisor, nullptr if rhs is
+// not a literal or a symbol, or is a literal without a magic number
+static std::unique_ptr<ExprAST> divide(Type type,
+                                       std::unique_ptr<ExprAST> &lhs,
+                                       std::unique_ptr<ExprAST> &rhs) {
+    Divisor divisor;
+    if (rhs->type == IMM) {
+        divisor = Divisor(static_cast<IntegerExprAST &>(*rhs).Val);
+        if (!divisor.magic) {
+            return nullptr;
+        }
+    } else if (rhs->type != VAR && rhs->type != REG) {
+        return nullptr;
+    }
+    return std::make_unique<DivideExprAST>(type == DIV ? DIVM : MODM,
+                                           std::move(lhs), std::move(rhs),
+                                           divisor);
+}
+
+//-----------------------------------------------------------------------------
+void optimize(std::unique_ptr<ExprAST> &ast) {
+    for_each_child(*ast, [](std::unique_ptr<ExprAST> &child) {
+        optimize(child);
+    });
+
+    if (ast->type == MUL) {
+        auto &node = static_cast<BinaryExprAST &>(*ast);
+        int k;
+        if ((k = power_of_two(*node.rhs)) >= 0) {
+            ast = std::make_unique<BinaryExprAST>(
+                SFTL, std::move(node.lhs), std::make_unique<IntegerExprAST>(k));
+        } else if ((k = power_of_two(*node.lhs)) >= 0) {
+            ast = std::make_unique<BinaryExprAST>(
+                SFTL, std::move(node.rhs), std::make_unique<IntegerExprAST>(k));
+        }
+    } else if (ast->type == DIV || ast->type == MOD) {
+        auto &node = static_cast<BinaryExprAST &>(*ast);
+        auto result = divide(ast->type, node.lhs, node.rhs);
+        if (result) {
+            ast = std::move(result);
+        }
+    } else if (ast->type == ASSIGN_MUL) {
+        auto &node = static_cast<AssignExprAST &>(*ast);
+        int k = power_of_two(*node.rhs);
+        if (k >= 0) {
+            ast = std::make_unique<AssignExprAST>(
+                ASSIGN_SL, std::move(node.lhs),
+                std::make_unique<IntegerExprAST>(k));
+        }
+    } else if (ast->type == ASSIGN_DIV || ast->type == ASSIGN_MOD) {
+        // x /= d -> x = x / d; reading x again has no side effects
+        auto &node = static_cast<AssignExprAST &>(*ast);
+        if (node.lhs->type != VAR && node.lhs->type != REG) {
+            return; // an error at evaluation, as before
+        }
+        auto value = clone_symbol(*node.lhs);
+        auto result = divide(ast->type == ASSIGN_DIV ? DIV : MOD, value,
+                             node.rhs);
+        if (result) {
+            ast = std::make_unique<AssignExprAST>(ASSIGN, std::move(node.lhs),
+                                                  std::move(result));
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+void prepare(ExprAST &ast, const SymbolTable &symbols) {
+    for_each_child(ast, [&](std::unique_ptr<ExprAST> &child) {
+        prepare(*child, symbols);
+    });
+    if (ast.type != DIVM && ast.type != MODM) {
+        return;
+    }
+    auto &node = static_cast<DivideExprAST &>(ast);
+    const int *val = nullptr;
+    if (node.rhs->type == VAR) {
+        val = symbols.find(static_cast<VariableExprAST &>(*node.rhs).Id);
+    } else if (node.rhs->type == REG) {
+        auto &reg = static_cast<RegisterExprAST &>(*node.rhs);
+        val = reg.Reg ? reg.Reg : symbols.find(reg.Id);
+    }
+    if (val) {
+        node.divisor = Divisor(*val);
+    }
+}
+
+//=============================================================================
+// partial evaluation
+
+//-----------------------------------------------------------------------------
+// fold - value of a unary / binary operator on constants. false if it must
+// be left for evaluation (division by zero, overflow, shift out of range),
+// where it fails or wraps around depending on checked evaluation.
+static bool fold(Type type, int rhs, int &result) {
+    switch (type) {
+    case PLUS:
+        result = rhs;
+        return true;
+    case MINUS:
+        return !sub_overflow(0, rhs, &result);
+    case INV:
+        result = ~rhs;
+        return true;
+    case NOT:
+        result = !rhs;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool fold(Type type, int lhs, int rhs, int &result) {
+    switch (type) {
+    case ADD:
+        return !add_overflow(lhs, rhs, &result);
+    case SUB:
+        return !sub_overflow(lhs, rhs, &result);
+    case MUL:
+        return !mul_overflow(lhs, rhs, &result);
+    case DIV:
+    case DIVM:
+    case MOD:
+    case MODM:
+        if (rhs == 0 || (lhs == INT_MIN && rhs == -1)) {
+            return false;
+        }
+        result = (type == DIV || type == DIVM) ? lhs / rhs : lhs % rhs;
+        return true;
+    case SFTL:
+    case SFTR:
+        if (rhs < 0 || rhs >= 32) {
+            return false;
+        }
+        if (type == SFTL) {
+            return !shl_overflow(lhs, rhs, &result);
+        }
+        result = lhs >> rhs;
+        return true;
+    case AND:
+        result = lhs & rhs;
+        return true;
+    case OR:
+        result = lhs | rhs;
+        return true;
+    case XOR:
+        result = lhs ^ rhs;
+        return true;
+    case LAND:
+        result = lhs && rhs;
+        return true;
+    case LOR:
+        result = lhs || rhs;
+        return true;
+    case EQ:
+        result = lhs == rhs;
+        return true;
+    case NE:
+        result = lhs != rhs;
+        return true;
+    case LT:
+        result = lhs < rhs;
+        return true;
+    case LE:
+        result = lhs <= rhs;
+        return true;
+    case GT:
+        result = lhs > rhs;
+        return true;
+    case GE:
+        result = lhs >= rhs;
+        return true;
+    default:
+        return false;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static const int *constant(const std::unique_ptr<ExprAST> &ast) {
+    return ast->type == IMM ? &static_cast<IntegerExprAST &>(*ast).Val
+                            : nullptr;
+}
+
+static std::unique_ptr<ExprAST> integer(int val) {
+    return std::make_unique<IntegerExprAST>(val);
+}
+
+// barrier - evaluating ast may assign or fail: a division by anything but a
+// literal other than 0 and -1, a bit range that is not constant and valid,
+// or if checked arithmetic that the ranges of its operands do not keep from
+// overflowing. Such a subtree is never dropped by specialize() or moved by
+// adapt().
+static bool barrier(ExprAST &ast, bool checked) {
+    if (ASSIGN_BIGIN < ast.type && ast.type < ASSIGN_END) {
+        return true;
+    }
+    if (ast.type == DIV || ast.type == MOD || ast.type == DIVM ||
+        ast.type == MODM) {
+        auto *d = constant(static_cast<BinaryExprAST &>(ast).rhs);
+        if (!d || *d == 0 || *d == -1) {
+            return true;
+        }
+    } else if (ast.type == BITS || ast.type == SETBITS) {
+        auto &args = static_cast<CallExprAST &>(ast).args;
+        auto *hi = constant(args[1]);
+        auto *lo = constant(args[2]);
+        if (!hi || !lo || !bit_range(*hi, *lo)) {
+            return true;
+        }
+    } else if (checked && ast.type == MINUS) {
+        Range a = range(*static_cast<UnaryExprAST &>(ast).rhs);
+        if (may_fail(MINUS, a, a)) {
+            return true;
+        }
+    } else if (checked && (ast.type == ADD || ast.type == SUB ||
+                           ast.type == MUL || ast.type == SFTL ||
+                           ast.type == SFTR)) {
+        auto &node = static_cast<BinaryExprAST &>(ast);
+        if (may_fail(ast.type, range(*node.lhs), range(*node.rhs))) {
+            return true;
+        }
+    }
+    bool result = false;
+    for_each_child(ast, [&](std::unique_ptr<ExprAST> &child) {
+        result = result || barrier(*child, checked);
+    });
+    return result;
+}
+
+// !!ast as a tree
+static std::unique_ptr<ExprAST> boolean(std::unique_ptr<ExprAST> ast) {
+    return std::make_unique<UnaryExprAST>(
+        NOT, std::make_unique<UnaryExprAST>(NOT, std::move(ast)));
+}
+
+//-----------------------------------------------------------------------------
+class Specializer {
+  public:
+    Specializer(const SymbolTable &known, std::unordered_set<int> written,
+                bool checked)
+        : known(known), written(std::move(written)), checked(checked) {}
+    std::unique_ptr<ExprAST> run(ExprAST &ast);
+
+  private:
+    const SymbolTable &known;
+    std::unordered_set<int> written; // never substituted
+    bool checked;
+
+    std::unique_ptr<ExprAST> symbol(ExprAST &ast);
+    std::unique_ptr<ExprAST> binary(BinaryExprAST &node);
+};
+
+//-----------------------------------------------------------------------------
+std::unique_ptr<ExprAST> Specializer::symbol(ExprAST &ast) {
+    if (ast.type == VAR) {
+        int id = static_cast<VariableExprAST &>(ast).Id;
+        const int *val = written.count(id) ? nullptr : known.find(id);
+        if (val) {
+            return integer(*val);
+        }
+        return std::make_unique<VariableExprAST>(id);
+    }
+    auto &reg = static_cast<RegisterExprAST &>(ast);
+    if (!reg.Reg) { // unbound registers are symbols
+        const int *val = written.count(reg.Id) ? nullptr : known.find(reg.Id);
+        if (val) {
+            return integer(*val);
+        }
+    }
+    auto copy = std::make_unique<RegisterExprAST>(reg.Id, reg.Bank, reg.Index);
+    copy->Reg = reg.Reg;
+    return copy;
+}
+
+//-----------------------------------------------------------------------------
+std::unique_ptr<ExprAST> Specializer::binary(BinaryExprAST &node) {
+    Type type = node.type;
+    auto lhs = run(*node.lhs);
+    const int *l = constant(lhs);
+
+    // short circuit on a constant lhs: rhs is not evaluated
+    if (l && type == LAND && !*l) {
+        return integer(0);
+    }
+    if (l && type == LOR && *l) {
+        return integer(1);
+    }
+    auto rhs = run(*node.rhs);
+    const int *r = constant(rhs);
+    int val;
+    if (l && r && fold(type, *l, *r, val)) {
+        return integer(val);
+    }
+    if (l && (type == LAND || type == LOR)) { // 1 && x, 0 || x
+        return boolean(std::move(rhs));
+    }
+    if (r && (type == LAND || type == LOR) && !barrier(*lhs, checked)) {
+        if ((type == LAND) == (*r != 0)) { // x && 1, x || 0
+            return boolean(std::move(lhs));
+        }
+        return integer(type == LOR); // x && 0, x || 1
+    }
+
+    // identities of a constant rhs
+    if (r && *r == 0 &&
+        (type == ADD || type == SUB || type == OR || type == XOR ||
+         type == SFTL || type == SFTR)) {
+        return lhs;
+    }
+    if (r && *r == 1 && (type == MUL || type == DIV || type == DIVM)) {
+        return lhs;
+    }
+    if (l && *l == 0 && (type == ADD || type == OR || type == XOR)) {
+        return rhs;
+    }
+    if (l && *l == 1 && type == MUL) {
+        return rhs;
+    }
+    if ((type == MUL || type == AND) &&
+        ((r && *r == 0 && !barrier(*lhs, checked)) ||
+         (l && *l == 0 && !barrier(*rhs, checked)))) {
+        return integer(0);
+    }
+
+    if (type == DIVM || type == MODM) {
+        auto &div = static_cast<DivideExprAST &>(node);
+        if (r) {
+            if (*r != div.divisor.d) { // was a symbol; now a literal
+                Divisor divisor(*r);
+                if (!divisor.magic) {
+                    return std::make_unique<BinaryExprAST>(
+                        type == DIVM ? DIV : MOD, std::move(lhs),
+                        std::move(rhs));
+                }
+                return std::make_unique<DivideExprAST>(
+                    type, std::move(lhs), std::move(rhs), divisor);
+            }
+        }
+        return std::make_unique<DivideExprAST>(type, std::move(lhs),
+                                               std::move(rhs), div.divisor);
+    }
+    return std::make_unique<BinaryExprAST>(type, std::move(lhs),
+                                           std::move(rhs));
+}
+
+//-----------------------------------------------------------------------------
+std::unique_ptr<ExprAST> Specializer::run(ExprAST &ast) {
+    if (ast.type == IMM) {
+        return integer(static_cast<IntegerExprAST &>(ast).Val);
+    }
+    if (ast.type == VAR || ast.type == REG) {
+        return symbol(ast);
+    }
+    if (ast.type == PLUS || ast.type == MINUS || ast.type == INV ||
+        ast.type == NOT) {
+        auto rhs = run(*static_cast<UnaryExprAST &>(ast).rhs);
+        const int *r = constant(rhs);
+        int val;
+        if (r && fold(ast.type, *r, val)) {
+            return integer(val);
+        }
+        return std::make_unique<UnaryExprAST>(ast.type, std::move(rhs));
+    }
+    if (BINOP_BIGIN < ast.type && ast.type < BINOP_END) {
+        return binary(static_cast<BinaryExprAST &>(ast));
+    }
+    if (ast.type == QUESTION) {
+        auto &node = static_cast<ConditionalExprAST &>(ast);
+        auto cond = run(*node.cond);
+        const int *c = constant(cond);
+        if (c) {
+            return run(*c ? *node.lhs : *node.rhs);
+        }
+        return std::make_unique<ConditionalExprAST>(
+            std::move(cond), run(*node.lhs), run(*node.rhs));
+    }
+    if (CALL_BIGIN < ast.type && ast.type < CALL_END) {
+        // folded unless an argument is unknown or a bit range is invalid
+        std::vector<std::unique_ptr<ExprAST>> args;
+        int values[BUILTIN_ARGS];
+        bool known = true;
+        for (auto &arg : static_cast<CallExprAST &>(ast).args) {
+            args.push_back(run(*arg));
+            const int *v = constant(args.back());
+            if (v) {
+                values[args.size() - 1] = *v;
+            }
+            known = known && v;
+        }
+        if (known && ((ast.type != BITS && ast.type != SETBITS) ||
+                      bit_range(values[1], values[2]))) {
+            return integer(call(ast.type, values));
+        }
+        return std::make_unique<CallExprAST>(ast.type, std::move(args));
+    }
+    if (ASSIGN_BIGIN < ast.type && ast.type < ASSIGN_END) {
+        // the lhs stays a symbol (written symbols are never substituted)
+        auto &node = static_cast<AssignExprAST &>(ast);
+        auto lhs = node.lhs->type == VAR || node.lhs->type == REG
+                       ? symbol(*node.lhs)
+                       : run(*node.lhs);
+        return std::make_unique<AssignExprAST>(ast.type, std::move(lhs),
+                                               run(*node.rhs));
+    }
+    throw expr_error("unknown operator");
+}
+
+//-----------------------------------------------------------------------------
+Specialized specialize(ExprAST &ast, const SymbolTable &known, bool checked) {
+    auto refs = references(ast);
+    Specializer specializer(
+        known, std::unordered_set<int>(refs.writes.begin(), refs.writes.end()),
+        checked);
+
+    Specialized result;
+    result.ast = specializer.run(ast);
+
+    refs = references(*result.ast);
+    std::unordered_set<int> seen;
+    for (auto ids : {&refs.reads, &refs.writes}) {
+        for (int id : *ids) {
+            if (seen.insert(id).second) {
+                result.free.push_back(id);
+            }
+        }
+    }
+    return result;
+}
+
+//=============================================================================
+// adaptive && / ||
+
+//-----------------------------------------------------------------------------
+AdaptiveExprAST::AdaptiveExprAST(Type type, std::unique_ptr<ExprAST> lhs,
+                                 std::unique_ptr<ExprAST> rhs)
+    : BinaryExprAST(type, std::move(lhs), std::move(rhs)), packed(0),
+      samples(0) {
+    // expand the leftmost operand of the same type until none is left
+    std::vector<std::unique_ptr<ExprAST> *> slots = {&this->lhs, &this->rhs};
+    for (size_t i = 0; i < slots.size() && slots.size() < OPERANDS_MAX;) {
+        if ((*slots[i])->type != type) {
+            i++;
+            continue;
+        }
+        auto &node = static_cast<BinaryExprAST &>(**slots[i]);
+        slots[i] = &node.rhs;
+        slots.insert(slots.begin() + i, &node.lhs);
+    }
+    count = slots.size();
+    operands.reset(new Operand[count]);
+    uint64_t ord = 0;
+    for (size_t i = 0; i < count; i++) {
+        operands[i].slot = slots[i];
+        ord |= uint64_t(i) << (4 * i);
+    }
+    packed = ord;
+}
+
+std::vector<size_t> AdaptiveExprAST::order() const {
+    std::vector<size_t> result;
+    uint64_t ord = packed.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++, ord >>= 4) {
+        result.push_back(ord & 15);
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+int AdaptiveExprAST::sample(std::function<int &(const std::string &)> &fp) {
+    return sample_(fp);
+}
+int AdaptiveExprAST::sample(SymbolTable &symbols) { return sample_(symbols); }
+
+// sample_ - eval_ that measures every operand it may run
+template <class Env> int AdaptiveExprAST::sample_(Env &fp) {
+    bool stop = type == LOR;
+    bool decided = false;
+    uint64_t ord = packed.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++, ord >>= 4) {
+        Operand &op = operands[ord & 15];
+        if (decided && op.barrier) {
+            break;
+        }
+        uint64_t start = cycles();
+        bool val = op.slot->get()->eval(fp) != 0;
+        op.cycles.fetch_add(cycles() - start, std::memory_order_relaxed);
+        if (val == stop) {
+            op.decisions.fetch_add(1, std::memory_order_relaxed);
+            decided = true;
+        }
+    }
+    if ((samples.fetch_add(1, std::memory_order_relaxed) + 1) %
+            REORDER_PERIOD ==
+        0) {
+        reorder();
+    }
+    return decided ? stop : !stop;
+}
+
+//-----------------------------------------------------------------------------
+// reorder - sort each run of operands between barriers by cycles per
+// decision (the cost of an operand over the chance that it ends the chain)
+void AdaptiveExprAST::reorder() {
+    std::unique_lock<std::mutex> lock(reordering, std::try_to_lock);
+    if (!lock) {
+        return; // another thread is at it
+    }
+    std::vector<double> rank(count);
+    for (size_t i = 0; i < count; i++) {
+        Operand &op = operands[i];
+        uint64_t decisions = op.decisions.load(std::memory_order_relaxed);
+        uint64_t cycles = op.cycles.load(std::memory_order_relaxed);
+        rank[i] = decisions ? double(cycles) / double(decisions) : HUGE_VAL;
+        // halve the history (racing increments may be lost)
+        op.decisions.store(decisions / 2, std::memory_order_relaxed);
+        op.cycles.store(cycles / 2, std::memory_order_relaxed);
+    }
+
+    auto ord = order();
+    for (size_t begin = 0; begin < count;) {
+        if (operands[ord[begin]].barrier) {
+            begin++;
+            continue;
+        }
+        size_t end = begin;
+        while (end < count && !operands[ord[end]].barrier) {
+            end++;
+        }
+        std::stable_sort(ord.begin() + begin, ord.begin() + end,
+                         [&](size_t a, size_t b) { return rank[a] < rank[b]; });
+        begin = end;
+    }
+    uint64_t next = 0;
+    for (size_t i = 0; i < count; i++) {
+        next |= uint64_t(ord[i]) << (4 * i);
+    }
+    packed.store(next, std::memory_order_release);
+}
+
+//-----------------------------------------------------------------------------
+void adapt(std::unique_ptr<ExprAST> &ast, bool checked) {
+    if (dynamic_cast<AdaptiveExprAST *>(ast.get())) {
+        return; // adapted before
+    }
+    if (ast->type != LAND && ast->type != LOR) {
+        for_each_child(*ast, [checked](std::unique_ptr<ExprAST> &child) {
+            adapt(child, checked);
+        });
+        return;
+    }
+    auto &node = static_cast<BinaryExprAST &>(*ast);
+    auto chain = std::make_unique<AdaptiveExprAST>(
+        ast->type, std::move(node.lhs), std::move(node.rhs));
+    bool movable = false; // two operands next to each other may swap
+    for (size_t i = 0; i < chain->size(); i++) {
+        auto &op = chain->operand(i);
+        adapt(*op.slot, checked);
+        op.barrier = barrier(**op.slot, checked);
+        movable = movable ||
+                  (i > 0 && !op.barrier && !chain->operand(i - 1).barrier);
+    }
+    if (movable) {
+        ast = std::move(chain);
+    } else { // nothing to learn: the plain node without sampling
+        ast = std::make_unique<BinaryExprAST>(
+            chain->type, std::move(chain->lhs), std::move(chain->rhs));
+    }
+}
+
+} // namespace expr
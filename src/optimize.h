@@ -0,0 +1,58 @@
+#pragma once
+
+#include "expr.h"
+#include <memory>
+#include <vector>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// optimize - rewrite ast in place for repeated evaluation.
+//   x * 2^k, 2^k * x   -> x << k
+//   x *= 2^k           -> x <<= k
+//   x / c, x % c       -> multiplication by a magic number of c (|c| >= 2)
+//   x / y, x % y       -> the same once prepare() has seen y (y a symbol)
+//   x /= c, x %= c ... -> x = x / c, x = x % c
+// Results are unchanged, including truncation toward zero for negative
+// operands.
+void optimize(std::unique_ptr<ExprAST> &ast);
+
+//-----------------------------------------------------------------------------
+// adapt - replace chains of && / || in ast by nodes that learn, while they
+// are evaluated, which operands are cheap and decide the result most often
+// and run those first (see AdaptiveExprAST). Only operands without
+// assignments and without divisions or bit ranges that may fail (if
+// checked, arithmetic that may overflow) are reordered, so results are
+// unchanged; symbols read by an operand may be created (as 0) earlier than
+// before. checked must be on if ast is evaluated with Checked (see
+// arith.h). Safe with concurrent evaluation. TraceFilter uses it when
+// adaptive.
+void adapt(std::unique_ptr<ExprAST> &ast, bool checked = false);
+
+//-----------------------------------------------------------------------------
+// prepare - compute the magic numbers of divisions by symbols from their
+// current values, e.g. once before evaluating a batch in which the divisors
+// do not change. A division whose divisor differs from the prepared value
+// still gives the right result, by a hardware division.
+// Call it while ast is not being evaluated.
+void prepare(ExprAST &ast, const SymbolTable &symbols);
+
+//-----------------------------------------------------------------------------
+// specialize - partial evaluation of ast for the symbols bound in known.
+// Returns a new tree in which known symbols are replaced by their values
+// and constant subtrees are folded:
+//   (mode == 2 ? a * k : b) + offset   [mode = 2, k = 4, offset = 1]
+//   -> (a * 4) + 1                     free: a
+// Subtrees that assign or may fail (as for adapt()) are never dropped or
+// reordered, e.g. "(x / y) * 0" is "(x / 0) * 0" for y = 0, and symbols
+// assigned anywhere in ast are not substituted. Division by zero, overflow
+// and shifts out of range are left for evaluation, checked or not as given
+// by checked (see arith.h). ast is not modified.
+struct Specialized {
+    std::unique_ptr<ExprAST> ast;
+    std::vector<int> free; // symbols (interned ids) still referenced
+};
+Specialized specialize(ExprAST &ast, const SymbolTable &known,
+                       bool checked = false);
+
+} // namespace expr
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// concurrency - number of worker threads to use by default
+inline size_t concurrency() {
+    size_t n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+//-----------------------------------------------------------------------------
+// parallel_for - split [0, n) into contiguous ranges, one per worker, and
+// call fn(begin, end, worker) for each range. Worker 0 runs on the calling
+// thread. If fn throws (e.g. expr_error from checked evaluation), the other
+// ranges still run to their end and the exception of the lowest worker is
+// rethrown.
+template <class F> void parallel_for(size_t n, size_t workers, F fn) {
+    workers = std::max<size_t>(1, std::min(workers, n));
+    std::vector<std::exception_ptr> errors(workers);
+    auto run = [&](size_t begin, size_t end, size_t w) {
+        try {
+            fn(begin, end, w);
+        } catch (...) {
+            errors[w] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (size_t w = 1; w < workers; w++) {
+        threads.emplace_back(run, n * w / workers, n * (w + 1) / workers, w);
+    }
+    if (n) {
+        run(0, n / workers, 0);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (auto &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+} // namespace expr
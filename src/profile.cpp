@@ -0,0 +1,216 @@
+#include "profile.h"
+#include "ast.h"
+#include <algorithm>
+#include <stdio.h>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+Profile::Profile(ExprAST &ast) { build(ast, 0); }
+
+void Profile::build(ExprAST &ast, int depth) {
+    size_t index = list.size();
+    list.push_back(Node{&ast, depth, 0, 0, 0, {}});
+    for_each_child(ast, [&](std::unique_ptr<ExprAST> &child) {
+        list[index].children.push_back(list.size());
+        build(*child, depth + 1);
+    });
+}
+
+//-----------------------------------------------------------------------------
+int Profile::eval(size_t i, SymbolTable &symbols) {
+    Node &node = list[i];
+    uint64_t start = cycles();
+    int val = value(node, symbols);
+    node.cycles += cycles() - start;
+    node.visits++;
+    return val;
+}
+
+//-----------------------------------------------------------------------------
+// value - evaluate one node, its children through eval()
+int Profile::value(Node &node, SymbolTable &symbols) {
+    ExprAST &ast = *node.ast;
+    auto child = [&](size_t k) { return eval(node.children[k], symbols); };
+
+    switch (ast.type) {
+    case IMM:
+    case VAR:
+    case REG:
+        return ast.eval(symbols);
+    case PLUS:
+        return +child(0);
+    case MINUS:
+        return arith(MINUS, child(0), 0, &ast);
+    case INV:
+        return ~child(0);
+    case NOT:
+        return !child(0);
+    case LAND:
+        if (!child(0)) {
+            node.shorts++;
+            return 0;
+        }
+        return !!child(1);
+    case LOR:
+        if (child(0)) {
+            node.shorts++;
+            return 1;
+        }
+        return !!child(1);
+    case QUESTION:
+        if (child(0)) {
+            node.shorts++;
+            return child(1);
+        }
+        return child(2);
+    default:
+        break;
+    }
+
+    if (BINOP_BIGIN < ast.type && ast.type < BINOP_END) {
+        int lhs = child(0);
+        int rhs = child(1);
+        switch (ast.type) {
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case MOD:
+            return arith(ast.type, lhs, rhs, &ast);
+        case AND:
+            return lhs & rhs;
+        case OR:
+            return lhs | rhs;
+        case XOR:
+            return lhs ^ rhs;
+        case SFTL:
+        case SFTR:
+            return arith(ast.type, lhs, rhs, &ast);
+        case EQ:
+            return lhs == rhs;
+        case NE:
+            return lhs != rhs;
+        case LT:
+            return lhs < rhs;
+        case LE:
+            return lhs <= rhs;
+        case GT:
+            return lhs > rhs;
+        case GE:
+            return lhs >= rhs;
+        case DIVM:
+        case MODM:
+            return static_cast<DivideExprAST &>(ast).apply(lhs, rhs);
+        default:
+            break;
+        }
+    } else if (CALL_BIGIN < ast.type && ast.type < CALL_END) {
+        int args[BUILTIN_ARGS];
+        for (size_t k = 0; k < node.children.size(); k++) {
+            args[k] = child(k);
+        }
+        return call(ast.type, args);
+    } else if (ASSIGN_BIGIN < ast.type && ast.type < ASSIGN_END) {
+        // the lhs is a reference, not evaluated (and not visited)
+        auto &lhs = *static_cast<AssignExprAST &>(ast).lhs;
+        int *ref;
+        if (lhs.type == VAR) {
+            ref = static_cast<VariableExprAST &>(lhs).ref(symbols);
+        } else if (lhs.type == REG) {
+            ref = static_cast<RegisterExprAST &>(lhs).ref(symbols);
+        } else {
+            throw expr_error("cannot assign to except for variables");
+        }
+        int rhs = child(1);
+        switch (ast.type) {
+        case ASSIGN:
+            return *ref = rhs;
+        case ASSIGN_OR:
+            return *ref |= rhs;
+        case ASSIGN_XOR:
+            return *ref ^= rhs;
+        case ASSIGN_AND:
+            return *ref &= rhs;
+        case ASSIGN_SL:
+        case ASSIGN_SR:
+        case ASSIGN_ADD:
+        case ASSIGN_SUB:
+        case ASSIGN_MUL:
+        case ASSIGN_DIV:
+        case ASSIGN_MOD:
+            return *ref = arith(assign_op(ast.type), *ref, rhs, &ast);
+        default:
+            break;
+        }
+    }
+    throw expr_error("unknown operator");
+}
+
+//-----------------------------------------------------------------------------
+uint64_t Profile::self(size_t i) const {
+    uint64_t total = list[i].cycles;
+    for (size_t c : list[i].children) {
+        total -= std::min(total, list[c].cycles);
+    }
+    return total;
+}
+
+//-----------------------------------------------------------------------------
+// report
+//   total%  self%     visits  short-circuit  expression
+//    100.0   19.9       1000  rhs   75.0%    a && b
+//     80.1   80.1       1000                   b
+std::string Profile::report() const {
+    char buf[160];
+    const Node &root = list[0];
+    snprintf(buf, sizeof(buf),
+             "%llu evaluations, %llu cycles/evaluation\n"
+             "%6s %6s %10s  %-13s  %s\n",
+             (unsigned long long)root.visits,
+             (unsigned long long)(root.visits ? root.cycles / root.visits
+                                              : 0),
+             "total%", "self%", "visits", "short-circuit", "expression");
+    std::string out = buf;
+    report(0, out);
+    return out;
+}
+
+void Profile::report(size_t i, std::string &out) const {
+    enum { TEXT_MAX = 60 };
+    const Node &node = list[i];
+    double total = list[0].cycles ? list[0].cycles : 1;
+
+    char shorts[32] = "";
+    if (node.ast->type == LAND || node.ast->type == LOR ||
+        node.ast->type == QUESTION) {
+        snprintf(shorts, sizeof(shorts), "%s %5.1f%%",
+                 node.ast->type == QUESTION ? "true" : "rhs ",
+                 node.visits ? 100.0 * node.shorts / node.visits : 0.0);
+    }
+    std::string text = unparse(*node.ast);
+    if (text.size() > TEXT_MAX) {
+        text.resize(TEXT_MAX - 3);
+        text += "...";
+    }
+
+    char buf[96];
+    snprintf(buf, sizeof(buf), "%6.1f %6.1f %10llu  %-13s  ",
+             100.0 * node.cycles / total, 100.0 * self(i) / total,
+             (unsigned long long)node.visits, shorts);
+    out += buf;
+    out.append(node.depth * 2, ' ');
+    out += text;
+    out += '\n';
+
+    std::vector<size_t> children = node.children;
+    std::stable_sort(children.begin(), children.end(),
+                     [&](size_t a, size_t b) {
+                         return list[a].cycles > list[b].cycles;
+                     });
+    for (size_t c : children) {
+        report(c, out);
+    }
+}
+
+} // namespace expr
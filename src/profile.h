@@ -0,0 +1,69 @@
+#pragma once
+
+#include "expr.h"
+#include <chrono>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// cycles - time stamp counter (nanoseconds where there is none)
+inline uint64_t cycles() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+//=============================================================================
+// Profile - profiling evaluation of an AST.
+// Evaluates the tree like ExprAST::eval(SymbolTable &) while counting, for
+// every node, the visits, the cycles spent in its subtree (rdtsc where
+// available, nanoseconds otherwise) and how often LAND / LOR / ?:
+// short-circuit. Cycles include the cost of the measurement itself, so
+// compare nodes with each other rather than with an unprofiled run.
+// The AST must outlive the profile.
+class Profile {
+  public:
+    struct Node {
+        ExprAST *ast;
+        int depth;
+        uint64_t visits;
+        uint64_t cycles; // inclusive
+        uint64_t shorts; // LAND/LOR: rhs skipped, ?: cond was true
+        std::vector<size_t> children; // indices into nodes()
+    };
+
+    explicit Profile(ExprAST &ast);
+
+    int eval(SymbolTable &symbols) { return eval(0, symbols); }
+
+    // nodes in preorder; nodes()[0] is the root
+    const std::vector<Node> &nodes() const { return list; }
+    // cycles of node i minus those of its children
+    uint64_t self(size_t i) const;
+
+    // annotated tree, children sorted by cost
+    std::string report() const;
+
+  private:
+    std::vector<Node> list;
+
+    void build(ExprAST &ast, int depth);
+    int eval(size_t i, SymbolTable &symbols);
+    int value(Node &node, SymbolTable &symbols);
+    void report(size_t i, std::string &out) const;
+};
+
+} // namespace expr
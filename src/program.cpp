@@ -0,0 +1,544 @@
+#include "program.h"
+#include "ast.h"
+#include "mapped_file.h"
+#include <algorithm>
+#include <string.h>
+#include <unordered_map>
+
+namespace expr {
+
+//=============================================================================
+// compiler
+
+//-----------------------------------------------------------------------------
+class Compiler {
+  public:
+    explicit Compiler(std::vector<Insn> &code, std::vector<int> &slot_ids)
+        : code(code), slot_ids(slot_ids) {}
+    void emit(ExprAST &ast);
+
+  private:
+    std::vector<Insn> &code;
+    std::vector<int> &slot_ids;
+    std::unordered_map<int, int> slots; // interned id -> slot
+    int divisions = 0;                  // DIVM / MODM emitted
+
+    int slot(int id) {
+        auto itr = slots.find(id);
+        if (itr != slots.end()) {
+            return itr->second;
+        }
+        int index = static_cast<int>(slot_ids.size());
+        slot_ids.push_back(id);
+        slots.emplace(id, index);
+        return index;
+    }
+    size_t insn(int op, int arg = 0) {
+        code.push_back(Insn{op, arg});
+        return code.size() - 1;
+    }
+    void patch(size_t at) { code[at].arg = static_cast<int32_t>(code.size()); }
+    // invariant - a divisor worth a magic number: a symbol, or a literal
+    // that has one
+    static bool invariant(ExprAST &rhs) {
+        return rhs.type == VAR || rhs.type == REG ||
+               (rhs.type == IMM &&
+                Divisor(static_cast<IntegerExprAST &>(rhs).Val).magic);
+    }
+};
+
+//-----------------------------------------------------------------------------
+void Compiler::emit(ExprAST &ast) {
+    if (ast.type == IMM) {
+        insn(IMM, static_cast<IntegerExprAST &>(ast).Val);
+    } else if (ast.type == VAR) {
+        insn(VAR, slot(static_cast<VariableExprAST &>(ast).Id));
+    } else if (ast.type == REG) {
+        // registers are slots named "%r12"; the host binds slots
+        insn(VAR, slot(static_cast<RegisterExprAST &>(ast).Id));
+    } else if (ast.type == QUESTION) {
+        auto &node = static_cast<ConditionalExprAST &>(ast);
+        emit(*node.cond);
+        size_t jz = insn(JZ);
+        emit(*node.lhs);
+        size_t jmp = insn(JMP);
+        patch(jz);
+        emit(*node.rhs);
+        patch(jmp);
+    } else if (ast.type == LAND || ast.type == LOR) {
+        auto &node = static_cast<BinaryExprAST &>(ast);
+        emit(*node.lhs);
+        size_t jump = insn(ast.type);
+        emit(*node.rhs);
+        insn(BOOL);
+        patch(jump);
+    } else if (ASSIGN_BIGIN < ast.type && ast.type < ASSIGN_END) {
+        auto &node = static_cast<AssignExprAST &>(ast);
+        int id;
+        if (node.lhs->type == VAR) {
+            id = static_cast<VariableExprAST &>(*node.lhs).Id;
+        } else if (node.lhs->type == REG) {
+            id = static_cast<RegisterExprAST &>(*node.lhs).Id;
+        } else {
+            throw expr_error("cannot assign to except for variables");
+        }
+        if ((ast.type == ASSIGN_DIV || ast.type == ASSIGN_MOD) &&
+            invariant(*node.rhs)) {
+            // x /= d -> x = x / d; d cannot assign, so x may be read first
+            insn(VAR, slot(id));
+            emit(*node.rhs);
+            insn(ast.type == ASSIGN_DIV ? DIVM : MODM, divisions++);
+            insn(ASSIGN, slot(id));
+        } else {
+            emit(*node.rhs);
+            insn(ast.type, slot(id));
+        }
+    } else if ((ast.type == DIV || ast.type == MOD || ast.type == DIVM ||
+                ast.type == MODM) &&
+               invariant(*static_cast<BinaryExprAST &>(ast).rhs)) {
+        auto &node = static_cast<BinaryExprAST &>(ast);
+        emit(*node.lhs);
+        emit(*node.rhs);
+        insn(ast.type == DIV || ast.type == DIVM ? DIVM : MODM, divisions++);
+    } else {
+        // unary / binary operators
+        for_each_child(ast, [&](std::unique_ptr<ExprAST> &child) {
+            emit(*child);
+        });
+        insn(ast.type == DIVM ? DIV : ast.type == MODM ? MOD : ast.type);
+    }
+}
+
+//-----------------------------------------------------------------------------
+std::unique_ptr<Program> compile(ExprAST &ast) {
+    std::unique_ptr<Program> prog(new Program);
+    Compiler(prog->owned, prog->slot_ids).emit(ast);
+    prog->code = prog->owned.data();
+    prog->size = prog->owned.size();
+    if (!prog->verify()) {
+        throw expr_error("cannot compile expression");
+    }
+    return prog;
+}
+
+//=============================================================================
+// verifier
+
+//-----------------------------------------------------------------------------
+// verify - check that every instruction is known, every slot exists, every
+// jump goes forward inside the code, and the stack depth at each point does
+// not depend on the path taken. Computes the stack size, the slots the code
+// assigns and the divisors of DIVM / MODM (from the instruction before each,
+// which pushes the divisor unless it is an expression).
+bool Program::verify() {
+    written.assign(slot_ids.size(), 0);
+    divisors.clear();
+    divisor_slots.clear();
+    std::vector<int> expect(size + 1, -1); // stack depth at jump targets
+    int d = 0;
+    int max = 0;
+    bool reachable = true;
+    auto jump = [&](size_t pc, int32_t target, int at) {
+        if (target <= static_cast<int64_t>(pc) ||
+            static_cast<size_t>(target) > size) {
+            return false;
+        }
+        if (expect[target] >= 0 && expect[target] != at) {
+            return false;
+        }
+        expect[target] = at;
+        return true;
+    };
+    auto slot = [&](int32_t arg) {
+        return 0 <= arg && static_cast<size_t>(arg) < slot_ids.size();
+    };
+
+    for (size_t pc = 0; pc < size; pc++) {
+        if (!reachable) { // only reachable by a jump
+            if (expect[pc] < 0) {
+                return false;
+            }
+            d = expect[pc];
+            reachable = true;
+        } else if (expect[pc] >= 0 && expect[pc] != d) {
+            return false;
+        }
+
+        const Insn &insn = code[pc];
+        int op = insn.op;
+        if (op == IMM) {
+            d++;
+        } else if (op == VAR) {
+            if (!slot(insn.arg)) {
+                return false;
+            }
+            d++;
+        } else if (op == PLUS || op == MINUS || op == INV || op == NOT ||
+                   op == BOOL) {
+            if (d < 1) {
+                return false;
+            }
+        } else if (op == LAND || op == LOR) {
+            if (d < 1 || !jump(pc, insn.arg, d)) {
+                return false;
+            }
+            d--;
+        } else if (op == DIVM || op == MODM) {
+            if (d < 2 || insn.arg != static_cast<int32_t>(divisors.size())) {
+                return false;
+            }
+            const Insn &divisor = code[pc - 1];
+            divisors.push_back(Divisor(divisor.op == IMM ? divisor.arg : 0));
+            divisor_slots.push_back(divisor.op == VAR ? divisor.arg : -1);
+            d--;
+        } else if (BINOP_BIGIN < op && op < BINOP_END) {
+            if (d < 2) {
+                return false;
+            }
+            d--;
+        } else if (ASSIGN_BIGIN < op && op < ASSIGN_END) {
+            if (d < 1 || !slot(insn.arg)) {
+                return false;
+            }
+            written[insn.arg] = 1;
+        } else if (CALL_BIGIN < op && op < CALL_END) {
+            int arity = builtin(static_cast<Type>(op))->arity;
+            if (d < arity) {
+                return false;
+            }
+            d -= arity - 1;
+        } else if (op == JZ) {
+            if (d < 1 || !jump(pc, insn.arg, d - 1)) {
+                return false;
+            }
+            d--;
+        } else if (op == JMP) {
+            if (!jump(pc, insn.arg, d)) {
+                return false;
+            }
+            reachable = false;
+        } else {
+            return false;
+        }
+        max = std::max(max, d);
+    }
+
+    if (!reachable) {
+        d = expect[size];
+    } else if (expect[size] >= 0 && expect[size] != d) {
+        return false;
+    }
+    if (d != 1) {
+        return false;
+    }
+    depth = static_cast<size_t>(max);
+    return true;
+}
+
+//=============================================================================
+// evaluation
+
+//-----------------------------------------------------------------------------
+template <bool Checked, class Slot>
+int Program::run(Slot slot, const Divisor *prepared) const {
+    int small[32];
+    static thread_local std::vector<int> large; // grows once per thread
+    int *sp = small; // next free entry
+    if (depth > sizeof(small) / sizeof(small[0])) {
+        if (large.size() < depth) {
+            large.resize(depth);
+        }
+        sp = large.data();
+    }
+
+    const Insn *pc = code;
+    const Insn *end = code + size;
+    while (pc != end) {
+        switch (pc->op) {
+        case IMM:
+            *sp++ = pc->arg;
+            break;
+        case VAR:
+            *sp++ = slot(pc->arg);
+            break;
+        case PLUS:
+            break;
+        case MINUS:
+            sp[-1] = arith<Checked>(MINUS, sp[-1], 0);
+            break;
+        case INV:
+            sp[-1] = ~sp[-1];
+            break;
+        case NOT:
+            sp[-1] = !sp[-1];
+            break;
+        case BOOL:
+            sp[-1] = !!sp[-1];
+            break;
+
+#define BINARY(op_type, op)                                                    \
+    case op_type:                                                              \
+        sp--;                                                                  \
+        sp[-1] = sp[-1] op sp[0];                                              \
+        break;
+            BINARY(AND, &)
+            BINARY(OR, |)
+            BINARY(XOR, ^)
+            BINARY(EQ, ==)
+            BINARY(NE, !=)
+            BINARY(LT, <)
+            BINARY(LE, <=)
+            BINARY(GT, >)
+            BINARY(GE, >=)
+#undef BINARY
+
+#define ARITH(op_type)                                                         \
+    case op_type:                                                              \
+        sp--;                                                                  \
+        sp[-1] = arith<Checked>(op_type, sp[-1], sp[0]);                       \
+        break;
+            ARITH(ADD)
+            ARITH(SUB)
+            ARITH(MUL)
+            ARITH(DIV)
+            ARITH(MOD)
+            ARITH(SFTL)
+            ARITH(SFTR)
+#undef ARITH
+
+#define DIVIDE(op_type, op)                                                    \
+    case op_type:                                                              \
+        sp--;                                                                  \
+        sp[-1] = divide<Checked>(op, sp[-1], sp[0], prepared[pc->arg]);        \
+        break;
+            DIVIDE(DIVM, DIV)
+            DIVIDE(MODM, MOD)
+#undef DIVIDE
+
+#define ASSIGN_OP(op_type, op)                                                 \
+    case op_type:                                                              \
+        sp[-1] = (slot(pc->arg) op sp[-1]);                                    \
+        break;
+            ASSIGN_OP(ASSIGN, =)
+            ASSIGN_OP(ASSIGN_OR, |=)
+            ASSIGN_OP(ASSIGN_XOR, ^=)
+            ASSIGN_OP(ASSIGN_AND, &=)
+#undef ASSIGN_OP
+
+#define ASSIGN_ARITH(op_type, op)                                              \
+    case op_type: {                                                            \
+        int &lhs = slot(pc->arg);                                              \
+        sp[-1] = lhs = arith<Checked>(op, lhs, sp[-1]);                        \
+        break;                                                                 \
+    }
+            ASSIGN_ARITH(ASSIGN_SL, SFTL)
+            ASSIGN_ARITH(ASSIGN_SR, SFTR)
+            ASSIGN_ARITH(ASSIGN_ADD, ADD)
+            ASSIGN_ARITH(ASSIGN_SUB, SUB)
+            ASSIGN_ARITH(ASSIGN_MUL, MUL)
+            ASSIGN_ARITH(ASSIGN_DIV, DIV)
+            ASSIGN_ARITH(ASSIGN_MOD, MOD)
+#undef ASSIGN_ARITH
+
+        case LAND:
+            if (!sp[-1]) {
+                pc = code + pc->arg;
+                continue;
+            }
+            sp--;
+            break;
+        case LOR:
+            if (sp[-1]) {
+                sp[-1] = 1;
+                pc = code + pc->arg;
+                continue;
+            }
+            sp--;
+            break;
+        case JZ:
+            sp--;
+            if (!sp[0]) {
+                pc = code + pc->arg;
+                continue;
+            }
+            break;
+        case JMP:
+            pc = code + pc->arg;
+            continue;
+        case POPCNT:
+            sp[-1] = popcnt(sp[-1]);
+            break;
+        case CLZ:
+            sp[-1] = clz(sp[-1]);
+            break;
+        case CTZ:
+            sp[-1] = ctz(sp[-1]);
+            break;
+        case BSWAP:
+            sp[-1] = bswap(sp[-1]);
+            break;
+        case BITS:
+            sp -= 2;
+            if (!bit_range(sp[0], sp[1])) {
+                throw expr_error("invalid bit range");
+            }
+            sp[-1] = bits(sp[-1], sp[0], sp[1]);
+            break;
+        case SETBITS:
+            sp -= 3;
+            if (!bit_range(sp[0], sp[1])) {
+                throw expr_error("invalid bit range");
+            }
+            sp[-1] = setbits(sp[-1], sp[0], sp[1], sp[2]);
+            break;
+        default:
+            throw expr_error("unknown operator");
+        }
+        pc++;
+    }
+    return sp[-1];
+}
+
+//-----------------------------------------------------------------------------
+int Program::eval(int *slots) const { return eval(slots, divisors.data()); }
+
+int Program::eval(int *slots, const Divisor *prepared) const {
+    auto slot = [slots](int i) -> int & { return slots[i]; };
+    return checking ? run<true>(slot, prepared) : run<false>(slot, prepared);
+}
+
+void Program::prepare(const int *slots, Divisor *prepared) const {
+    for (size_t i = 0; i < divisors.size(); i++) {
+        prepared[i] = divisor_slots[i] >= 0 ? Divisor(slots[divisor_slots[i]])
+                                            : divisors[i];
+    }
+}
+
+//-----------------------------------------------------------------------------
+int Program::eval(SymbolTable &symbols) const {
+    int *small[16];
+    std::vector<int *> large;
+    int **refs = small;
+    if (slot_ids.size() > sizeof(small) / sizeof(small[0])) {
+        large.resize(slot_ids.size());
+        refs = large.data();
+    }
+    for (size_t i = 0; i < slot_ids.size(); i++) {
+        // only assigned slots count as changes of the table
+        refs[i] = written[i] ? &symbols.ref(slot_ids[i])
+                             : const_cast<int *>(&symbols.cref(slot_ids[i]));
+    }
+    auto slot = [refs](int i) -> int & { return *refs[i]; };
+    return checking ? run<true>(slot, divisors.data())
+                    : run<false>(slot, divisors.data());
+}
+
+//=============================================================================
+// binary image
+//   ProgramHeader
+//   Insn[length]
+//   SymbolName[symbols]
+//   source bytes
+//   name bytes
+
+struct ProgramHeader {
+    char magic[8]; // "CREPLPRG"
+    uint32_t version;
+    uint32_t length;
+    uint32_t symbols;
+    uint32_t source_size;
+    uint32_t names_size;
+    uint32_t reserved;
+};
+
+struct SymbolName {
+    uint32_t offset; // offset in the name bytes
+    uint32_t len;
+};
+
+static const char program_magic[8] = {'C', 'R', 'E', 'P', 'L', 'P', 'R', 'G'};
+
+//-----------------------------------------------------------------------------
+std::string Program::serialize(const std::string &source) const {
+    std::vector<SymbolName> table;
+    std::string names;
+    for (int id : slot_ids) {
+        const std::string &name = interner().name(id);
+        table.push_back(SymbolName{static_cast<uint32_t>(names.size()),
+                                   static_cast<uint32_t>(name.size())});
+        names += name;
+    }
+
+    ProgramHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, program_magic, sizeof(header.magic));
+    header.version = PROGRAM_VERSION;
+    header.length = static_cast<uint32_t>(size);
+    header.symbols = static_cast<uint32_t>(table.size());
+    header.source_size = static_cast<uint32_t>(source.size());
+    header.names_size = static_cast<uint32_t>(names.size());
+
+    std::string image;
+    image.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    image.append(reinterpret_cast<const char *>(code), sizeof(Insn) * size);
+    image.append(reinterpret_cast<const char *>(table.data()),
+                 sizeof(SymbolName) * table.size());
+    image += source;
+    image += names;
+    return image;
+}
+
+//-----------------------------------------------------------------------------
+std::unique_ptr<Program> Program::load(std::shared_ptr<const MappedFile> file,
+                                       const std::string &source) {
+    const char *base = file->data();
+    size_t size = file->size();
+
+    ProgramHeader header;
+    if (size < sizeof(header)) {
+        return nullptr;
+    }
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, program_magic, sizeof(header.magic)) != 0 ||
+        header.version != PROGRAM_VERSION) {
+        return nullptr;
+    }
+    uint64_t expect = sizeof(header) + uint64_t(sizeof(Insn)) * header.length +
+                      uint64_t(sizeof(SymbolName)) * header.symbols +
+                      header.source_size + header.names_size;
+    if (expect != size) {
+        return nullptr;
+    }
+
+    const char *p = base + sizeof(header);
+    auto code = reinterpret_cast<const Insn *>(p);
+    p += sizeof(Insn) * header.length;
+    auto table = reinterpret_cast<const SymbolName *>(p);
+    p += sizeof(SymbolName) * header.symbols;
+    if (source.size() != header.source_size ||
+        memcmp(p, source.data(), source.size()) != 0) {
+        return nullptr; // hash collision or different source
+    }
+    p += header.source_size;
+    const char *names = p;
+
+    std::unique_ptr<Program> prog(new Program);
+    prog->slot_ids.reserve(header.symbols);
+    for (uint32_t i = 0; i < header.symbols; i++) {
+        if (table[i].offset > header.names_size ||
+            table[i].len > header.names_size - table[i].offset) {
+            return nullptr;
+        }
+        prog->slot_ids.push_back(interner().intern(
+            std::string(names + table[i].offset, table[i].len)));
+    }
+    prog->code = code; // used in place
+    prog->size = header.length;
+    prog->map = std::move(file);
+    if (!prog->verify()) {
+        return nullptr;
+    }
+    return prog;
+}
+
+} // namespace expr
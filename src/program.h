@@ -0,0 +1,116 @@
+#pragma once
+
+#include "arith.h"
+#include "expr.h"
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace expr {
+
+class MappedFile;
+
+//=============================================================================
+// Program - compiled expression.
+// A flat postfix code over a value stack. Symbols are numbered slots:
+// slot i holds the value of the symbol with interned id symbols()[i].
+// The code only jumps forward, and it is verified when it is loaded, so a
+// corrupt program is rejected instead of being executed.
+
+//-----------------------------------------------------------------------------
+// instruction
+//   op = IMM            push arg
+//   op = VAR            push slot[arg]
+//   op = PLUS .. NOT    unary operator on top
+//   op = ADD .. GE      binary operator on the top two (not LAND, LOR, DIVM
+//                       and MODM)
+//   op = DIVM, MODM     DIV, MOD by invariant divisor number arg (numbered
+//                       in code order from 0): while the divisor on top
+//                       equals the prepared one, by its magic number
+//   op = ASSIGN ..      pop rhs, slot[arg] (op)= rhs, push slot[arg]
+//   op = POPCNT ..      builtin function on the top arity values
+//   op = LAND           top == 0 ? jump to arg (keep 0) : pop
+//   op = LOR            top != 0 ? top = 1, jump to arg : pop
+//   op = JZ             pop, jump to arg if it was 0
+//   op = JMP            jump to arg
+//   op = BOOL           top = !!top
+struct Insn {
+    int32_t op;
+    int32_t arg;
+};
+
+enum {
+    PROGRAM_VERSION = 4, // bump when the code or the file format changes
+    JZ = 1000,           // op codes that are not node types
+    JMP,
+    BOOL,
+};
+
+class Program {
+  public:
+    Program() : code(nullptr), size(0), depth(0), checking(false) {}
+    Program(const Program &) = delete;
+    Program &operator=(const Program &) = delete;
+
+    // interned id of each slot
+    const std::vector<int> &symbols() const { return slot_ids; }
+    // number of instructions
+    size_t length() const { return size; }
+    const Insn *begin() const { return code; }
+    // stack depth needed by eval
+    size_t stack_size() const { return depth; }
+
+    // checked arithmetic (see arith.h), off by default. Not to be changed
+    // while the program is being evaluated.
+    bool checked() const { return checking; }
+    void set_checked(bool on) { checking = on; }
+
+    // evaluate with slots[i] holding the value of symbols()[i]
+    int eval(int *slots) const;
+    // evaluate against a symbol table (missing symbols are created)
+    int eval(SymbolTable &symbols) const;
+
+    // Divisions by a literal (|d| >= 2) or a symbol are done by the magic
+    // number of a prepared divisor (see Divisor) while the divisor equals
+    // it, by a hardware division otherwise. eval() above prepares only the
+    // literals. For a batch of evaluations in which symbol divisors do not
+    // change, prepare() computes them once from the first slots:
+    //   std::vector<Divisor> div(prog.divisions());
+    //   prog.prepare(slots, div.data());
+    //   for (...) prog.eval(slots, div.data());
+    size_t divisions() const { return divisors.size(); }
+    void prepare(const int *slots, Divisor *prepared) const;
+    int eval(int *slots, const Divisor *prepared) const;
+
+    // binary image of the program, tagged with its (normalized) source
+    std::string serialize(const std::string &source) const;
+    // program from a binary image inside file (used in place).
+    // returns nullptr if the image is not a valid program of source.
+    static std::unique_ptr<Program>
+    load(std::shared_ptr<const MappedFile> file, const std::string &source);
+
+    friend std::unique_ptr<Program> compile(ExprAST &ast);
+
+  private:
+    const Insn *code;
+    size_t size;
+    size_t depth;
+    bool checking;
+    std::vector<Insn> owned;               // compiled code
+    std::shared_ptr<const MappedFile> map; // loaded code
+    std::vector<int> slot_ids;
+    std::vector<char> written;      // by slot: assigned by the code
+    std::vector<Divisor> divisors;  // by division: literal, or 0 (unknown)
+    std::vector<int> divisor_slots; // by division: slot of a symbol, or -1
+
+    bool verify();
+    template <bool Checked, class Slot>
+    int run(Slot slot, const Divisor *prepared) const;
+};
+
+//-----------------------------------------------------------------------------
+// compile ast (expr_error if it cannot be compiled, e.g. "1 = 2")
+std::unique_ptr<Program> compile(ExprAST &ast);
+
+} // namespace expr
@@ -0,0 +1,336 @@
+#include "range.h"
+#include "ast.h"
+#include <algorithm>
+#include <unordered_set>
+
+namespace expr {
+
+//=============================================================================
+// Range
+
+//-----------------------------------------------------------------------------
+Range Range::interval(int64_t lo, int64_t hi) {
+    if (lo < INT32_MIN || hi > INT32_MAX) {
+        return all();
+    }
+    Range r{static_cast<int>(lo), static_cast<int>(hi), 0, 0};
+    return r.normalize();
+}
+
+//-----------------------------------------------------------------------------
+Range &Range::normalize() {
+    // lo and hi of the same sign share their bits above the highest bit
+    // in which they differ, and so does every value between them
+    if ((lo < 0) == (hi < 0)) {
+        uint32_t l = static_cast<uint32_t>(lo);
+        int n = clz(static_cast<int>(l ^ static_cast<uint32_t>(hi)));
+        uint32_t prefix = n == 32 ? ~0u : n == 0 ? 0 : ~(~0u >> n);
+        zeros |= ~l & prefix;
+        ones |= l & prefix;
+    }
+    // with the sign known, unknown bits 0 give the smallest value and
+    // unknown bits 1 the largest
+    if ((zeros | ones) >> 31) {
+        lo = std::max(lo, static_cast<int>(ones));
+        hi = std::min(hi, static_cast<int>(~zeros));
+    }
+    return *this;
+}
+
+//=============================================================================
+// analysis
+
+static Range boolean() { return Range::interval(0, 1); }
+
+// union of the values of a and b
+static Range join(const Range &a, const Range &b) {
+    Range r{std::min(a.lo, b.lo), std::max(a.hi, b.hi), a.zeros & b.zeros,
+            a.ones & b.ones};
+    return r.normalize();
+}
+
+// largest |v| of r
+static int64_t magnitude(const Range &r) {
+    return std::max(-static_cast<int64_t>(r.lo), static_cast<int64_t>(r.hi));
+}
+
+//-----------------------------------------------------------------------------
+// compare - [1, 1] or [0, 0] when the ranges decide a comparison
+static Range compare(Type type, const Range &a, const Range &b) {
+    int result = -1;
+    switch (type) {
+    case EQ:
+    case NE:
+        if (a.is_constant() && b.is_constant()) {
+            result = a.lo == b.lo;
+        } else if (a.hi < b.lo || b.hi < a.lo || (a.zeros & b.ones) ||
+                   (a.ones & b.zeros)) {
+            result = 0;
+        }
+        if (result >= 0 && type == NE) {
+            result = !result;
+        }
+        break;
+    case LT:
+        result = a.hi < b.lo ? 1 : a.lo >= b.hi ? 0 : -1;
+        break;
+    case LE:
+        result = a.hi <= b.lo ? 1 : a.lo > b.hi ? 0 : -1;
+        break;
+    case GT:
+        result = a.lo > b.hi ? 1 : a.hi <= b.lo ? 0 : -1;
+        break;
+    case GE:
+        result = a.lo >= b.hi ? 1 : a.hi < b.lo ? 0 : -1;
+        break;
+    default:
+        break;
+    }
+    return result < 0 ? boolean() : Range::constant(result);
+}
+
+//-----------------------------------------------------------------------------
+// arithmetic - a op b for the operators that do not short circuit
+static Range arithmetic(Type type, const Range &a, const Range &b) {
+    switch (type) {
+    case ADD:
+    case SUB: {
+        Range r = type == ADD
+                      ? Range::interval(int64_t(a.lo) + b.lo,
+                                        int64_t(a.hi) + b.hi)
+                      : Range::interval(int64_t(a.lo) - b.hi,
+                                        int64_t(a.hi) - b.lo);
+        // the low bits known in both operands give the low bits of the
+        // result, even when it wraps around
+        uint32_t known = ~((a.zeros | a.ones) & (b.zeros | b.ones));
+        uint32_t low = known ? (1u << ctz(static_cast<int>(known))) - 1 : ~0u;
+        uint32_t v = type == ADD ? a.ones + b.ones : a.ones - b.ones;
+        r.zeros |= ~v & low;
+        r.ones |= v & low;
+        return r.normalize();
+    }
+    case MUL: {
+        int64_t p[] = {int64_t(a.lo) * b.lo, int64_t(a.lo) * b.hi,
+                       int64_t(a.hi) * b.lo, int64_t(a.hi) * b.hi};
+        Range r = Range::interval(*std::min_element(p, p + 4),
+                                  *std::max_element(p, p + 4));
+        // trailing zeros add up
+        int tz = ctz(static_cast<int>(~a.zeros)) + ctz(static_cast<int>(~b.zeros));
+        r.zeros |= tz >= 32 ? ~0u : (1u << tz) - 1;
+        return r.normalize();
+    }
+    case DIV:
+    case DIVM: {
+        // |a / b| <= |a| for every b != 0
+        int64_t m = magnitude(a);
+        return a.lo >= 0 && b.lo >= 0 ? Range::interval(0, a.hi)
+                                      : Range::interval(-m, m);
+    }
+    case MOD:
+    case MODM: {
+        // |a % b| < |b|, with the sign of a
+        int64_t m = std::min(magnitude(b) - 1, magnitude(a));
+        m = std::max<int64_t>(m, 0);
+        return a.lo >= 0 ? Range::interval(0, m) : Range::interval(-m, m);
+    }
+    case AND: {
+        Range r = Range::all();
+        if (a.lo >= 0 || b.lo >= 0) { // no larger than a non-negative side
+            r.lo = 0;
+            r.hi = std::min(a.lo >= 0 ? a.hi : INT32_MAX,
+                            b.lo >= 0 ? b.hi : INT32_MAX);
+        }
+        r.zeros = a.zeros | b.zeros;
+        r.ones = a.ones & b.ones;
+        return r.normalize();
+    }
+    case OR: {
+        Range r = Range::all();
+        r.zeros = a.zeros & b.zeros;
+        r.ones = a.ones | b.ones;
+        return r.normalize();
+    }
+    case XOR: {
+        Range r = Range::all();
+        r.zeros = (a.zeros & b.zeros) | (a.ones & b.ones);
+        r.ones = (a.zeros & b.ones) | (a.ones & b.zeros);
+        return r.normalize();
+    }
+    case SFTL: {
+        if (!b.is_constant() || !b.contains(b.lo) || b.lo < 0 || b.lo > 31) {
+            return Range::all();
+        }
+        int k = b.lo;
+        Range r = Range::interval(int64_t(a.lo) * (int64_t(1) << k),
+                                  int64_t(a.hi) * (int64_t(1) << k));
+        r.zeros |= (a.zeros << k) | ((1u << k) - 1);
+        r.ones |= a.ones << k;
+        return r.normalize();
+    }
+    case SFTR: {
+        if (b.lo < 0 || b.hi > 31) {
+            return Range::all();
+        }
+        // v >> s is monotonic in v, and in s for either sign of v
+        int c[] = {a.lo >> b.lo, a.lo >> b.hi, a.hi >> b.lo, a.hi >> b.hi};
+        return Range::interval(*std::min_element(c, c + 4),
+                               *std::max_element(c, c + 4));
+    }
+    default:
+        return compare(type, a, b);
+    }
+}
+
+//-----------------------------------------------------------------------------
+class RangeAnalyzer {
+  public:
+    RangeAnalyzer(const SymbolRange &symbol, std::unordered_set<int> written)
+        : symbol(symbol), written(std::move(written)) {}
+    Range run(ExprAST &ast);
+
+  private:
+    const SymbolRange &symbol;
+    std::unordered_set<int> written; // unknown whatever symbol says
+
+    Range variable(int id) {
+        return symbol && !written.count(id) ? symbol(id) : Range::all();
+    }
+    Range call(CallExprAST &node);
+};
+
+//-----------------------------------------------------------------------------
+Range RangeAnalyzer::call(CallExprAST &node) {
+    std::vector<Range> args;
+    for (auto &arg : node.args) {
+        args.push_back(run(*arg));
+    }
+    switch (node.type) {
+    case POPCNT:
+    case CLZ:
+    case CTZ:
+        return Range::interval(0, 32);
+    case BITS:
+        // zero extended field of hi - lo + 1 bits
+        if (args[1].is_constant() && args[2].is_constant() &&
+            bit_range(args[1].lo, args[2].lo) &&
+            args[1].lo - args[2].lo < 31) {
+            return Range::interval(0,
+                                   (int64_t(1) << (args[1].lo - args[2].lo + 1)) -
+                                       1);
+        }
+        return Range::all();
+    default:
+        return Range::all();
+    }
+}
+
+//-----------------------------------------------------------------------------
+Range RangeAnalyzer::run(ExprAST &ast) {
+    Type type = ast.type;
+    if (type == IMM) {
+        return Range::constant(static_cast<IntegerExprAST &>(ast).Val);
+    }
+    if (type == VAR) {
+        return variable(static_cast<VariableExprAST &>(ast).Id);
+    }
+    if (type == REG) {
+        auto &reg = static_cast<RegisterExprAST &>(ast);
+        return reg.Reg ? Range::all() : variable(reg.Id);
+    }
+    if (type == PLUS || type == MINUS || type == INV || type == NOT) {
+        Range a = run(*static_cast<UnaryExprAST &>(ast).rhs);
+        if (type == MINUS) {
+            return Range::interval(-int64_t(a.hi), -int64_t(a.lo));
+        }
+        if (type == INV) {
+            Range r{~a.hi, ~a.lo, a.ones, a.zeros};
+            return r.normalize();
+        }
+        if (type == NOT) {
+            return a.contains(0) ? a.is_constant() ? Range::constant(1)
+                                                   : boolean()
+                                 : Range::constant(0);
+        }
+        return a;
+    }
+    if (type == LAND || type == LOR) {
+        auto &node = static_cast<BinaryExprAST &>(ast);
+        Range a = run(*node.lhs);
+        Range b = run(*node.rhs);
+        bool a_true = !a.contains(0), a_false = a.is_constant() && !a.lo;
+        bool b_true = !b.contains(0), b_false = b.is_constant() && !b.lo;
+        if (type == LAND) {
+            return a_false || b_false ? Range::constant(0)
+                   : a_true && b_true ? Range::constant(1)
+                                      : boolean();
+        }
+        return a_true || b_true     ? Range::constant(1)
+               : a_false && b_false ? Range::constant(0)
+                                    : boolean();
+    }
+    if (BINOP_BIGIN < type && type < BINOP_END) {
+        auto &node = static_cast<BinaryExprAST &>(ast);
+        Range a = run(*node.lhs);
+        return arithmetic(type, a, run(*node.rhs));
+    }
+    if (type == QUESTION) {
+        auto &node = static_cast<ConditionalExprAST &>(ast);
+        Range c = run(*node.cond);
+        Range a = run(*node.lhs);
+        Range b = run(*node.rhs);
+        return !c.contains(0) ? a : c.is_constant() ? b : join(a, b);
+    }
+    if (CALL_BIGIN < type && type < CALL_END) {
+        return call(static_cast<CallExprAST &>(ast));
+    }
+    if (ASSIGN_BIGIN < type && type < ASSIGN_END) {
+        auto &node = static_cast<AssignExprAST &>(ast);
+        Range b = run(*node.rhs);
+        return type == ASSIGN ? b : Range::all();
+    }
+    throw expr_error("unknown operator");
+}
+
+//-----------------------------------------------------------------------------
+Range range(ExprAST &ast, const SymbolRange &symbol) {
+    auto refs = references(ast);
+    std::unordered_set<int> written(refs.writes.begin(), refs.writes.end());
+    return RangeAnalyzer(symbol, std::move(written)).run(ast);
+}
+
+//-----------------------------------------------------------------------------
+static bool fits(int64_t v) { return INT32_MIN <= v && v <= INT32_MAX; }
+
+bool may_fail(Type type, const Range &a, const Range &b) {
+    switch (type) {
+    case ADD:
+        return !fits(int64_t(a.lo) + b.lo) || !fits(int64_t(a.hi) + b.hi);
+    case SUB:
+        return !fits(int64_t(a.lo) - b.hi) || !fits(int64_t(a.hi) - b.lo);
+    case MUL: {
+        int64_t p[] = {int64_t(a.lo) * b.lo, int64_t(a.lo) * b.hi,
+                       int64_t(a.hi) * b.lo, int64_t(a.hi) * b.hi};
+        return !fits(*std::min_element(p, p + 4)) ||
+               !fits(*std::max_element(p, p + 4));
+    }
+    case MINUS:
+        return a.lo == INT32_MIN;
+    case SFTL:
+        // |v << s| grows with s
+        return b.lo < 0 || b.hi > 31 ||
+               !fits(int64_t(a.lo) * (int64_t(1) << b.hi)) ||
+               !fits(int64_t(a.hi) * (int64_t(1) << b.hi));
+    case SFTR:
+        return b.lo < 0 || b.hi > 31;
+    case DIV:
+    case DIVM:
+        return b.contains(0) || (a.lo == INT32_MIN && b.contains(-1));
+    case MOD:
+    case MODM:
+        return b.contains(0);
+    default:
+        return false;
+    }
+}
+
+} // namespace expr
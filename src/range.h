@@ -0,0 +1,56 @@
+#pragma once
+
+#include "expr.h"
+#include <functional>
+#include <stdint.h>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+// Range - what is known about the values of an expression:
+// lo <= v <= hi, the bits set in zeros are 0 and the bits set in ones are 1
+// in every value v. Arithmetic wraps around at 32 bits like evaluation does,
+// so a range that might wrap is widened to all values.
+struct Range {
+    int lo, hi;
+    uint32_t zeros, ones;
+
+    static Range all() { return Range{INT32_MIN, INT32_MAX, 0, 0}; }
+    static Range constant(int v) {
+        return Range{v, v, ~static_cast<uint32_t>(v), static_cast<uint32_t>(v)};
+    }
+    // [lo, hi] with the known bits that follow from it
+    static Range interval(int64_t lo, int64_t hi);
+
+    bool is_constant() const { return lo == hi; }
+    bool contains(int v) const { return lo <= v && v <= hi; }
+    // bits of the narrowest signed integer (8, 16 or 32) that holds every
+    // value
+    int width() const {
+        return lo >= INT8_MIN && hi <= INT8_MAX     ? 8
+               : lo >= INT16_MIN && hi <= INT16_MAX ? 16
+                                                    : 32;
+    }
+    // tighten each half (interval, known bits) by the other
+    Range &normalize();
+};
+
+// symbol(id) : range of a symbol, all() if symbol is null
+typedef std::function<Range(int id)> SymbolRange;
+
+//-----------------------------------------------------------------------------
+// range - values that ast may evaluate to, from literals, masks, shifts and
+// the ranges of the symbols. Symbols assigned in ast are taken as unknown,
+// as are bound registers. A node that may fail (division by zero, invalid
+// bit range) is analyzed for the values it gives when it does not.
+//   (r0 >> 8) & 0xFF        -> [0, 255]
+//   ((r0 >> 8) & 0xFF) < 256 -> [1, 1]
+Range range(ExprAST &ast, const SymbolRange &symbol = nullptr);
+
+//-----------------------------------------------------------------------------
+// may_fail - whether a type b (-a for MINUS) may fail under checked
+// evaluation for some operands in a and b: overflow of + - * << and unary -,
+// a shift amount outside [0, 31], or division by zero.
+bool may_fail(Type type, const Range &a, const Range &b);
+
+} // namespace expr
@@ -0,0 +1,384 @@
+#include "server.h"
+#include "cache.h"
+#include "format.h"
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+struct Server::Conn {
+    int fd;
+    std::string in;  // received bytes not yet collected
+    std::string out; // responses not yet sent
+    size_t sent;     // bytes of out already sent
+    uint32_t events; // epoll interest
+    bool eof;        // the peer shut down its side
+    bool dead;       // error : close without sending
+    bool ready;      // queued for the next batch
+};
+
+//-----------------------------------------------------------------------------
+// compile - cached program of src
+const Server::Entry &Server::compile(const std::string &src) {
+    std::string key = ProgramCache::normalize(src);
+    auto itr = cache.find(key);
+    if (itr != cache.end()) {
+        counts.hits++;
+        return itr->second;
+    }
+    counts.misses++;
+    if (cache.size() >= CACHE_MAX) {
+        cache.clear();
+    }
+    Entry entry;
+    auto parsed = try_parse(key);
+    if (!parsed) {
+        entry.error = parsed.error.message();
+    } else {
+        try {
+            auto prog = expr::compile(*parsed.ast);
+            prog->set_checked(checked);
+            entry.prog = std::move(prog);
+        } catch (const std::runtime_error &e) {
+            entry.error = e.what();
+        }
+    }
+    return cache.emplace(std::move(key), std::move(entry)).first->second;
+}
+
+//-----------------------------------------------------------------------------
+void Server::evaluate(const Request &req) {
+    counts.requests++;
+    std::string &out = req.conn->out;
+    const Entry &entry = compile(req.src);
+    if (entry.prog) {
+        symbols.begin(); // a failed request leaves no assignments behind
+        try {
+            char buf[DEC_MAX];
+            out.append(buf, format_dec(buf, entry.prog->eval(symbols)));
+            symbols.commit();
+            out += '\n';
+            return;
+        } catch (const std::runtime_error &e) {
+            symbols.abort();
+            out += "error: ";
+            out += e.what();
+            out += '\n';
+            return;
+        }
+    }
+    out += "error: ";
+    out += entry.error;
+    out += '\n';
+}
+
+#ifdef __linux__
+
+enum { MAX_EVENTS = 256 };
+
+//-----------------------------------------------------------------------------
+Server::Server(const std::string &path, SymbolTable &symbols, bool checked)
+    : path(path), symbols(symbols), checked(checked), listener(-1), epoll(-1),
+      wakeup(-1), counts{0, 0, 0, 0, 0} {
+    auto fail = [&](const std::string &what) {
+        std::string msg = what + " '" + path + "': " + strerror(errno);
+        if (listener >= 0) {
+            ::close(listener);
+        }
+        if (epoll >= 0) {
+            ::close(epoll);
+        }
+        if (wakeup >= 0) {
+            ::close(wakeup);
+        }
+        throw expr_error(msg);
+    };
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        fail("cannot listen on");
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    // replace a socket left by a previous server, but no other file
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ||
+        listen(listener, SOMAXCONN)) {
+        fail("cannot listen on");
+    }
+
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll < 0 || wakeup < 0) {
+        unlink(path.c_str());
+        fail("cannot serve");
+    }
+    for (int fd : {listener, wakeup}) {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+//-----------------------------------------------------------------------------
+Server::~Server() {
+    for (auto &itr : conns) {
+        ::close(itr.first);
+    }
+    ::close(listener);
+    ::close(epoll);
+    ::close(wakeup);
+    unlink(path.c_str());
+}
+
+//-----------------------------------------------------------------------------
+void Server::stop() {
+    uint64_t one = 1;
+    ssize_t n = write(wakeup, &one, sizeof(one)); // async-signal-safe
+    (void)n;
+}
+
+//-----------------------------------------------------------------------------
+// run - the event loop
+// 1. wait for events (without blocking while connections are ready)
+// 2. accept, send pending responses and read requests
+// 3. collect the complete requests of every ready connection into a batch,
+//    evaluate it in order and send the responses
+void Server::run() {
+    epoll_event events[MAX_EVENTS];
+    std::vector<int> ready;
+    for (;;) {
+        int n = epoll_wait(epoll, events, MAX_EVENTS,
+                           queued.empty() ? -1 : 0);
+        if (n < 0 && errno != EINTR) {
+            throw expr_error(std::string("epoll_wait: ") + strerror(errno));
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakeup) {
+                uint64_t count;
+                ssize_t r = read(wakeup, &count, sizeof(count));
+                (void)r;
+                return;
+            }
+            if (fd == listener) {
+                accept_all();
+                continue;
+            }
+            auto itr = conns.find(fd);
+            if (itr == conns.end()) {
+                continue;
+            }
+            Conn &conn = *itr->second;
+            if (events[i].events & EPOLLOUT) {
+                send(conn);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                receive(conn);
+            }
+        }
+
+        ready.swap(queued);
+        for (int fd : ready) {
+            auto itr = conns.find(fd);
+            if (itr != conns.end()) {
+                itr->second->ready = false;
+                collect(*itr->second);
+            }
+        }
+        if (!batch.empty()) {
+            counts.batches++;
+            for (auto &req : batch) {
+                evaluate(req);
+            }
+            batch.clear();
+        }
+        for (int fd : ready) {
+            auto itr = conns.find(fd);
+            if (itr == conns.end()) {
+                continue; // closed, or queued twice
+            }
+            Conn &conn = *itr->second;
+            send(conn);
+            if (conn.dead ||
+                (conn.eof && conn.in.empty() && conn.out.empty())) {
+                close(conn);
+            }
+        }
+        ready.clear();
+    }
+}
+
+//-----------------------------------------------------------------------------
+void Server::accept_all() {
+    for (;;) {
+        int fd = accept4(listener, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; // EAGAIN, or out of descriptors until a client leaves
+        }
+        std::unique_ptr<Conn> conn(new Conn{fd, {}, {}, 0, EPOLLIN, false,
+                                            false, false});
+        epoll_event ev;
+        ev.events = conn->events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev)) {
+            ::close(fd);
+            continue;
+        }
+        conns[fd] = std::move(conn);
+        counts.connections++;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// receive - read what the peer has sent, up to OUTPUT_MAX bytes pending
+void Server::receive(Conn &conn) {
+    char buf[1 << 16];
+    while (!conn.eof && !conn.dead && conn.in.size() < OUTPUT_MAX) {
+        ssize_t n = read(conn.fd, buf, sizeof(buf));
+        if (n > 0) {
+            conn.in.append(buf, static_cast<size_t>(n));
+        } else if (n == 0) {
+            conn.eof = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            conn.dead = true;
+        }
+    }
+    watch(conn);
+}
+
+//-----------------------------------------------------------------------------
+// collect - move the complete requests of conn to the batch. Nothing is
+// collected while too many responses are pending; the requests stay in the
+// input buffer until the peer reads.
+void Server::collect(Conn &conn) {
+    if (conn.dead || conn.out.size() - conn.sent >= OUTPUT_MAX) {
+        return;
+    }
+    const char *data = conn.in.data();
+    size_t len = conn.in.size();
+    size_t pos = 0;
+    auto add = [&](size_t end) {
+        size_t n = end - pos;
+        if (n && data[end - 1] == '\r') {
+            n--;
+        }
+        if (n) { // empty lines are ignored
+            batch.push_back(Request{&conn, std::string(data + pos, n)});
+        }
+    };
+    while (pos < len) {
+        auto eol = static_cast<const char *>(memchr(data + pos, '\n', len - pos));
+        if (!eol) {
+            break;
+        }
+        add(eol - data);
+        pos = eol - data + 1;
+    }
+    if (conn.eof && pos < len) { // last request without '\n'
+        add(len);
+        pos = len;
+    }
+    conn.in.erase(0, pos);
+    if (conn.in.size() > REQUEST_MAX) {
+        conn.dead = true;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// send - write pending responses without blocking
+void Server::send(Conn &conn) {
+    while (!conn.dead && conn.sent < conn.out.size()) {
+        ssize_t n = ::send(conn.fd, conn.out.data() + conn.sent,
+                           conn.out.size() - conn.sent, MSG_NOSIGNAL);
+        if (n >= 0) {
+            conn.sent += static_cast<size_t>(n);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            conn.dead = true;
+        }
+    }
+    if (conn.sent == conn.out.size()) {
+        conn.out.clear();
+        conn.sent = 0;
+    }
+    watch(conn);
+}
+
+//-----------------------------------------------------------------------------
+// watch - update the epoll interest of conn, and queue it for the next batch
+// if it holds requests (e.g. left while it was blocked) or is to be closed
+void Server::watch(Conn &conn) {
+    size_t pending = conn.out.size() - conn.sent;
+    uint32_t events = 0;
+    if (pending) {
+        events |= EPOLLOUT;
+    }
+    if (pending < OUTPUT_MAX && !conn.eof && conn.in.size() < OUTPUT_MAX) {
+        events |= EPOLLIN;
+    }
+    if (!conn.dead && events != conn.events) {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.fd = conn.fd;
+        epoll_ctl(epoll, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.events = events;
+    }
+
+    bool requests = pending < OUTPUT_MAX && !conn.in.empty() &&
+                    (conn.eof || memchr(conn.in.data(), '\n', conn.in.size()));
+    bool closing = conn.dead || (conn.eof && !pending);
+    if (!conn.ready && (requests || closing)) {
+        conn.ready = true;
+        queued.push_back(conn.fd);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void Server::close(Conn &conn) {
+    int fd = conn.fd;
+    epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    conns.erase(fd); // conn is gone
+}
+
+#else // !__linux__
+
+Server::Server(const std::string &path, SymbolTable &symbols, bool checked)
+    : path(path), symbols(symbols), checked(checked), listener(-1), epoll(-1),
+      wakeup(-1), counts{0, 0, 0, 0, 0} {
+    throw expr_error("the server is not supported on this platform");
+}
+Server::~Server() {}
+void Server::run() {}
+void Server::stop() {}
+
+#endif
+
+} // namespace expr
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "program.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace expr {
+
+//=============================================================================
+// Server - evaluation server on a Unix domain socket (Linux, epoll).
+//
+// protocol
+//   A client sends newline-delimited expressions and may pipeline any number
+//   of them. Each request gets exactly one response line, in request order:
+//     "<value>"           decimal result
+//     "error: <message>"  syntax or evaluation error
+//   Empty lines are ignored. Requests longer than REQUEST_MAX close the
+//   connection.
+//
+// batching
+//   Every wakeup of the event loop reads all ready connections and collects
+//   their complete requests into one batch. The batch is evaluated and the
+//   responses of each connection are sent with a single write.
+//
+// consistency
+//   All requests are evaluated one at a time on the event loop thread
+//   against one symbol table. The result is a single total order of
+//   requests (arrival order within a batch, batches in order) that keeps
+//   the order of each connection, and every request sees the effects of all
+//   requests before it: an assignment is visible to every request answered
+//   after its own response. A request is atomic: one that fails (e.g.
+//   "(a = 5) + 1 / 0") undoes its assignments, so no other request sees
+//   them. There are no multi-request transactions.
+//
+// Compiled programs are cached by normalized source (up to CACHE_MAX
+// entries), so a repeated expression is neither lexed nor parsed again.
+class Server {
+  public:
+    enum {
+        REQUEST_MAX = 1 << 16, // bytes per request line
+        OUTPUT_MAX = 1 << 20,  // pending response bytes before a connection
+                               // is no longer read
+        CACHE_MAX = 1 << 16,   // compiled programs
+    };
+
+    struct Stats {
+        size_t connections; // accepted
+        size_t requests;
+        size_t batches;
+        size_t hits; // compiled program found in the cache
+        size_t misses;
+    };
+
+    // listen on path (an existing socket file is replaced). checked selects
+    // checked arithmetic (see arith.h) for every request.
+    // throws expr_error if the socket cannot be created.
+    Server(const std::string &path, SymbolTable &symbols,
+           bool checked = false);
+    ~Server();
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    // serve until stop() is called
+    void run();
+    // make run() return; may be called from another thread or a signal
+    // handler
+    void stop();
+
+    const Stats &stats() const { return counts; }
+
+  private:
+    struct Conn;
+    struct Request {
+        Conn *conn;
+        std::string src;
+    };
+    struct Entry {
+        std::shared_ptr<const Program> prog; // nullptr : error
+        std::string error;
+    };
+
+    std::string path;
+    SymbolTable &symbols;
+    bool checked;
+    int listener;
+    int epoll;
+    int wakeup; // eventfd signalled by stop()
+    std::unordered_map<int, std::unique_ptr<Conn>> conns;
+    std::unordered_map<std::string, Entry> cache;
+    std::vector<Request> batch;
+    std::vector<int> queued; // connections to collect from in the next batch
+    Stats counts;
+
+    void accept_all();
+    void receive(Conn &conn);
+    void collect(Conn &conn);
+    void evaluate(const Request &req);
+    void send(Conn &conn);
+    void watch(Conn &conn);
+    void close(Conn &conn);
+    const Entry &compile(const std::string &src);
+};
+
+} // namespace expr
@@ -0,0 +1,89 @@
+#include "session.h"
+#include "expr.h"
+#include "mapped_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace expr {
+
+static const char session_magic[8] = {'C', 'R', 'E', 'P', 'L', 'S', 'E', 'S'};
+
+//-----------------------------------------------------------------------------
+void save_session(const std::string &path, const SymbolTable &symbols) {
+    auto entries = symbols.entries();
+    std::vector<SessionEntry> table;
+    std::string names;
+    table.reserve(entries.size());
+    for (auto &entry : entries) {
+        const std::string &name = interner().name(entry.first);
+        table.push_back(SessionEntry{static_cast<uint32_t>(names.size()),
+                                     static_cast<uint32_t>(name.size()),
+                                     entry.second});
+        names += name;
+    }
+
+    SessionHeader header;
+    memcpy(header.magic, session_magic, sizeof(header.magic));
+    header.version = SESSION_VERSION;
+    header.count = static_cast<uint32_t>(table.size());
+    header.names_size = names.size();
+
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        throw expr_error("cannot open '" + path + "'");
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(table.data(), sizeof(SessionEntry), table.size(), fp) ==
+                  table.size() &&
+              fwrite(names.data(), 1, names.size(), fp) == names.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        throw expr_error("cannot write '" + path + "'");
+    }
+}
+
+//-----------------------------------------------------------------------------
+size_t load_session(const std::string &path, SymbolTable &symbols) {
+    MappedFile file(path);
+    const char *base = file.data();
+    size_t size = file.size();
+
+    SessionHeader header;
+    if (size < sizeof(header)) {
+        throw expr_error("invalid session file '" + path + "'");
+    }
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, session_magic, sizeof(header.magic)) != 0) {
+        throw expr_error("invalid session file '" + path + "'");
+    }
+    if (header.version != SESSION_VERSION) {
+        throw expr_error("unsupported session version '" + path + "'");
+    }
+    size_t table_size = sizeof(SessionEntry) * header.count;
+    if (size - sizeof(header) < table_size ||
+        size - sizeof(header) - table_size != header.names_size) {
+        throw expr_error("invalid session file '" + path + "'");
+    }
+
+    // the entry table is 4-byte aligned in the mapping and used in place
+    auto table = reinterpret_cast<const SessionEntry *>(base + sizeof(header));
+    const char *names = base + sizeof(header) + table_size;
+    for (uint32_t i = 0; i < header.count; i++) {
+        if (table[i].name_offset > header.names_size ||
+            table[i].name_len > header.names_size - table[i].name_offset) {
+            throw expr_error("invalid session file '" + path + "'");
+        }
+    }
+
+    interner().reserve(interner().size() + header.count);
+    symbols.reserve(symbols.size() + header.count);
+    std::string name;
+    for (uint32_t i = 0; i < header.count; i++) {
+        name.assign(names + table[i].name_offset, table[i].name_len);
+        symbols.ref(interner().intern(name)) = table[i].value;
+    }
+    return header.count;
+}
+
+} // namespace expr
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "symbol.h"
+#include <stdint.h>
+#include <string>
+
+namespace expr {
+
+//=============================================================================
+// session file
+// Binary snapshot of a symbol table, in native byte order.
+//   SessionHeader
+//   SessionEntry[count]  (insertion order of the table)
+//   name bytes           (names_size bytes, not '\0' terminated)
+// Loading maps the file and reads names and values in place; nothing is
+// lexed or parsed.
+
+enum { SESSION_VERSION = 1 };
+
+struct SessionHeader {
+    char magic[8];       // "CREPLSES"
+    uint32_t version;    // SESSION_VERSION
+    uint32_t count;      // number of entries
+    uint64_t names_size; // size of the name area
+};
+
+struct SessionEntry {
+    uint32_t name_offset; // offset in the name area
+    uint32_t name_len;
+    int32_t value;
+};
+
+//-----------------------------------------------------------------------------
+// save symbols to path (expr_error on failure)
+void save_session(const std::string &path, const SymbolTable &symbols);
+
+//-----------------------------------------------------------------------------
+// load path into symbols, overwriting symbols of the same name.
+// returns the number of symbols loaded (expr_error on failure).
+size_t load_session(const std::string &path, SymbolTable &symbols);
+
+} // namespace expr
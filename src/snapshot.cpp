@@ -0,0 +1,295 @@
+#include "snapshot.h"
+#include "bitops.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace expr {
+
+//=============================================================================
+// SymbolMap
+
+struct SymbolMap::Node {
+    uint32_t bitmap = 0; // populated positions
+    uint32_t leaves = 0; // positions holding a value, the others a child
+    struct Entry {
+        int id;
+        int value;
+        std::shared_ptr<Node> child;
+    };
+    std::vector<Entry> entries; // by rank of the position in bitmap
+
+    size_t rank(uint32_t bit) const { return popcnt(bitmap & (bit - 1)); }
+};
+
+static inline uint32_t position(int id, unsigned shift) {
+    return 1u << ((static_cast<uint32_t>(id) >> shift) & 31);
+}
+
+// unique - node p for writing: copied if another map shares it
+static SymbolMap::Node &unique(std::shared_ptr<SymbolMap::Node> &p);
+
+//-----------------------------------------------------------------------------
+static const int *find(const SymbolMap::Node *node, unsigned shift, int id) {
+    for (; node; shift += 5) {
+        uint32_t bit = position(id, shift);
+        if (!(node->bitmap & bit)) {
+            return nullptr;
+        }
+        auto &e = node->entries[node->rank(bit)];
+        if (node->leaves & bit) {
+            return e.id == id ? &e.value : nullptr;
+        }
+        node = e.child.get();
+    }
+    return nullptr;
+}
+
+const int *SymbolMap::find(int id) const {
+    return expr::find(root.get(), 0, id);
+}
+
+static SymbolMap::Node &unique(std::shared_ptr<SymbolMap::Node> &p) {
+    if (!p) {
+        p = std::make_shared<SymbolMap::Node>();
+    } else if (p.use_count() > 1) {
+        p = std::make_shared<SymbolMap::Node>(*p);
+    }
+    return *p;
+}
+
+//-----------------------------------------------------------------------------
+bool SymbolMap::assign(int id, int value) {
+    const int *v = find(id);
+    if (v && *v == value) {
+        return false; // keep the nodes shared
+    }
+    std::shared_ptr<Node> *p = &root;
+    for (unsigned shift = 0;; shift += 5) {
+        Node &node = unique(*p);
+        uint32_t bit = position(id, shift);
+        size_t k = node.rank(bit);
+        if (!(node.bitmap & bit)) {
+            node.entries.insert(node.entries.begin() + k,
+                                Node::Entry{id, value, nullptr});
+            node.bitmap |= bit;
+            node.leaves |= bit;
+            count++;
+            return true;
+        }
+        auto &e = node.entries[k];
+        if (node.leaves & bit) {
+            if (e.id == id) {
+                e.value = value;
+                return true;
+            }
+            // another id with the same prefix: push it one level down
+            auto child = std::make_shared<Node>();
+            child->bitmap = child->leaves = position(e.id, shift + 5);
+            child->entries.push_back(Node::Entry{e.id, e.value, nullptr});
+            e.child = child;
+            node.leaves &= ~bit;
+        }
+        p = &e.child;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// remove - a child left with a single value is folded into its parent, so
+// equal maps have equal shapes
+static void remove(std::shared_ptr<SymbolMap::Node> &p, unsigned shift,
+                   int id) {
+    auto &node = unique(p);
+    uint32_t bit = position(id, shift);
+    size_t k = node.rank(bit);
+    if (!(node.leaves & bit)) {
+        auto &e = node.entries[k];
+        remove(e.child, shift + 5, id);
+        if (e.child) {
+            auto &c = *e.child;
+            if (c.entries.size() == 1 && c.leaves == c.bitmap) {
+                e = SymbolMap::Node::Entry{c.entries[0].id, c.entries[0].value,
+                                           nullptr};
+                node.leaves |= bit;
+            }
+            return;
+        }
+    }
+    node.entries.erase(node.entries.begin() + k);
+    node.bitmap &= ~bit;
+    node.leaves &= ~bit;
+    if (node.entries.empty()) {
+        p.reset();
+    }
+}
+
+bool SymbolMap::remove(int id) {
+    if (!find(id)) {
+        return false;
+    }
+    expr::remove(root, 0, id);
+    count--;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+static void for_each(const SymbolMap::Node *node,
+                     const std::function<void(int, int)> &fn) {
+    if (!node) {
+        return;
+    }
+    for (size_t k = 0, bits = node->bitmap; bits; bits &= bits - 1, k++) {
+        auto &e = node->entries[k];
+        if (node->leaves & (bits & (0 - bits))) {
+            fn(e.id, e.value);
+        } else {
+            for_each(e.child.get(), fn);
+        }
+    }
+}
+
+void SymbolMap::for_each(const std::function<void(int, int)> &fn) const {
+    expr::for_each(root.get(), fn);
+}
+
+//-----------------------------------------------------------------------------
+// diff of one position: each side is absent, a value or a subtree
+static void diff(const SymbolMap::Node *a, const SymbolMap::Node *b,
+                 unsigned shift, const SymbolMap::DiffFn &fn);
+
+static void diff_entry(const SymbolMap::Node::Entry *a, bool a_leaf,
+                       const SymbolMap::Node::Entry *b, bool b_leaf,
+                       unsigned shift, const SymbolMap::DiffFn &fn) {
+    if (a && b && !a_leaf && !b_leaf) {
+        diff(a->child.get(), b->child.get(), shift + 5, fn);
+    } else if (a && b && a_leaf && b_leaf) {
+        if (a->id != b->id) {
+            fn(a->id, &a->value, nullptr);
+            fn(b->id, nullptr, &b->value);
+        } else if (a->value != b->value) {
+            fn(a->id, &a->value, &b->value);
+        }
+    } else if (a && b) { // a value against a subtree
+        auto leaf = a_leaf ? a : b;
+        auto tree = a_leaf ? b->child.get() : a->child.get();
+        bool found = false;
+        for_each(tree, [&](int id, int value) {
+            if (id != leaf->id) {
+                fn(id, a_leaf ? nullptr : &value, a_leaf ? &value : nullptr);
+            } else {
+                found = true;
+                if (value != leaf->value) {
+                    fn(id, a_leaf ? &leaf->value : &value,
+                       a_leaf ? &value : &leaf->value);
+                }
+            }
+        });
+        if (!found) {
+            fn(leaf->id, a_leaf ? &leaf->value : nullptr,
+               a_leaf ? nullptr : &leaf->value);
+        }
+    } else if (a || b) { // present on one side only
+        auto e = a ? a : b;
+        auto report = [&](int id, const int &value) {
+            fn(id, a ? &value : nullptr, a ? nullptr : &value);
+        };
+        if (a ? a_leaf : b_leaf) {
+            report(e->id, e->value);
+        } else {
+            for_each(e->child.get(), report);
+        }
+    }
+}
+
+static void diff(const SymbolMap::Node *a, const SymbolMap::Node *b,
+                 unsigned shift, const SymbolMap::DiffFn &fn) {
+    if (a == b) {
+        return; // shared
+    }
+    uint32_t bits = (a ? a->bitmap : 0) | (b ? b->bitmap : 0);
+    for (; bits; bits &= bits - 1) {
+        uint32_t bit = bits & (0 - bits);
+        const SymbolMap::Node::Entry *ea = nullptr;
+        const SymbolMap::Node::Entry *eb = nullptr;
+        if (a && (a->bitmap & bit)) {
+            ea = &a->entries[a->rank(bit)];
+        }
+        if (b && (b->bitmap & bit)) {
+            eb = &b->entries[b->rank(bit)];
+        }
+        diff_entry(ea, a && (a->leaves & bit), eb, b && (b->leaves & bit),
+                   shift, fn);
+    }
+}
+
+void SymbolMap::diff(const SymbolMap &a, const SymbolMap &b,
+                     const DiffFn &fn) {
+    expr::diff(a.root.get(), b.root.get(), 0, fn);
+}
+
+//=============================================================================
+// History
+
+//-----------------------------------------------------------------------------
+// sync - fold the changes of the table into current
+void History::sync() {
+    for (int id : symbols.changes()) {
+        if (const int *v = symbols.find(id)) {
+            current.assign(id, *v);
+        } else {
+            current.remove(id);
+        }
+    }
+    symbols.clear_changes();
+}
+
+//-----------------------------------------------------------------------------
+size_t History::snapshot() {
+    sync();
+    snapshots.push_back(current);
+    return snapshots.size();
+}
+
+//-----------------------------------------------------------------------------
+size_t History::rollback(size_t n) {
+    if (n < 1 || n > snapshots.size()) {
+        throw std::out_of_range("no such snapshot");
+    }
+    sync();
+    size_t changed = 0;
+    SymbolMap::diff(current, snapshots[n - 1],
+                    [&](int id, const int *, const int *after) {
+                        if (after) {
+                            symbols.ref(id) = *after;
+                        } else {
+                            symbols.erase(id);
+                        }
+                        changed++;
+                    });
+    symbols.clear_changes();
+    current = snapshots[n - 1];
+    snapshots.resize(n);
+    return changed;
+}
+
+//-----------------------------------------------------------------------------
+std::vector<History::Change> History::diff(size_t n) {
+    if (n < 1 || n > snapshots.size()) {
+        throw std::out_of_range("no such snapshot");
+    }
+    sync();
+    std::vector<Change> result;
+    SymbolMap::diff(snapshots[n - 1], current,
+                    [&](int id, const int *before, const int *after) {
+                        result.push_back(Change{id, before != nullptr,
+                                                before ? *before : 0,
+                                                after != nullptr,
+                                                after ? *after : 0});
+                    });
+    std::sort(result.begin(), result.end(),
+              [](const Change &x, const Change &y) {
+                  return interner().name(x.id) < interner().name(y.id);
+              });
+    return result;
+}
+
+} // namespace expr
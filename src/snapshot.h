@@ -0,0 +1,82 @@
+#pragma once
+
+#include "symbol.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace expr {
+
+//=============================================================================
+// enum/struct/class
+
+//-----------------------------------------------------------------------------
+// SymbolMap - persistent map from interned id to value (hash array mapped
+// trie). Each level consumes 5 bits of the id, lowest first; a node keeps a
+// 32-bit bitmap of its populated positions and only those entries.
+// Copying a map is O(1) and shares every node. assign() and remove() copy
+// the nodes on the path to the id only when they are shared with another
+// map, so a map that is being updated stays cheap while its snapshots keep
+// their contents.
+class SymbolMap {
+  public:
+    SymbolMap() : count(0) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    // value of id (nullptr when absent)
+    const int *find(int id) const;
+    // set/remove id; false if the map did not change
+    bool assign(int id, int value);
+    bool remove(int id);
+    void for_each(const std::function<void(int, int)> &fn) const;
+
+    // call fn(id, before, after) for every id whose value differs between
+    // a (before) and b (after), nullptr when absent. Subtrees shared by the
+    // two maps are skipped, so the cost follows the number of differences.
+    typedef std::function<void(int, const int *, const int *)> DiffFn;
+    static void diff(const SymbolMap &a, const SymbolMap &b, const DiffFn &fn);
+
+    struct Node; // defined in snapshot.cpp
+
+  private:
+    std::shared_ptr<Node> root;
+    size_t count;
+};
+
+//-----------------------------------------------------------------------------
+// History - snapshots of a symbol table.
+// The current contents are mirrored in a SymbolMap that is brought up to
+// date from SymbolTable::changes() when needed, so a snapshot costs O(1)
+// plus the symbols changed since the previous one.
+class History {
+  public:
+    explicit History(SymbolTable &symbols) : symbols(symbols) {}
+
+    struct Change {
+        int id;
+        bool had; // present in the snapshot
+        int before;
+        bool has; // present now
+        int after;
+    };
+
+    // take a snapshot, returns its number (from 1)
+    size_t snapshot();
+    size_t size() const { return snapshots.size(); }
+    // restore snapshot n (1 <= n <= size()) and drop the later ones.
+    // returns the number of symbols changed.
+    size_t rollback(size_t n);
+    // changes from snapshot n to the current table, sorted by name
+    std::vector<Change> diff(size_t n);
+
+  private:
+    SymbolTable &symbols;
+    SymbolMap current;
+    std::vector<SymbolMap> snapshots;
+
+    void sync();
+};
+
+} // namespace expr
@@ -0,0 +1,133 @@
+#include "stats.h"
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace expr {
+namespace stats {
+
+bool enabled = false;
+
+static thread_local Counters counters;
+
+//-----------------------------------------------------------------------------
+Counters &current() { return counters; }
+
+void reset() { memset(&counters, 0, sizeof(counters)); }
+
+//-----------------------------------------------------------------------------
+void Histogram::add(uint64_t val) {
+    int bucket = 0;
+    for (uint64_t v = val; v; v >>= 1) {
+        bucket++;
+    }
+    buckets[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+    count++;
+    sum += val;
+    max = val > max ? val : max;
+}
+
+//-----------------------------------------------------------------------------
+// cumulative
+static struct {
+    Histogram ns[PHASE_MAX];
+    Histogram tokens;
+    Histogram nodes;
+    Histogram allocs;
+    Histogram alloc_bytes;
+} total;
+
+void record() {
+    for (int i = 0; i < PHASE_MAX; i++) {
+        total.ns[i].add(counters.ns[i]);
+    }
+    total.tokens.add(counters.tokens);
+    total.nodes.add(counters.nodes);
+    total.allocs.add(counters.allocs);
+    total.alloc_bytes.add(counters.alloc_bytes);
+}
+
+void clear() { memset(&total, 0, sizeof(total)); }
+
+//-----------------------------------------------------------------------------
+std::string format(const Counters &c) {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "lex %llu ns, parse %llu ns, eval %llu ns, %llu tokens, "
+             "%llu nodes, %llu allocs (%llu bytes)",
+             (unsigned long long)c.ns[LEX], (unsigned long long)c.ns[PARSE],
+             (unsigned long long)c.ns[EVAL], (unsigned long long)c.tokens,
+             (unsigned long long)c.nodes, (unsigned long long)c.allocs,
+             (unsigned long long)c.alloc_bytes);
+    return buf;
+}
+
+//-----------------------------------------------------------------------------
+// histogram as
+//   name: count N, mean M, max X
+//     [lo, hi)  count  ####
+static void report(std::string &s, const char *name, const Histogram &h) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s: count %llu, mean %llu, max %llu\n", name,
+             (unsigned long long)h.count,
+             (unsigned long long)(h.count ? h.sum / h.count : 0),
+             (unsigned long long)h.max);
+    s += buf;
+
+    uint64_t peak = 0;
+    for (auto n : h.buckets) {
+        peak = n > peak ? n : peak;
+    }
+    for (int i = 0; i < Histogram::BUCKETS; i++) {
+        if (!h.buckets[i]) {
+            continue;
+        }
+        unsigned long long lo = i ? 1ull << (i - 1) : 0;
+        unsigned long long hi = 1ull << i;
+        int bar = static_cast<int>((h.buckets[i] * 40 + peak - 1) / peak);
+        snprintf(buf, sizeof(buf), "  [%llu, %llu) %llu ", lo, hi,
+                 (unsigned long long)h.buckets[i]);
+        s += buf;
+        s.append(bar, '#');
+        s += '\n';
+    }
+}
+
+std::string report() {
+    static const char *phases[PHASE_MAX] = {"lex ns", "parse ns", "eval ns"};
+    std::string s;
+    for (int i = 0; i < PHASE_MAX; i++) {
+        report(s, phases[i], total.ns[i]);
+    }
+    report(s, "tokens", total.tokens);
+    report(s, "nodes", total.nodes);
+    report(s, "allocs", total.allocs);
+    report(s, "alloc bytes", total.alloc_bytes);
+    return s;
+}
+
+} // namespace stats
+} // namespace expr
+
+#if EXPR_STATS
+//-----------------------------------------------------------------------------
+// allocation hooks
+// The replaceable global operator new counts allocations of the calling
+// thread while stats are enabled. operator new[] and delete[] forward to
+// these.
+void *operator new(size_t size) {
+    if (expr::stats::enabled) {
+        expr::stats::counters.allocs++;
+        expr::stats::counters.alloc_bytes += size;
+    }
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <stdint.h>
+#include <string>
+
+//=============================================================================
+// instrumentation
+// Per-phase timings, token / node counts and heap allocations of the
+// expressions handled by the calling thread.
+// Build with -DEXPR_STATS=0 to remove every hook; otherwise a disabled hook
+// costs one test of stats::enabled.
+#ifndef EXPR_STATS
+#define EXPR_STATS 1
+#endif
+
+namespace expr {
+namespace stats {
+
+enum Phase {
+    LEX,
+    PARSE,
+    EVAL,
+    PHASE_MAX,
+};
+
+//-----------------------------------------------------------------------------
+// Counters - what happened on this thread since the last reset()
+struct Counters {
+    uint64_t ns[PHASE_MAX];
+    uint64_t tokens;
+    uint64_t nodes;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+};
+
+//-----------------------------------------------------------------------------
+// Histogram - power of two buckets; bucket i counts values in [2^(i-1), 2^i)
+struct Histogram {
+    enum { BUCKETS = 64 };
+    uint64_t buckets[BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+
+    void add(uint64_t val);
+};
+
+// collect counters (set it while no expression is being evaluated)
+extern bool enabled;
+
+Counters &current();
+void reset();
+
+// add current() to the cumulative histograms
+void record();
+// cumulative report of the recorded lines
+std::string report();
+void clear();
+
+// one line summary of counters
+std::string format(const Counters &counters);
+
+//-----------------------------------------------------------------------------
+// Timer - add the lifetime of the object to a phase
+class Timer {
+  public:
+    explicit Timer(Phase phase) : phase(phase), active(enabled) {
+        if (active) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    ~Timer() {
+        if (active) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start);
+            current().ns[phase] += ns.count();
+        }
+    }
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+  private:
+    Phase phase;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // namespace stats
+} // namespace expr
+
+//-----------------------------------------------------------------------------
+// hooks
+//   EXPR_STATS_PHASE(phase)   time the rest of the enclosing scope
+//   EXPR_STATS_ADD(field, n)  add n to a counter (n is evaluated only when
+//                             enabled)
+#if EXPR_STATS
+#define EXPR_STATS_PHASE(phase) expr::stats::Timer expr_stats_timer_(phase)
+#define EXPR_STATS_ADD(field, n)                                               \
+    do {                                                                       \
+        if (expr::stats::enabled) {                                            \
+            expr::stats::current().field += (n);                               \
+        }                                                                      \
+    } while (0)
+#else
+#define EXPR_STATS_PHASE(phase) ((void)0)
+#define EXPR_STATS_ADD(field, n) ((void)0)
+#endif
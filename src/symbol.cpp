@@ -0,0 +1,252 @@
+#include "symbol.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace expr {
+
+//=============================================================================
+// Interner
+
+//-----------------------------------------------------------------------------
+int Interner::intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto itr = ids.find(name);
+    if (itr != ids.end()) {
+        return itr->second;
+    }
+    size_t id = count;
+    if (id >= static_cast<size_t>(CHUNK_SIZE) * MAX_CHUNKS) {
+        throw std::length_error("too many symbols");
+    }
+    auto &chunk = chunks[id >> CHUNK_BITS];
+    if (!chunk) {
+        chunk.reset(new std::string[CHUNK_SIZE]);
+    }
+    chunk[id & (CHUNK_SIZE - 1)] = name;
+    ids.emplace(name, static_cast<int>(id));
+    count = id + 1; // publish
+    return static_cast<int>(id);
+}
+
+//-----------------------------------------------------------------------------
+int Interner::find(const std::string &name) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto itr = ids.find(name);
+    return itr != ids.end() ? itr->second : -1;
+}
+
+//-----------------------------------------------------------------------------
+const std::string &Interner::name(int id) const {
+    if (id < 0 || static_cast<size_t>(id) >= count) {
+        throw std::out_of_range("invalid symbol id");
+    }
+    return chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+}
+
+//-----------------------------------------------------------------------------
+void Interner::reserve(size_t n) {
+    std::lock_guard<std::mutex> lock(mtx);
+    ids.reserve(n);
+}
+
+//-----------------------------------------------------------------------------
+Interner &interner() {
+    static Interner instance;
+    return instance;
+}
+
+//=============================================================================
+// SymbolTable
+
+//-----------------------------------------------------------------------------
+int &SymbolTable::ref(int id) {
+    touch(id);
+    if (int *v = find(id)) {
+        if (journal) {
+            undo.push_back(Undo{id, *v, true});
+        }
+        return *v;
+    }
+    return insert(id);
+}
+
+const int &SymbolTable::cref(int id) {
+    if (int *v = find(id)) {
+        return *v;
+    }
+    touch(id);
+    return insert(id);
+}
+
+int &SymbolTable::insert(int id) {
+    if (journal) {
+        undo.push_back(Undo{id, 0, false});
+    }
+    // keep load factor <= 1/2
+    if ((values.size() + 1) * 2 > slots.size()) {
+        grow();
+    }
+    size_t i = hash(id);
+    while (slots[i].id >= 0) {
+        i = (i + 1) & (slots.size() - 1);
+    }
+    slots[i] = Slot{id, static_cast<int>(values.size())};
+    values.push_back(0);
+    ids.push_back(id);
+    return values.back();
+}
+
+//-----------------------------------------------------------------------------
+int *SymbolTable::find(int id) {
+    const SymbolTable *self = this;
+    return const_cast<int *>(self->find(id));
+}
+
+const int *SymbolTable::find(int id) const {
+    if (id < 0) {
+        return nullptr;
+    }
+    for (size_t i = hash(id);; i = (i + 1) & (slots.size() - 1)) {
+        if (slots[i].id == id) {
+            return &values[static_cast<size_t>(slots[i].index)];
+        }
+        if (slots[i].id < 0) {
+            return nullptr;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+void SymbolTable::clear() {
+    for (int id : ids) {
+        touch(id);
+    }
+    slots.assign(16, Slot{-1, 0});
+    shift = 28;
+    values.clear();
+    ids.clear();
+    removals++;
+}
+
+//-----------------------------------------------------------------------------
+// erase - backward-shift deletion: later slots of the probe run move into
+// the hole unless that would put them before their home slot. The last
+// symbol then takes the index of the erased one.
+bool SymbolTable::erase(int id) {
+    size_t mask = slots.size() - 1;
+    size_t i = hash(id);
+    while (slots[i].id != id) {
+        if (slots[i].id < 0) {
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+    size_t index = static_cast<size_t>(slots[i].index);
+    for (size_t j = (i + 1) & mask; slots[j].id >= 0; j = (j + 1) & mask) {
+        size_t home = hash(slots[j].id);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i] = Slot{-1, 0};
+
+    size_t last = values.size() - 1;
+    if (index != last) {
+        values[index] = values[last];
+        ids[index] = ids[last];
+        for (size_t k = hash(ids[index]);; k = (k + 1) & mask) {
+            if (slots[k].id == ids[index]) {
+                slots[k].index = static_cast<int>(index);
+                break;
+            }
+        }
+    }
+    values.pop_back();
+    ids.pop_back();
+    removals++;
+    touch(id);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+void SymbolTable::clear_changes() {
+    for (int id : changed) {
+        flagged[id] = 0;
+    }
+    changed.clear();
+}
+
+//-----------------------------------------------------------------------------
+void SymbolTable::begin() {
+    undo.clear();
+    journal = true;
+}
+
+void SymbolTable::commit() {
+    undo.clear();
+    journal = false;
+}
+
+// abort - undo in reverse order, so the oldest state of each symbol wins
+void SymbolTable::abort() {
+    journal = false;
+    for (size_t i = undo.size(); i-- > 0;) {
+        const Undo &u = undo[i];
+        if (u.existed) {
+            ref(u.id) = u.value;
+        } else {
+            erase(u.id);
+        }
+    }
+    undo.clear();
+}
+
+//-----------------------------------------------------------------------------
+void SymbolTable::reserve(size_t n) {
+    while (n * 2 > slots.size()) {
+        grow();
+    }
+}
+
+//-----------------------------------------------------------------------------
+// grow - double the slot array and reinsert every symbol.
+// values are not moved, so outstanding references stay valid.
+void SymbolTable::grow() {
+    std::vector<Slot> old(slots.size() * 2, Slot{-1, 0});
+    old.swap(slots);
+    shift--;
+    for (auto &slot : old) {
+        if (slot.id < 0) {
+            continue;
+        }
+        size_t i = hash(slot.id);
+        while (slots[i].id >= 0) {
+            i = (i + 1) & (slots.size() - 1);
+        }
+        slots[i] = slot;
+    }
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::pair<int, int>> SymbolTable::entries() const {
+    std::vector<std::pair<int, int>> result;
+    result.reserve(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        result.emplace_back(ids[i], values[i]);
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::pair<std::string, int>> SymbolTable::sorted() const {
+    std::vector<std::pair<std::string, int>> result;
+    result.reserve(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        result.emplace_back(interner().name(ids[i]), values[i]);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+} // namespace expr
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace expr {
+
+//=============================================================================
+// enum/struct/class
+
+//-----------------------------------------------------------------------------
+// Interner - maps identifier strings to dense integer ids.
+// 識別子文字列を0から始まる連番のidに変換する。
+// Ids and the strings they refer to are never freed, so a reference returned
+// by name() stays valid for the lifetime of the process.
+// intern() and find() take a lock; name() does not, since names are stored
+// in fixed chunks that never move once an id has been handed out.
+class Interner {
+  public:
+    int intern(const std::string &name);
+    int find(const std::string &name) const; // -1 if not interned
+    const std::string &name(int id) const;
+    size_t size() const { return count; }
+    void reserve(size_t n); // room for n names without rehashing
+
+  private:
+    enum {
+        CHUNK_BITS = 12,
+        CHUNK_SIZE = 1 << CHUNK_BITS,
+        MAX_CHUNKS = 1 << 16,
+    };
+    mutable std::mutex mtx;
+    std::unordered_map<std::string, int> ids;
+    std::unique_ptr<std::string[]> chunks[MAX_CHUNKS];
+    std::atomic<size_t> count{0};
+};
+
+// process-wide interner shared by the lexer and all symbol tables
+Interner &interner();
+
+//-----------------------------------------------------------------------------
+// SymbolTable - open-addressing hash table keyed by interned id.
+// Values are kept in a deque, so a reference returned by ref() stays valid
+// while later assignments insert new symbols and the slot array is rehashed
+// (but not across erase(), which moves the last symbol into the hole).
+//
+// The table records which symbols may have changed (see changes()), so a
+// persistent copy can be brought up to date in time proportional to the
+// changes (see History). ref() is taken as a write; readers use cref().
+class SymbolTable {
+  public:
+    SymbolTable()
+        : slots(16, Slot{-1, 0}), shift(28), removals(0), journal(false) {}
+
+    // get value by id for writing (insert 0 when absent, like
+    // std::map::operator[])
+    int &ref(int id);
+    // get value by id for reading (insert 0 when absent)
+    const int &cref(int id);
+    int &operator[](const std::string &name) {
+        return ref(interner().intern(name));
+    }
+
+    // get value by id (nullptr when absent)
+    int *find(int id);
+    const int *find(int id) const;
+
+    size_t size() const { return values.size(); }
+    bool empty() const { return values.empty(); }
+    void clear();
+    void reserve(size_t n); // room for n symbols without rehashing
+    // remove a symbol (false when absent)
+    bool erase(int id);
+    // bumped by clear() and erase(). While it stays the same, symbols are
+    // only appended to the insertion order (see id()).
+    uint64_t generation() const { return removals; }
+
+    // ids inserted, written through ref() or erased since clear_changes(),
+    // each once. Their current values may equal the previous ones.
+    const std::vector<int> &changes() const { return changed; }
+    void clear_changes();
+
+    // transaction: between begin() and commit(), the previous state of every
+    // symbol written through ref() or inserted is logged, and abort()
+    // restores it. Transactions do not nest.
+    void begin();
+    void commit();
+    void abort();
+
+    // interned id of the i-th symbol in insertion order (i < size())
+    int id(size_t i) const { return ids[i]; }
+    // (id, value) pairs in insertion order
+    std::vector<std::pair<int, int>> entries() const;
+    // (name, value) pairs sorted by name
+    std::vector<std::pair<std::string, int>> sorted() const;
+
+  private:
+    struct Slot {
+        int id;    // -1 : empty
+        int index; // index of values/ids
+    };
+    std::vector<Slot> slots;
+    unsigned shift; // 32 - log2(slots.size())
+    std::deque<int> values;
+    std::vector<int> ids;
+    uint64_t removals; // generation()
+    std::vector<int> changed;
+    std::vector<char> flagged; // by id: listed in changed
+    struct Undo {
+        int id;
+        int value;
+        bool existed;
+    };
+    std::vector<Undo> undo;
+    bool journal; // in a transaction
+
+    size_t hash(int id) const {
+        // Fibonacci hashing spreads dense ids over the slot array.
+        return static_cast<uint32_t>(static_cast<uint32_t>(id) * 0x9E3779B9u) >>
+               shift;
+    }
+    void grow();
+    int &insert(int id);
+    void touch(int id) {
+        if (static_cast<size_t>(id) >= flagged.size()) {
+            flagged.resize(std::max<size_t>(id + 1, flagged.size() * 2));
+        }
+        if (!flagged[id]) {
+            flagged[id] = 1;
+            changed.push_back(id);
+        }
+    }
+};
+
+} // namespace expr
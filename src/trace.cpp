@@ -0,0 +1,277 @@
+#include "trace.h"
+#include "optimize.h"
+#include <algorithm>
+#include <stdlib.h>
+
+namespace expr {
+
+//-----------------------------------------------------------------------------
+Layout parse_layout(const std::string &spec, size_t record_size) {
+    Layout layout;
+    size_t end = 0;
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = spec.size();
+        }
+        std::string item = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        size_t eq = item.find('=');
+        size_t colon = item.find(':', eq);
+        if (eq == 0 || eq == std::string::npos || colon == std::string::npos) {
+            throw expr_error("invalid field '" + item + "'");
+        }
+        std::string name = item.substr(0, eq);
+        std::string offset = item.substr(eq + 1, colon - eq - 1);
+        std::string width = item.substr(colon + 1);
+
+        // the name must be a single symbol token
+        auto tokens = lexer(name);
+        if (tokens.size() != 2 ||
+            (tokens.front().type != VAR && tokens.front().type != REG)) {
+            throw expr_error("invalid field name '" + name + "'");
+        }
+
+        Field field;
+        field.id = tokens.front().id;
+        field.sign = !width.empty() && width[0] == 's';
+        if (field.sign) {
+            width.erase(0, 1);
+        }
+        char *p;
+        unsigned long off = strtoul(offset.c_str(), &p, 0);
+        if (offset.empty() || *p || off > UINT32_MAX) {
+            throw expr_error("invalid offset '" + item + "'");
+        }
+        field.offset = static_cast<uint32_t>(off);
+        if (width == "1" || width == "2" || (width == "4" && !field.sign)) {
+            field.width = width[0] - '0';
+        } else {
+            throw expr_error("invalid width '" + item + "'");
+        }
+        for (auto &f : layout.fields) {
+            if (f.id == field.id) {
+                throw expr_error("duplicate field '" + name + "'");
+            }
+        }
+        layout.fields.push_back(field);
+        end = std::max<size_t>(end, field.offset + field.width);
+    }
+    if (layout.fields.empty()) {
+        throw expr_error("empty layout");
+    }
+    if (record_size && record_size < end) {
+        throw expr_error("record size is smaller than the layout");
+    }
+    layout.record_size = record_size ? record_size : end;
+    return layout;
+}
+
+//-----------------------------------------------------------------------------
+Range field_range(const Field &field) {
+    if (field.width == 4) {
+        return Range::all();
+    }
+    int64_t bits = field.width * 8;
+    return field.sign ? Range::interval(-(int64_t(1) << (bits - 1)),
+                                        (int64_t(1) << (bits - 1)) - 1)
+                      : Range::interval(0, (int64_t(1) << bits) - 1);
+}
+
+//-----------------------------------------------------------------------------
+static const Field &find_field(const Layout &layout, int id) {
+    for (auto &f : layout.fields) {
+        if (f.id == id) {
+            return f;
+        }
+    }
+    throw expr_error("unknown field '" + interner().name(id) + "'");
+}
+
+TraceFilter::TraceFilter(const Layout &layout, const std::string &condition,
+                         int lanes, bool checked, bool adaptive)
+    : size(layout.record_size), checking(checked) {
+    auto ast = parser(condition);
+    prog = compile(*ast);
+    prog->set_checked(checked);
+    for (int id : prog->symbols()) {
+        loads.push_back(find_field(layout, id));
+    }
+    if (adaptive) {
+        adapt(ast, checked);
+        tree = std::move(ast);
+        return;
+    }
+    if (lanes) {
+        block = BlockEval::create(
+            *ast, [&](int id) { return field_range(find_field(layout, id)); },
+            lanes < 32, checked);
+    }
+    if (block) {
+        for (int id : block->symbols()) {
+            columns.push_back(find_field(layout, id));
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// load - a field of a record (byte by byte; compiles to a single load on
+// little endian hosts)
+static inline int load(const unsigned char *rec, const Field &field) {
+    const unsigned char *p = rec + field.offset;
+    switch (field.width) {
+    case 1:
+        return field.sign ? static_cast<int8_t>(p[0]) : p[0];
+    case 2: {
+        uint16_t v = static_cast<uint16_t>(p[0] | p[1] << 8);
+        return field.sign ? static_cast<int16_t>(v) : v;
+    }
+    default:
+        return static_cast<int>(static_cast<uint32_t>(p[0]) |
+                                static_cast<uint32_t>(p[1]) << 8 |
+                                static_cast<uint32_t>(p[2]) << 16 |
+                                static_cast<uint32_t>(p[3]) << 24);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// each - call fn(i, value) for records [begin, end). The divisors of the
+// program are prepared from the first record.
+template <class F>
+void TraceFilter::each(const char *base, uint64_t begin, uint64_t end,
+                       F fn) const {
+    if (tree) {
+        each_tree(base, begin, end, fn);
+        return;
+    }
+    int small[16];
+    std::vector<int> large;
+    int *slots = small;
+    if (loads.size() > sizeof(small) / sizeof(small[0])) {
+        large.resize(loads.size());
+        slots = large.data();
+    }
+    std::vector<Divisor> divisors(prog->divisions());
+
+    auto rec = reinterpret_cast<const unsigned char *>(base) + begin * size;
+    for (uint64_t i = begin; i < end; i++, rec += size) {
+        for (size_t k = 0; k < loads.size(); k++) {
+            slots[k] = load(rec, loads[k]);
+        }
+        if (i == begin) {
+            prog->prepare(slots, divisors.data());
+        }
+        int val;
+        try {
+            val = prog->eval(slots, divisors.data());
+        } catch (const expr_error &e) {
+            throw expr_error("record " + std::to_string(i) + ": " + e.what());
+        }
+        fn(i, val);
+    }
+}
+
+// each_tree - the same by the adapted tree, the fields of each record
+// stored into a symbol table of this call
+template <class F>
+void TraceFilter::each_tree(const char *base, uint64_t begin, uint64_t end,
+                            F fn) const {
+    SymbolTable symbols;
+    std::vector<int *> refs;
+    for (auto &field : loads) {
+        refs.push_back(&symbols.ref(field.id));
+    }
+    Checked scope(checking);
+
+    auto rec = reinterpret_cast<const unsigned char *>(base) + begin * size;
+    for (uint64_t i = begin; i < end; i++, rec += size) {
+        for (size_t k = 0; k < loads.size(); k++) {
+            *refs[k] = load(rec, loads[k]);
+        }
+        int val;
+        try {
+            val = tree->eval(symbols);
+        } catch (const expr_error &e) {
+            throw expr_error("record " + std::to_string(i) + ": " + e.what());
+        }
+        fn(i, val);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// gather - field of n records into lanes of type T
+template <class T>
+static void gather(const unsigned char *rec, size_t size, const Field &field,
+                   size_t n, T *out) {
+    for (size_t i = 0; i < n; i++, rec += size) {
+        out[i] = static_cast<T>(load(rec, field));
+    }
+}
+
+// each_block - call fn(first, values, n) for blocks of records in
+// [begin, end), values[i] being the value of record first + i
+template <class F>
+void TraceFilter::each_block(const char *base, uint64_t begin, uint64_t end,
+                             F fn) const {
+    std::vector<int32_t> buf(columns.size() * BlockEval::BLOCK);
+    std::vector<const void *> cols(columns.size());
+    int values[BlockEval::BLOCK];
+
+    auto rec = reinterpret_cast<const unsigned char *>(base) + begin * size;
+    for (uint64_t i = begin; i < end; i += BlockEval::BLOCK) {
+        size_t n = static_cast<size_t>(
+            std::min<uint64_t>(BlockEval::BLOCK, end - i));
+        for (size_t k = 0; k < columns.size(); k++) {
+            void *col = &buf[k * BlockEval::BLOCK];
+            cols[k] = col;
+            if (block->width(k) == 8) {
+                gather(rec, size, columns[k], n, static_cast<int8_t *>(col));
+            } else if (block->width(k) == 16) {
+                gather(rec, size, columns[k], n, static_cast<int16_t *>(col));
+            } else {
+                gather(rec, size, columns[k], n, static_cast<int32_t *>(col));
+            }
+        }
+        block->eval(cols.data(), n, values);
+        fn(i, values, n);
+        rec += n * size;
+    }
+}
+
+//-----------------------------------------------------------------------------
+void TraceFilter::scan(const char *base, uint64_t begin, uint64_t end,
+                       std::vector<uint64_t> &matches) const {
+    if (block) {
+        each_block(base, begin, end,
+                   [&](uint64_t first, const int *values, size_t n) {
+                       for (size_t i = 0; i < n; i++) {
+                           if (values[i]) {
+                               matches.push_back(first + i);
+                           }
+                       }
+                   });
+        return;
+    }
+    each(base, begin, end, [&](uint64_t i, int val) {
+        if (val) {
+            matches.push_back(i);
+        }
+    });
+}
+
+void TraceFilter::eval(const char *base, uint64_t begin, uint64_t end,
+                       int *values) const {
+    if (block) {
+        each_block(base, begin, end,
+                   [&](uint64_t first, const int *v, size_t n) {
+                       std::copy(v, v + n, values + (first - begin));
+                   });
+        return;
+    }
+    each(base, begin, end,
+         [&](uint64_t i, int val) { values[i - begin] = val; });
+}
+
+} // namespace expr
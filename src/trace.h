@@ -0,0 +1,95 @@
+#pragma once
+
+#include "block_eval.h"
+#include "program.h"
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace expr {
+
+//=============================================================================
+// trace replay
+// A trace is a file of fixed-size binary records. A layout names the fields
+// of a record, and a condition over the field names selects records.
+//
+// layout : comma separated fields "name=offset:width"
+//   width  1, 2, 4 : unsigned little endian integer (zero extended)
+//          s1, s2  : signed little endian integer (sign extended)
+//   e.g. "pc=0:4,%r0=4:4,%r1=8:4,flags=12:s2"
+// The record size is the end of the last field unless given.
+
+struct Field {
+    int id;          // interned name
+    uint32_t offset; // byte offset in the record
+    int width;       // 1, 2 or 4
+    bool sign;       // sign extend
+};
+
+struct Layout {
+    std::vector<Field> fields;
+    size_t record_size;
+};
+
+// parse a layout (expr_error if invalid). record_size 0 : end of the last
+// field; otherwise it must hold every field.
+Layout parse_layout(const std::string &spec, size_t record_size = 0);
+
+// values a field can hold, e.g. [0, 255] for width 1
+Range field_range(const Field &field);
+
+//-----------------------------------------------------------------------------
+// TraceFilter - a compiled condition with its symbols bound to record
+// offsets. Every symbol of the condition must be a field (expr_error).
+// The condition may also be any expression whose values are wanted, e.g.
+// the argument of an aggregate. When BlockEval supports the condition,
+// records are evaluated a block at a time in lanes chosen from the field
+// widths; otherwise one at a time by the compiled program. lanes limits
+// the blocks: 8 (narrowest lanes), 32 (32-bit lanes only) or 0 (no blocks).
+// checked selects checked arithmetic (see arith.h). A record whose
+// evaluation fails (division by zero, overflow if checked) ends scan() and
+// eval() with expr_error naming its index.
+// adaptive evaluates records one at a time by the tree after adapt()
+// instead (no blocks, no program), so chains of && / || learn from the
+// records which operands to run first; the results are the same. It pays
+// for conditions whose cheap, deciding operands are not written first.
+class TraceFilter {
+  public:
+    TraceFilter(const Layout &layout, const std::string &condition,
+                int lanes = 8, bool checked = false, bool adaptive = false);
+
+    size_t record_size() const { return size; }
+    // evaluated a block at a time
+    bool blocked() const { return block != nullptr; }
+    // evaluated by the adapted tree
+    bool adaptive() const { return tree != nullptr; }
+
+    // append the index of every matching record in [begin, end) to matches.
+    // base points to record 0. Safe to call from several threads.
+    void scan(const char *base, uint64_t begin, uint64_t end,
+              std::vector<uint64_t> &matches) const;
+    // store the value of records [begin, end) to values[0, end - begin)
+    void eval(const char *base, uint64_t begin, uint64_t end,
+              int *values) const;
+
+  private:
+    std::unique_ptr<Program> prog;
+    std::vector<Field> loads; // field of each slot
+    size_t size;
+    std::unique_ptr<BlockEval> block;
+    std::vector<Field> columns; // field of each input of block
+    std::unique_ptr<ExprAST> tree; // adaptive: the adapted condition
+    bool checking;
+
+    template <class F>
+    void each(const char *base, uint64_t begin, uint64_t end, F fn) const;
+    template <class F>
+    void each_tree(const char *base, uint64_t begin, uint64_t end,
+                   F fn) const;
+    template <class F>
+    void each_block(const char *base, uint64_t begin, uint64_t end,
+                    F fn) const;
+};
+
+} // namespace expr
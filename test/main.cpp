@@ -1,4 +1,23 @@
+#include "ast.h" // internal: expr::Divisor
+#include "aggregate.h"
+#include "block_eval.h"
+#include "bulk_eval.h"
+#include "cache.h"
+#include "completion.h"
 #include "expr.h"
+#include "format.h"
+#include "import.h"
+#include "libexpr.h"
+#include "optimize.h"
+#include "profile.h"
+#include "range.h"
+#include "server.h"
+#include "session.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
+#include <algorithm>
+#include <climits>
 #include <iostream>
 #include <list>
 #include <map>
@@ -7,6 +26,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
 
 //=============================================================================
 // test & main
@@ -161,6 +184,52 @@ TEST(eval, invalid_syntax) {
   TEST_INVALID_SYNTAX("1=2");     //	cannot assign to except for variables
 }
 
+//-----------------------------------------------------------------------------
+TEST(eval, try_parse) {
+  struct {
+    const char *src;
+    expr::ParseCode code;
+    size_t offset;
+    const char *token;
+    const char *message;
+  } cases[] = {
+      {"((1+2)", expr::PARSE_EXPECTED_PARR, 6, "", "expected ')'"},
+      {"(1+2))", expr::PARSE_EXPECTED_PARL, 5, ")", "expected '('"},
+      {"3 (1+2)", expr::PARSE_EXPECTED_OPERATOR, 2, "(",
+       "unknown token when expecting an operator '('"},
+      {"(1+2)+", expr::PARSE_EXPECTED_EXPRESSION, 6, "",
+       "unknown token when expecting an expression"},
+      {"a ? 3", expr::PARSE_EXPECTED_COLON, 5, "", "expected ':'"},
+      {"1 + $", expr::PARSE_INVALID_TOKEN, 4, "$", "invalid token"},
+      {"x + 4294967296", expr::PARSE_OUT_OF_RANGE, 4, "4294967296",
+       "integer literal out of range '4294967296'"},
+      {"1 + bits(x, 3)", expr::PARSE_ARGUMENTS, 4, "bits",
+       "bits() takes 3 arguments"},
+      {"popcnt(x, 1", expr::PARSE_EXPECTED_PARR, 11, "", "expected ')'"},
+  };
+  for (auto &c : cases) {
+    auto result = expr::try_parse(c.src);
+    ASSERT_FALSE(result) << c.src;
+    ASSERT_EQ(c.code, result.error.code) << c.src;
+    ASSERT_EQ(c.offset, result.error.offset) << c.src;
+    ASSERT_EQ(c.token, result.error.token) << c.src;
+    ASSERT_EQ(c.message, result.error.message()) << c.src;
+    // the throwing parser reports the same message
+    try {
+      expr::parser(c.src);
+      FAIL() << c.src;
+    } catch (const expr::expr_error &e) {
+      ASSERT_EQ(c.message, std::string(e.what())) << c.src;
+    }
+  }
+
+  auto result = expr::try_parse("a = 0x7fffffff + 2147483647");
+  ASSERT_TRUE(result);
+  ASSERT_EQ(expr::PARSE_OK, result.error.code);
+  expr::SymbolTable symbols;
+  ASSERT_EQ(-2, result.ast->eval(symbols));
+}
+
 //-----------------------------------------------------------------------------
 int a, b, c, d, e, f, g = 0;
 int _a, _b, _c, _d, _e, _f, _g = 0;
@@ -296,6 +365,1452 @@ TEST(eval, this_pointer) {
   ASSERT_EQ((int)(foo.reg[12] >= 100), myAST->eval(getReg));
 }
 
+//-----------------------------------------------------------------------------
+TEST(eval, builtin) {
+  expr::SymbolTable symbols;
+  symbols["x"] = 0x12345678;
+  symbols["popcnt"] = 3; // a variable unless it is called
+  struct {
+    const char *src;
+    int expect;
+  } cases[] = {
+      {"popcnt(x)", 13},
+      {"popcnt(-1) + popcnt", 35},
+      {"clz(x) + clz(0) + clz(-1)", 35},
+      {"ctz(x) + ctz (0)", 35},
+      {"bswap(x) == 0x78563412", 1},
+      {"bits(x, 15, 8)", 0x56},
+      {"bits(x, 31, 0) == x", 1},
+      {"bits(-1, 31, 31)", 1},
+      {"setbits(x, 15, 8, 0xab) == 0x1234ab78", 1},
+      {"setbits(0, 31, 28, 0x1f)", (int)0xf0000000},
+      {"bits(setbits(x, 7, 4, y = 9), 7, 4) + y", 18},
+  };
+  for (auto &c : cases) {
+    ASSERT_EQ(c.expect, expr::eval(c.src, symbols)) << c.src;
+    auto ast = expr::parser(c.src);
+    ASSERT_EQ(c.expect, expr::compile(*ast)->eval(symbols)) << c.src;
+    ASSERT_EQ(c.expect, expr::eval(expr::unparse(*ast), symbols)) << c.src;
+  }
+
+  for (auto src : {"popcnt()", "popcnt(1, 2)", "bits(x, 1)", "clz(1",
+                   "clz 1"}) {
+    ASSERT_ANY_THROW(expr::parser(src)) << src;
+  }
+  for (auto src : {"bits(x, 3, 4)", "bits(x, 32, 0)", "setbits(x, 0, -1, 1)"}) {
+    ASSERT_ANY_THROW(expr::eval(src, symbols)) << src;
+    ASSERT_ANY_THROW(expr::compile(*expr::parser(src))->eval(symbols)) << src;
+  }
+}
+
+//-----------------------------------------------------------------------------
+TEST(eval, reg_bind) {
+  int R[16] = {0};
+  int S[4] = {0};
+  auto myAST = expr::parser(R"(%r12 >= 100 && %s3 == -1)");
+  expr::bind(*myAST, {{'r', R, 16}, {'s', S, 4}});
+
+  R[12] = 128;
+  S[3] = -1;
+  ASSERT_EQ(1, myAST->eval());
+  R[12] = 99;
+  ASSERT_EQ(0, myAST->eval());
+
+  // assignment writes through to the register file
+  auto assign = expr::parser(R"(%r1 = %r12 + 1)");
+  expr::bind(*assign, {{'r', R, 16}});
+  ASSERT_EQ(100, assign->eval());
+  ASSERT_EQ(100, R[1]);
+
+  // out of range index is rejected at bind time
+  auto bad = expr::parser(R"(%r16 + 1)");
+  ASSERT_ANY_THROW(expr::bind(*bad, {{'r', R, 16}}));
+
+  // unbound banks fall back to the symbol callback
+  auto partial = expr::parser(R"(%r0 + %t0)");
+  expr::bind(*partial, {{'r', R, 16}});
+  R[0] = 5;
+  _a = 7;
+  ASSERT_EQ(12, partial->eval(getVar));
+}
+
+//-----------------------------------------------------------------------------
+TEST(eval, checked) {
+  // message of the expr_error thrown by fn, "" if none
+  auto error = [](std::function<void()> fn) -> std::string {
+    try {
+      fn();
+    } catch (const expr::expr_error &e) {
+      return e.what();
+    }
+    return "";
+  };
+  expr::SymbolTable symbols;
+  symbols["big"] = INT_MAX;
+  symbols["min"] = INT_MIN;
+  symbols["x"] = 65536;
+  auto ast_eval = [&](const char *src) {
+    return [&symbols, src] { expr::eval(src, symbols); };
+  };
+  auto prog_eval = [&](const char *src, bool checked = false) {
+    return [&symbols, src, checked] {
+      auto prog = expr::compile(*expr::parser(src));
+      prog->set_checked(checked);
+      prog->eval(symbols);
+    };
+  };
+
+  // unchecked : wraps around, shift amounts modulo 32
+  ASSERT_EQ(INT_MIN, expr::eval("big + 1", symbols));
+  ASSERT_EQ(0, expr::eval("x * x", symbols));
+  ASSERT_EQ(INT_MIN, expr::eval("min / -1", symbols));
+  ASSERT_EQ(0, expr::eval("min % -1", symbols));
+  ASSERT_EQ(INT_MIN, expr::eval("-min", symbols));
+  ASSERT_EQ(2, expr::eval("1 << 33", symbols));
+  ASSERT_EQ(INT_MIN, expr::compile(*expr::parser("big + 1"))->eval(symbols));
+
+  // division by zero fails in either mode, also in the optimized forms
+  ASSERT_EQ("division by zero in 'x / (big - big)'",
+            error(ast_eval("x / (big - big)")));
+  ASSERT_EQ("division by zero in 'x %= 0'", error(ast_eval("x %= 0")));
+  ASSERT_EQ(65536, symbols["x"]);
+  ASSERT_EQ("division by zero", error(prog_eval("x / 0")));
+  auto divide = expr::parser("x / y");
+  expr::optimize(divide);
+  symbols["y"] = 7;
+  expr::prepare(*divide, symbols);
+  ASSERT_EQ(9362, divide->eval(symbols));
+  symbols["y"] = 0;
+  ASSERT_EQ("division by zero in 'x / y'",
+            error([&] { divide->eval(symbols); }));
+
+  std::unique_ptr<expr::Checked> scope(new expr::Checked(true));
+  ASSERT_EQ("overflow in 'big + 1' (2147483647 + 1)",
+            error(ast_eval("big + 1")));
+  ASSERT_EQ("overflow in 'x * x' (65536 * 65536)", error(ast_eval("x * x")));
+  ASSERT_EQ("overflow in '-min' (-(-2147483648))", error(ast_eval("-min")));
+  ASSERT_EQ("overflow in 'min / -1' (-2147483648 / -1)",
+            error(ast_eval("min / -1")));
+  ASSERT_EQ("", error(ast_eval("min % -1")));
+  ASSERT_EQ("overflow in 'x << 15' (65536 << 15)", error(ast_eval("x << 15")));
+  ASSERT_EQ("shift out of range in '1 << 33' (1 << 33)",
+            error(ast_eval("1 << 33")));
+  ASSERT_EQ("shift out of range in 'x >> -1' (65536 >> -1)",
+            error(ast_eval("x >> -1")));
+  ASSERT_EQ("overflow in 'big -= min' (2147483647 - -2147483648)",
+            error(ast_eval("big -= min")));
+  ASSERT_EQ(INT_MAX, symbols["big"]);
+  ASSERT_EQ(INT_MAX, expr::eval("big - 1 + 1", symbols));
+  ASSERT_EQ(INT_MIN, expr::eval("-1 << 31", symbols));
+
+  // only on this thread, and only while the scope lasts
+  int other = 0;
+  std::thread([&] { other = expr::eval("big + 1", symbols); }).join();
+  ASSERT_EQ(INT_MIN, other);
+  ASSERT_EQ("", error(prog_eval("big + 1"))); // programs carry their own
+  scope.reset();
+  ASSERT_EQ(INT_MIN, expr::eval("big + 1", symbols));
+
+  // a checked program, whatever the thread
+  ASSERT_EQ("overflow in 2147483647 + 1", error(prog_eval("big + 1", true)));
+  ASSERT_EQ("overflow in 65536 * 65536", error(prog_eval("x *= x", true)));
+  ASSERT_EQ(65536, symbols["x"]);
+
+  // blocks only for arithmetic that the ranges keep from overflowing
+  auto byte = [](int) { return expr::Range::interval(0, 255); };
+  auto block = [](const char *src, const expr::SymbolRange &symbol) {
+    return expr::BlockEval::create(*expr::parser(src), symbol, true, true);
+  };
+  ASSERT_NE(nullptr, block("a * b + 1", byte));
+  ASSERT_EQ(nullptr, block("a * b + 1", nullptr));
+  ASSERT_EQ(nullptr, block("-a", nullptr));
+  ASSERT_NE(nullptr, expr::BlockEval::create(*expr::parser("-a"), nullptr));
+
+  // constants that overflow are not folded away
+  auto folded = expr::specialize(*expr::parser("big * 2 + 1"), symbols, true);
+  ASSERT_EQ("(2147483647 * 2) + 1", expr::unparse(*folded.ast));
+  {
+    expr::Checked on(true);
+    ASSERT_FALSE(error([&] { folded.ast->eval(symbols); }).empty());
+  }
+  ASSERT_EQ(-1, folded.ast->eval(symbols));
+
+  // parallel_for passes the first failure on to the caller
+  ASSERT_ANY_THROW(expr::parallel_for(100, 4, [](size_t begin, size_t, size_t) {
+    if (begin) {
+      throw expr::expr_error("worker");
+    }
+  }));
+}
+
+//-----------------------------------------------------------------------------
+TEST(symbol, interner) {
+  auto &names = expr::interner();
+  int foo = names.intern("foo");
+  ASSERT_EQ(foo, names.intern("foo"));
+  ASSERT_EQ(foo, names.find("foo"));
+  ASSERT_EQ("foo", names.name(foo));
+  ASSERT_NE(foo, names.intern("bar"));
+  ASSERT_EQ(-1, names.find("never_interned_name"));
+
+  auto tokens = expr::lexer("foo + bar");
+  ASSERT_EQ(foo, tokens.front().id);
+  ASSERT_EQ(-1, std::next(tokens.begin())->id);
+}
+
+//-----------------------------------------------------------------------------
+TEST(symbol, table) {
+  expr::SymbolTable symbols;
+  int &first = symbols["v0"];
+  first = 42;
+  // force several rehashes while holding a reference
+  for (int i = 1; i < 1000; i++) {
+    symbols["v" + std::to_string(i)] = i;
+  }
+  ASSERT_EQ(1000u, symbols.size());
+  ASSERT_EQ(42, first);
+  ASSERT_EQ(999, symbols["v999"]);
+  ASSERT_EQ(nullptr, symbols.find(expr::interner().intern("undefined")));
+
+  auto sorted = symbols.sorted();
+  ASSERT_EQ("v0", sorted.front().first);
+  ASSERT_EQ("v999", sorted.back().first);
+  ASSERT_TRUE(std::is_sorted(sorted.begin(), sorted.end()));
+}
+
+//-----------------------------------------------------------------------------
+TEST(symbol, eval) {
+  expr::SymbolTable symbols;
+  ASSERT_EQ(3, expr::eval("x = 1 + 2", symbols));
+  ASSERT_EQ(9, expr::eval("y = x * x", symbols));
+  ASSERT_EQ(12, expr::eval("x += y", symbols));
+  ASSERT_EQ(7, expr::eval("a = b = c = 7", symbols));
+  ASSERT_EQ(21, expr::eval("a + b + c", symbols));
+  ASSERT_EQ(0, expr::eval("undefinedyet", symbols));
+  ASSERT_ANY_THROW(expr::eval("1 = 2", symbols));
+}
+
+//-----------------------------------------------------------------------------
+TEST(symbol, session) {
+  char path[] = "/tmp/crepl_session_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  expr::SymbolTable saved;
+  for (int i = 0; i < 1000; i++) {
+    saved["s" + std::to_string(i)] = i * 3 - 500;
+  }
+  expr::save_session(path, saved);
+
+  expr::SymbolTable loaded;
+  loaded["s1"] = 12345;
+  loaded["other"] = 7;
+  ASSERT_EQ(1000u, expr::load_session(path, loaded));
+  ASSERT_EQ(1001u, loaded.size());
+  ASSERT_EQ(-500, loaded["s0"]);
+  ASSERT_EQ(-497, loaded["s1"]);
+  ASSERT_EQ(2497, loaded["s999"]);
+  ASSERT_EQ(7, loaded["other"]);
+
+  // truncated file is rejected without touching the table
+  ASSERT_EQ(0, truncate(path, 40));
+  ASSERT_ANY_THROW(expr::load_session(path, loaded));
+  ASSERT_EQ(-497, loaded["s1"]);
+  unlink(path);
+  ASSERT_ANY_THROW(expr::load_session(path, loaded));
+}
+
+//-----------------------------------------------------------------------------
+TEST(symbol, snapshot) {
+  auto id = [](int i) { return expr::interner().intern("s" + std::to_string(i)); };
+  expr::SymbolTable symbols;
+  for (int i = 0; i < 2000; i++) {
+    symbols.ref(id(i)) = i;
+  }
+  expr::History history(symbols);
+  ASSERT_EQ(1u, history.snapshot());
+
+  // a few changes: the diff lists exactly them
+  expr::eval("s5 = -5", symbols);
+  expr::eval("s1999 += 1", symbols);
+  expr::eval("s2000 = 7", symbols);
+  ASSERT_TRUE(symbols.erase(id(10)));
+  ASSERT_FALSE(symbols.erase(id(10)));
+  ASSERT_EQ(2000u, symbols.size());
+  ASSERT_EQ(2u, history.snapshot());
+  auto changes = history.diff(1);
+  ASSERT_EQ(4u, changes.size());
+  ASSERT_EQ(id(10), changes[0].id); // sorted by name: s10, s1999, s2000, s5
+  ASSERT_TRUE(changes[0].had && !changes[0].has);
+  ASSERT_EQ(1999, changes[1].before);
+  ASSERT_EQ(2000, changes[1].after);
+  ASSERT_TRUE(!changes[2].had && changes[2].has && changes[2].after == 7);
+  ASSERT_EQ(-5, changes[3].after);
+  ASSERT_EQ(0u, history.diff(2).size());
+
+  // reading does not count as a change
+  expr::eval("s1 + s2", symbols);
+  ASSERT_EQ(0u, history.diff(2).size());
+
+  // rollback restores the table and drops the later snapshots
+  ASSERT_EQ(4u, history.rollback(1));
+  ASSERT_EQ(1u, history.size());
+  ASSERT_EQ(2000u, symbols.size());
+  for (int i = 0; i < 2000; i++) {
+    ASSERT_EQ(i, *symbols.find(id(i)));
+  }
+  ASSERT_EQ(nullptr, symbols.find(id(2000)));
+  ASSERT_EQ(0u, history.diff(1).size());
+
+  // every symbol erased and back
+  symbols.clear();
+  ASSERT_EQ(2000u, history.diff(1).size());
+  ASSERT_EQ(2000u, history.rollback(1));
+  ASSERT_EQ(1999, *symbols.find(id(1999)));
+
+  // snapshots share their nodes: older maps keep their contents
+  expr::SymbolMap map;
+  std::vector<expr::SymbolMap> versions;
+  for (int i = 0; i < 100; i++) {
+    versions.push_back(map);
+    map.assign(i << 10, i); // ids sharing their low bits
+  }
+  ASSERT_TRUE(map.remove(5 << 10));
+  ASSERT_FALSE(map.assign(6 << 10, 6));
+  ASSERT_EQ(99u, map.size());
+  ASSERT_EQ(50u, versions[50].size());
+  ASSERT_EQ(nullptr, versions[50].find(50 << 10));
+  ASSERT_EQ(49, *versions[50].find(49 << 10));
+  int count = 0;
+  expr::SymbolMap::diff(versions[50], map,
+                        [&](int, const int *before, const int *after) {
+                          count += before ? -1 : 1;
+                          ASSERT_TRUE(before == nullptr || after == nullptr);
+                        });
+  ASSERT_EQ(50 - 1, count); // 50..99 added, 5 removed
+}
+
+//-----------------------------------------------------------------------------
+TEST(symbol, transaction) {
+  expr::SymbolTable symbols;
+  symbols["a"] = 1;
+  symbols.begin();
+  symbols["a"] = 2;
+  symbols["a"] = 3;
+  symbols["b"] = 4;
+  symbols.abort();
+  ASSERT_EQ(1u, symbols.size());
+  ASSERT_EQ(1, symbols["a"]);
+
+  // a failing line leaves no partial writes
+  symbols.begin();
+  ASSERT_ANY_THROW(expr::eval("a = (c = 5) + bits(a, 40, 0)", symbols));
+  symbols.abort();
+  ASSERT_EQ(1, symbols["a"]);
+  ASSERT_EQ(nullptr, symbols.find(expr::interner().intern("c")));
+
+  symbols.begin();
+  expr::eval("a = (c = 5) + 1", symbols);
+  symbols.commit();
+  ASSERT_EQ(6, symbols["a"]);
+  ASSERT_EQ(5, symbols["c"]);
+}
+
+//-----------------------------------------------------------------------------
+TEST(program, eval) {
+  const char *exprs[] = {
+      "1 + 2 * 3",         "-x + ~y - !z",       "x / 3 + x % 3",
+      "x << 2 | y >> 1",   "x == y || y != z",   "x < y && y <= z",
+      "z && (x = 5)",      "y || (x = 7)",       "x ? y : z",
+      "x > 0 ? y >= 2 ? 1 : 2 : 3",              "x = y = z + 1",
+      "x += 2",            "x -= 1",             "x *= y",
+      "x /= 2",            "x %= 3",             "x &= 6",
+      "x |= 9",            "x ^= y",             "x <<= 2",
+      "x >>= 1",           "+x - -y",            "(x & y) ^ (z | 1)",
+  };
+  for (auto src : exprs) {
+    auto ast = expr::parser(src);
+    auto prog = expr::compile(*ast);
+    for (int x : {-7, 0, 3, 12}) {
+      expr::SymbolTable expect, actual;
+      expect["x"] = actual["x"] = x;
+      expect["y"] = actual["y"] = 2;
+      expect["z"] = actual["z"] = 0;
+      ASSERT_EQ(ast->eval(expect), prog->eval(actual)) << src;
+      ASSERT_EQ(expect.sorted(), actual.sorted()) << src;
+    }
+  }
+  ASSERT_ANY_THROW(expr::compile(*expr::parser("1 = 2")));
+
+  // slots are numbered in order of first appearance
+  auto prog = expr::compile(*expr::parser("b = a * a + b"));
+  ASSERT_EQ(2u, prog->symbols().size());
+  int slots[2] = {0, 0};
+  slots[prog->symbols()[0] == expr::interner().find("a") ? 0 : 1] = 3;
+  ASSERT_EQ(9, prog->eval(slots));
+}
+
+//-----------------------------------------------------------------------------
+TEST(program, divide) {
+  // divisions by symbols and by literals with a magic number are DIVM / MODM
+  struct {
+    const char *src;
+    size_t divisions;
+  } cases[] = {
+      {"x / 7 + x % y", 2}, {"x /= y", 1},     {"x %= 3", 1}, 
+      {"x / 1 + x % -1", 0}, {"x / (y * 2)", 0}, {"y ? x / y : 0", 1},
+  };
+  for (auto &c : cases) {
+    auto ast = expr::parser(c.src);
+    auto prog = expr::compile(*ast);
+    ASSERT_EQ(c.divisions, prog->divisions()) << c.src;
+    for (int x : {-7, 0, 3, 12, INT_MIN}) {
+      for (int y : {-7, -1, 1, 2, 7, 1000}) {
+        expr::SymbolTable expect, actual;
+        expect["x"] = actual["x"] = x;
+        expect["y"] = actual["y"] = y;
+        ASSERT_EQ(ast->eval(expect), prog->eval(actual)) << c.src;
+        ASSERT_EQ(expect.sorted(), actual.sorted()) << c.src;
+      }
+    }
+  }
+
+  // so are the divisions optimize() rewrites
+  auto ast = expr::parser("x / y + x % 10");
+  expr::optimize(ast);
+  auto prog = expr::compile(*ast);
+  ASSERT_EQ(2u, prog->divisions());
+
+  // prepared for one divisor, right for any
+  int x = prog->symbols()[0] == expr::interner().find("x") ? 0 : 1;
+  int slots[2];
+  slots[x] = 100;
+  slots[1 - x] = 7;
+  std::vector<expr::Divisor> prepared(prog->divisions());
+  prog->prepare(slots, prepared.data());
+  ASSERT_EQ(100 / 7 + 100 % 10, prog->eval(slots, prepared.data()));
+  for (int y : {7, -7, 3, -1, 1}) {
+    for (int n : {-100, 0, 99, INT_MIN, INT_MAX}) {
+      slots[x] = n;
+      slots[1 - x] = y;
+      int expect = (y == -1 && n == INT_MIN ? INT_MIN : n / y) + n % 10;
+      ASSERT_EQ(expect, prog->eval(slots, prepared.data())) << n << "/" << y;
+    }
+  }
+  slots[1 - x] = 0;
+  ASSERT_THROW(prog->eval(slots, prepared.data()), expr::expr_error);
+
+  // checked, INT_MIN / -1 fails by either path
+  prog->set_checked(true);
+  slots[x] = INT_MIN;
+  slots[1 - x] = -1;
+  ASSERT_THROW(prog->eval(slots, prepared.data()), expr::expr_error);
+  slots[1 - x] = 7;
+  ASSERT_EQ(INT_MIN / 7 + INT_MIN % 10, prog->eval(slots, prepared.data()));
+}
+
+//-----------------------------------------------------------------------------
+TEST(program, cache) {
+  char dir[] = "/tmp/crepl_cache_XXXXXX";
+  ASSERT_NE(nullptr, mkdtemp(dir));
+
+  expr::ProgramCache cache(dir);
+  expr::SymbolTable symbols;
+  symbols["x"] = 4;
+  ASSERT_EQ(17, cache.get("x * x + 1")->eval(symbols));
+  ASSERT_EQ(1u, cache.stats().misses);
+  ASSERT_EQ(17, cache.get("  x *  x\t+ 1 ")->eval(symbols)); // normalized
+  ASSERT_EQ(1u, cache.stats().hits);
+  ASSERT_ANY_THROW(cache.get("x +"));
+
+  // a corrupt entry is recompiled and rewritten
+  std::string path = cache.path(expr::ProgramCache::normalize("x * x + 1"));
+  FILE *fp = fopen(path.c_str(), "r+b");
+  ASSERT_NE(nullptr, fp);
+  fseek(fp, 40, SEEK_SET);
+  fputc(0x7f, fp);
+  fclose(fp);
+  ASSERT_EQ(17, cache.get("x * x + 1")->eval(symbols));
+  ASSERT_EQ(1u, cache.stats().invalid);
+  ASSERT_EQ(17, cache.get("x * x + 1")->eval(symbols));
+  ASSERT_EQ(2u, cache.stats().hits);
+
+  unlink(path.c_str());
+  rmdir(dir);
+}
+
+//-----------------------------------------------------------------------------
+TEST(eval, unparse) {
+  for (auto src : {"a + (b * 3)", "(a + b) * 3", "-a + ~(b - 1)",
+                   "x = ((a > 0) ? b : (c ? 1 : 2))", "%r1 <<= (a && b)",
+                   "!a || (b != c)"}) {
+    auto ast = expr::parser(src);
+    ASSERT_EQ(src, expr::unparse(*ast));
+  }
+  ASSERT_STREQ("<<=", expr::op_str(expr::ASSIGN_SL));
+  ASSERT_STREQ("-", expr::op_str(expr::MINUS));
+}
+
+//-----------------------------------------------------------------------------
+TEST(profile, eval) {
+  auto ast = expr::parser("a > 0 && b || (c ? d + 1 : 2)");
+  expr::Profile prof(*ast);
+  expr::SymbolTable symbols;
+  for (int i = 0; i < 10; i++) {
+    symbols["a"] = i % 2; // a > 0 on odd i
+    symbols["b"] = i % 4 == 1;
+    symbols["c"] = i % 3;
+    symbols["d"] = i;
+    ASSERT_EQ(ast->eval(symbols), prof.eval(symbols));
+  }
+  // preorder: || && > a 0 b ?: c + d 1 2
+  auto &nodes = prof.nodes();
+  ASSERT_EQ(12u, nodes.size());
+  ASSERT_EQ(10u, nodes[0].visits);
+  ASSERT_EQ(3u, nodes[0].shorts); // i = 1, 5, 9
+  ASSERT_EQ(10u, nodes[1].visits);
+  ASSERT_EQ(5u, nodes[1].shorts); // a == 0
+  ASSERT_EQ(5u, nodes[5].visits); // b
+  ASSERT_EQ(7u, nodes[6].visits); // ?:
+  ASSERT_EQ(4u, nodes[6].shorts); // c != 0 for i = 2, 4, 7, 8
+  ASSERT_EQ(4u, nodes[8].visits);
+  ASSERT_EQ(3u, nodes[11].visits);
+  ASSERT_GE(nodes[0].cycles, nodes[1].cycles);
+
+  auto report = prof.report();
+  ASSERT_NE(std::string::npos, report.find("10 evaluations"));
+  ASSERT_NE(std::string::npos, report.find("  (a > 0) && b\n"));
+}
+
+//-----------------------------------------------------------------------------
+TEST(optimize, divide) {
+  const int values[] = {0,   1,   -1,     2,      -2,         3,         -3,
+                        7,   -7,  10,     -10,    100,        -100,      12345,
+                        -99, 255, 0x4000, -65536, 0x7fffffff, -0x7fffffff,
+                        (int)0x80000000};
+  for (int d : values) {
+    if (d == 0) {
+      continue;
+    }
+    expr::Divisor divisor(d);
+    for (int n : values) {
+      if (d == -1 && n == (int)0x80000000) {
+        continue; // overflow
+      }
+      ASSERT_EQ(n / d, divisor.div(n)) << n << " / " << d;
+      ASSERT_EQ(n % d, divisor.mod(n)) << n << " % " << d;
+    }
+  }
+  // random dividends and divisors
+  srand(1);
+  for (int i = 0; i < 100000; i++) {
+    int n = (rand() << 16) ^ rand();
+    int d = ((rand() << 16) ^ rand()) >> (rand() % 31);
+    if (d == 0 || (d == -1 && n == (int)0x80000000)) {
+      continue;
+    }
+    expr::Divisor divisor(d);
+    ASSERT_EQ(n / d, divisor.div(n)) << n << " / " << d;
+    ASSERT_EQ(n % d, divisor.mod(n)) << n << " % " << d;
+  }
+}
+
+//-----------------------------------------------------------------------------
+TEST(optimize, rewrite) {
+  struct {
+    const char *src;
+    const char *optimized;
+  } cases[] = {
+      {"a * 8", "a << 3"},
+      {"16 * (a + 1)", "(a + 1) << 4"},
+      {"a * 6", "a * 6"},
+      {"a / 7 + a % -10", "(a / 7) + (a % -10)"},
+      {"a / 1", "a / 1"},
+      {"a / b", "a / b"},
+      {"a / (b + 1)", "a / (b + 1)"},
+      {"a *= 4", "a <<= 2"},
+      {"a /= 3", "a = (a / 3)"},
+      {"a %= b", "a = (a % b)"},
+  };
+  for (auto &c : cases) {
+    auto ast = expr::parser(c.src);
+    auto opt = expr::parser(c.src);
+    expr::optimize(opt);
+    ASSERT_EQ(c.optimized, expr::unparse(*opt)) << c.src;
+
+    for (int a : {-100, -7, -1, 0, 1, 5, 99, 0x12345678}) {
+      for (int b : {-5, 3, 7}) {
+        expr::SymbolTable expect, actual;
+        expect["a"] = actual["a"] = a;
+        expect["b"] = actual["b"] = b;
+        expr::prepare(*opt, actual);
+        ASSERT_EQ(ast->eval(expect), opt->eval(actual)) << c.src;
+        ASSERT_EQ(expect["a"], actual["a"]) << c.src;
+        // the divisor changes after prepare
+        actual["b"] = b * 3;
+        expect["b"] = b * 3;
+        ASSERT_EQ(ast->eval(expect), opt->eval(actual)) << c.src;
+      }
+    }
+    // compiled programs divide by the hardware
+    expr::SymbolTable symbols;
+    symbols["a"] = 100;
+    symbols["b"] = 7;
+    int val = expr::compile(*opt)->eval(symbols);
+    symbols["a"] = 100;
+    ASSERT_EQ(ast->eval(symbols), val) << c.src;
+  }
+}
+
+//-----------------------------------------------------------------------------
+TEST(optimize, specialize) {
+  expr::SymbolTable known;
+  known["mode"] = 2;
+  known["k"] = 4;
+  known["offset"] = 1;
+  known["zero"] = 0;
+  known["x"] = 100; // assigned below, so never substituted
+
+  auto names = [](const std::vector<int> &ids) {
+    std::string s;
+    for (int id : ids) {
+      s += expr::interner().name(id) + " ";
+    }
+    return s;
+  };
+  struct {
+    const char *src;
+    const char *residual;
+    const char *free;
+  } cases[] = {
+      {"(mode == 2 ? a * k : b) + offset", "(a * 4) + 1", "a "},
+      {"mode * k + offset", "9", ""},
+      {"zero && (a = 1)", "0", ""},
+      {"mode || a", "1", ""},
+      {"offset && a", "!!a", "a "},
+      {"a && zero", "0", ""},
+      {"(a = 5) && zero", "(a = 5) && 0", "a "},
+      {"a + zero * b", "a", "a "},
+      {"a / zero", "a / 0", "a "},
+      {"x = x + k", "x = (x + 4)", "x "},
+      {"x + k", "104", ""},
+      {"b += mode << k", "b += 32", "b "},
+      {"-k + ~zero + !mode", "-5", ""},
+      {"bits(a, k + 3, k) + popcnt(mode)", "bits(a, 7, 4) + 1", "a "},
+      {"bits(a, zero, k)", "bits(a, 0, 4)", "a "}, // invalid range kept
+      // an operand that may fail is not dropped
+      {"(a / zero) * 0", "(a / 0) * 0", "a "},
+      {"zero * (a % b)", "0 * (a % b)", "a b "},
+      {"(a / b) && zero", "(a / b) && 0", "a b "},
+      {"(a % b) & zero", "(a % b) & 0", "a b "},
+      {"(a / b) || offset", "(a / b) || 1", "a b "},
+      {"bits(a, k, b) & zero", "bits(a, 4, b) & 0", "a b "},
+      {"(a / k) * zero", "0", ""},
+      {"(a * b) * zero", "0", ""}, // overflow wraps around
+  };
+  for (auto &c : cases) {
+    auto ast = expr::parser(c.src);
+    auto spec = expr::specialize(*ast, known);
+    ASSERT_EQ(c.residual, expr::unparse(*spec.ast)) << c.src;
+    ASSERT_EQ(c.free, names(spec.free)) << c.src;
+  }
+
+  // ... and fails like the original
+  for (const char *src : {"(a / b) * zero", "(a % b) && zero"}) {
+    expr::SymbolTable full;
+    full["zero"] = 0;
+    auto ast = expr::parser(src);
+    ASSERT_THROW(ast->eval(full), expr::expr_error) << src;
+    ASSERT_THROW(expr::specialize(*ast, known).ast->eval(full),
+                 expr::expr_error)
+        << src;
+  }
+
+  // with checked arithmetic, neither is an operand that may overflow
+  auto mul = expr::parser("(a * b) * zero");
+  ASSERT_EQ("(a * b) * 0",
+            expr::unparse(*expr::specialize(*mul, known, true).ast));
+  mul = expr::parser("((a & 0xFF) * k) * zero");
+  ASSERT_EQ("0", expr::unparse(*expr::specialize(*mul, known, true).ast));
+
+  // the residual gives the same results and side effects
+  auto ast = expr::parser("(a > k ? (b += a / k) : (b -= mode)) + offset");
+  auto spec = expr::specialize(*ast, known);
+  for (int a : {-9, 0, 3, 5, 100}) {
+    expr::SymbolTable full, rest;
+    for (auto &kv : known.sorted()) {
+      full[kv.first] = kv.second;
+    }
+    full["a"] = rest["a"] = a;
+    full["b"] = rest["b"] = 7;
+    ASSERT_EQ(ast->eval(full), spec.ast->eval(rest));
+    ASSERT_EQ(full["b"], rest["b"]);
+  }
+}
+
+//-----------------------------------------------------------------------------
+TEST(optimize, adapt) {
+  // an expensive test that rarely decides first, a cheap decisive one last
+  const char *src = "popcnt(a) + clz(a) + ctz(b) + bswap(b) != 99 && f == 1";
+  auto ast = expr::parser(src);
+  auto adaptive = expr::parser(src);
+  expr::adapt(adaptive);
+  ASSERT_EQ(expr::unparse(*ast), expr::unparse(*adaptive));
+  auto &chain = static_cast<expr::AdaptiveExprAST &>(*adaptive);
+  ASSERT_EQ((std::vector<size_t>{0, 1}), chain.order());
+
+  expr::SymbolTable symbols;
+  for (int i = 0; i < 100000; i++) {
+    symbols["a"] = i;
+    symbols["b"] = i * 7;
+    symbols["f"] = i % 10 == 0;
+    ASSERT_EQ(ast->eval(symbols), adaptive->eval(symbols)) << i;
+  }
+  ASSERT_EQ((std::vector<size_t>{1, 0}), chain.order());
+
+  // a division stays behind its guard; the tests after it may swap
+  src = "d != 0 && x / d > 2 && popcnt(x) + clz(x) + ctz(x) != 99 && f == 1";
+  ast = expr::parser(src);
+  adaptive = expr::parser(src);
+  expr::adapt(adaptive);
+  auto &guarded = static_cast<expr::AdaptiveExprAST &>(*adaptive);
+  ASSERT_EQ(4u, guarded.size());
+  for (int i = 0; i < 100000; i++) {
+    symbols["d"] = i % 2;
+    symbols["x"] = i;
+    symbols["f"] = i % 10 == 0;
+    ASSERT_EQ(ast->eval(symbols), adaptive->eval(symbols)) << i;
+  }
+  ASSERT_EQ((std::vector<size_t>{0, 1, 3, 2}), guarded.order());
+
+  // nothing may move: the node stays plain
+  adaptive = expr::parser("(a = 1) && b || c / d");
+  expr::adapt(adaptive);
+  ASSERT_EQ(nullptr, dynamic_cast<expr::AdaptiveExprAST *>(adaptive.get()));
+
+  // nested chains and concurrent evaluation
+  src = "(a & 1 || b & 2 || popcnt(a ^ b) > 20) && a != b && (a | b) != 77";
+  ast = expr::parser(src);
+  adaptive = expr::parser(src);
+  expr::adapt(adaptive);
+  std::vector<std::thread> threads;
+  std::atomic<int> mismatches(0);
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      expr::SymbolTable local;
+      for (int i = 0; i < 50000; i++) {
+        local["a"] = i * (t + 1);
+        local["b"] = i ^ 0x55;
+        if (ast->eval(local) != adaptive->eval(local)) {
+          mismatches++;
+        }
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  ASSERT_EQ(0, mismatches.load());
+}
+
+//-----------------------------------------------------------------------------
+TEST(range, analysis) {
+  auto r = [](const std::string &src) {
+    return expr::range(*expr::parser(src), [](int id) {
+      // b is a byte, h a signed halfword, anything else unknown
+      return id == expr::interner().intern("b") ? expr::Range::interval(0, 255)
+             : id == expr::interner().intern("h")
+                 ? expr::Range::interval(-32768, 32767)
+                 : expr::Range::all();
+    });
+  };
+  auto bounds = [&](const std::string &src) {
+    auto x = r(src);
+    return std::make_pair(x.lo, x.hi);
+  };
+  ASSERT_EQ(std::make_pair(0, 255), bounds("(r0 >> 8) & 0xFF"));
+  ASSERT_EQ(std::make_pair(1, 1), bounds("((r0 >> 8) & 0xFF) < 256"));
+  ASSERT_EQ(std::make_pair(0, 0), bounds("(r0 & 0xF0) == 3"));
+  ASSERT_EQ(std::make_pair(0, 1), bounds("r0 == 3"));
+  ASSERT_EQ(std::make_pair(-128, 127), bounds("(r0 >> 24)"));
+  ASSERT_EQ(std::make_pair(0, 510), bounds("b + b"));
+  ASSERT_EQ(std::make_pair(0, 255 << 4), bounds("b << 4"));
+  ASSERT_EQ(0xFu, r("b << 4").zeros & 0xFu);
+  ASSERT_EQ(std::make_pair(-255, 0), bounds("-b"));
+  ASSERT_EQ(std::make_pair(-256, -1), bounds("~b"));
+  ASSERT_EQ(std::make_pair(-32768, 32767), bounds("b ? h : b"));
+  ASSERT_EQ(std::make_pair(0, 31), bounds("bits(r0, 8, 4)"));
+  ASSERT_EQ(std::make_pair(0, 32), bounds("popcnt(r0)"));
+  ASSERT_EQ(std::make_pair(-255, 255), bounds("h % 256"));
+  ASSERT_EQ(std::make_pair(0, 1), bounds("(r0 | 1) != 0 && r1"));
+  ASSERT_EQ(std::make_pair(1, 1), bounds("(r0 | 1) != 0"));
+
+  // wrapping arithmetic knows nothing about the interval
+  ASSERT_EQ(std::make_pair(INT_MIN, INT_MAX), bounds("r0 + 1"));
+  ASSERT_EQ(std::make_pair(INT_MIN, INT_MAX), bounds("h * h * h"));
+  ASSERT_EQ(std::make_pair(INT_MIN, INT_MAX), bounds("-(r0 & 0x80000000)"));
+  // but the low bits survive
+  ASSERT_EQ(1u, r("(r0 << 1) + 1").ones & 1u);
+  // an assigned symbol is unknown
+  ASSERT_EQ(std::make_pair(INT_MIN, INT_MAX), bounds("(b = r0) + b - b"));
+  ASSERT_EQ(8, r("b - 128").width());
+  ASSERT_EQ(16, r("b").width());
+  ASSERT_EQ(32, r("h << 1").width());
+}
+
+//-----------------------------------------------------------------------------
+TEST(range, block_eval) {
+  auto field = [](int id) {
+    return id == expr::interner().intern("b")   ? expr::Range::interval(0, 255)
+           : id == expr::interner().intern("s") ? expr::Range::interval(-128, 127)
+                                                : expr::Range::all();
+  };
+  // ((r0 >> 8) & 0xFF) == 3 : shift in 32, mask and compare in 16 bits
+  auto ast = expr::parser("((r0 >> 8) & 0xFF) == 3");
+  auto block = expr::BlockEval::create(*ast, field);
+  ASSERT_NE(nullptr, block);
+  auto widths = block->widths();
+  ASSERT_EQ(32, block->width(0));
+  ASSERT_EQ(16, widths.back());
+
+  // unsupported : may fail, assigns, calls, shifts out of range
+  for (auto src : {"r0 / 2", "a = 1", "popcnt(r0)", "1 << r0"}) {
+    ASSERT_EQ(nullptr, expr::BlockEval::create(*expr::parser(src), field)) << src;
+  }
+  ASSERT_NE(nullptr, expr::BlockEval::create(*expr::parser("1 << (r0 & 31)"),
+                                             field));
+
+  // the same values as the scalar evaluation, narrow or not
+  std::vector<int> w(expr::BlockEval::BLOCK), b(w.size()), s(w.size());
+  const int edges[] = {0, 1, -1, INT_MIN, INT_MAX, 255, 256, -256};
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < w.size(); i++) {
+    x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+    w[i] = i < 8 ? edges[i] : int(x);
+    b[i] = (x >> 3) & 0xFF;
+    s[i] = int8_t(x >> 11);
+  }
+  std::vector<int8_t> s8(s.begin(), s.end());
+  std::vector<int16_t> b16(b.begin(), b.end());
+  for (auto src :
+       {"((w >> 8) & 0xFF) == 3", "b + s * 3 - (b ^ s)", "(b << 4) | (s & 15)",
+        "~b + -s", "!(b & s) || w < 0 && s > -3", "b > 100 ? s : w >> 30",
+        "(w << 3) - w * w", "(b - 128) * (s + 1) >= s * 64",
+        "((w >> (b & 31)) & 0xFFF) != (s << (b & 7))", "b + 1 < 256"}) {
+    auto ast = expr::parser(src);
+    for (bool narrow : {true, false}) {
+      auto block = expr::BlockEval::create(*ast, field, narrow);
+      ASSERT_NE(nullptr, block) << src;
+      std::vector<const void *> cols;
+      for (int id : block->symbols()) {
+        const std::string &name = expr::interner().name(id);
+        int width = block->width(cols.size());
+        if (name == "w") {
+          cols.push_back(w.data());
+        } else if (name == "b") {
+          ASSERT_EQ(narrow ? 16 : 32, width);
+          cols.push_back(narrow ? (const void *)b16.data() : b.data());
+        } else {
+          ASSERT_EQ(narrow ? 8 : 32, width);
+          cols.push_back(narrow ? (const void *)s8.data() : s.data());
+        }
+      }
+      std::vector<int> results(w.size());
+      block->eval(cols.data(), results.size(), results.data());
+      for (size_t i = 0; i < w.size(); i++) {
+        std::map<std::string, int> env = {{"w", w[i]}, {"b", b[i]}, {"s", s[i]}};
+        int expect = ast->eval([&](const std::string &name) -> int & {
+          return env[name];
+        });
+        ASSERT_EQ(expect, results[i]) << src << " narrow " << narrow << " #" << i;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+TEST(stats, counters) {
+  expr::SymbolTable symbols;
+  expr::stats::reset();
+  expr::eval("a = 1 + 2 * 3", symbols);
+  ASSERT_EQ(0u, expr::stats::current().tokens); // disabled
+
+  expr::stats::enabled = true;
+  expr::eval("a = 1 + 2 * 3", symbols);
+  expr::stats::enabled = false;
+  auto &c = expr::stats::current();
+  if (EXPR_STATS) {
+    ASSERT_EQ(7u, c.tokens);
+    ASSERT_EQ(7u, c.nodes);
+    ASSERT_GT(c.allocs, 0u);
+    ASSERT_GT(c.alloc_bytes, 0u);
+  }
+
+  expr::stats::clear();
+  expr::stats::record();
+  auto report = expr::stats::report();
+  ASSERT_NE(std::string::npos, report.find("tokens: count 1"));
+
+  expr::stats::Histogram h = {};
+  for (uint64_t v : {0, 1, 2, 3, 1000}) {
+    h.add(v);
+  }
+  ASSERT_EQ(1u, h.buckets[0]);
+  ASSERT_EQ(1u, h.buckets[1]);
+  ASSERT_EQ(2u, h.buckets[2]);
+  ASSERT_EQ(1u, h.buckets[10]);
+  ASSERT_EQ(1000u, h.max);
+}
+
+//-----------------------------------------------------------------------------
+TEST(trace, layout) {
+  auto layout = expr::parse_layout("pc=0:4,%r0=4:s2,f=0x6:1");
+  ASSERT_EQ(3u, layout.fields.size());
+  ASSERT_EQ(7u, layout.record_size);
+  ASSERT_EQ(4u, layout.fields[1].offset);
+  ASSERT_EQ(2, layout.fields[1].width);
+  ASSERT_TRUE(layout.fields[1].sign);
+  ASSERT_EQ(16u, expr::parse_layout("pc=0:4", 16).record_size);
+
+  for (auto spec : {"", "pc", "pc=0", "=0:4", "pc=x:4", "pc=0:3", "pc=0:s4",
+                    "1=0:4", "pc=0:4,pc=4:4"}) {
+    ASSERT_ANY_THROW(expr::parse_layout(spec)) << spec;
+  }
+  ASSERT_ANY_THROW(expr::parse_layout("pc=0:4", 2));
+}
+
+//-----------------------------------------------------------------------------
+TEST(trace, scan) {
+  // 6 byte records : a (u32), b (s16)
+  const unsigned char data[] = {
+      1, 0, 0, 0, 0xff, 0xff, // a = 1, b = -1
+      0, 1, 0, 0, 2,    0,    // a = 256, b = 2
+      5, 0, 0, 0, 0x00, 0x80, // a = 5, b = -32768
+  };
+  auto base = reinterpret_cast<const char *>(data);
+  expr::TraceFilter filter(expr::parse_layout("a=0:4,b=4:s2"), "b < 0");
+  ASSERT_EQ(6u, filter.record_size());
+  ASSERT_TRUE(filter.blocked());
+
+  std::vector<uint64_t> matches;
+  filter.scan(base, 0, 3, matches);
+  ASSERT_EQ((std::vector<uint64_t>{0, 2}), matches);
+
+  matches.clear();
+  expr::TraceFilter(expr::parse_layout("a=0:4,b=4:s2"), "a > 4 || b == 2")
+      .scan(base, 1, 3, matches);
+  ASSERT_EQ((std::vector<uint64_t>{1, 2}), matches);
+
+  // one record at a time
+  matches.clear();
+  expr::TraceFilter divide(expr::parse_layout("a=0:4,b=4:s2"), "a / 5 == 1");
+  ASSERT_FALSE(divide.blocked());
+  divide.scan(base, 0, 3, matches);
+  ASSERT_EQ((std::vector<uint64_t>{2}), matches);
+
+  ASSERT_ANY_THROW(expr::TraceFilter(expr::parse_layout("a=0:4"), "a + c"));
+
+  int values[2];
+  filter.eval(base, 1, 3, values);
+  ASSERT_EQ(0, values[0]);
+  ASSERT_EQ(1, values[1]);
+
+  // by the adapted tree: same matches while the chain is reordered
+  std::vector<unsigned char> many;
+  for (int i = 0; i < 20000; i++) {
+    int a = i * 7919, b = i % 97 == 0 ? 3 : -i;
+    for (int k = 0; k < 4; k++) {
+      many.push_back(static_cast<unsigned char>(a >> (8 * k)));
+    }
+    many.push_back(static_cast<unsigned char>(b));
+    many.push_back(static_cast<unsigned char>(b >> 8));
+  }
+  auto records = reinterpret_cast<const char *>(many.data());
+  const char *cond = "popcnt(a * a) + clz(a ^ 5) > 20 && b == 3";
+  expr::TraceFilter adapted(expr::parse_layout("a=0:4,b=4:s2"), cond, 8,
+                            false, true);
+  ASSERT_TRUE(adapted.adaptive());
+  ASSERT_FALSE(adapted.blocked());
+  std::vector<uint64_t> expect, actual;
+  expr::TraceFilter(expr::parse_layout("a=0:4,b=4:s2"), cond)
+      .scan(records, 0, 20000, expect);
+  for (uint64_t first = 0; first < 20000; first += 1000) {
+    adapted.scan(records, first, first + 1000, actual);
+  }
+  ASSERT_EQ(expect, actual);
+  ASSERT_FALSE(expect.empty());
+
+  expr::TraceFilter failing(expr::parse_layout("a=0:4,b=4:s2"),
+                            "b > 0 || a / (b + 1) > 0", 8, false, true);
+  try {
+    failing.eval(base, 0, 3, values);
+    FAIL();
+  } catch (const expr::expr_error &e) {
+    ASSERT_STREQ("record 0: division by zero in 'a / (b + 1)'", e.what());
+  }
+}
+
+//-----------------------------------------------------------------------------
+TEST(aggregate, reduce) {
+  auto q = expr::parse_aggregate(" max ( (r1 - r2) * (r3) ) ");
+  ASSERT_EQ(expr::AGG_MAX, q.kind);
+  ASSERT_EQ(" (r1 - r2) * (r3) ", q.expression);
+  ASSERT_EQ(expr::AGG_HIST, expr::parse_aggregate("hist(a)").kind);
+  ASSERT_ANY_THROW(expr::parse_aggregate("count(a) + count(b)"));
+  ASSERT_ANY_THROW(expr::parse_aggregate("avg(a)"));
+  ASSERT_ANY_THROW(expr::parse_aggregate("a + 1"));
+
+  // records i = 0, 1, ... with value i * 7919 - 500000 (mod 2^32)
+  const uint64_t n = 100000;
+  auto value = [](uint64_t i) { return int(uint32_t(i * 7919 - 500000)); };
+  auto eval = [&](uint64_t begin, uint64_t end, int *values) {
+    for (uint64_t i = begin; i < end; i++) {
+      values[i - begin] = value(i);
+    }
+  };
+  int64_t sum = 0, count = 0;
+  int lo = INT_MAX, hi = INT_MIN;
+  for (uint64_t i = 0; i < n; i++) {
+    sum += value(i);
+    count += value(i) != 0;
+    lo = std::min(lo, value(i));
+    hi = std::max(hi, value(i));
+  }
+  for (size_t workers : {1, 3}) {
+    ASSERT_EQ(count, expr::reduce(expr::AGG_COUNT, n, workers, eval).value());
+    ASSERT_EQ(sum, expr::reduce(expr::AGG_SUM, n, workers, eval).value());
+    ASSERT_EQ(lo, expr::reduce(expr::AGG_MIN, n, workers, eval).value());
+    ASSERT_EQ(hi, expr::reduce(expr::AGG_MAX, n, workers, eval).value());
+    ASSERT_EQ(n, expr::reduce(expr::AGG_MAX, n, workers, eval).records());
+  }
+  ASSERT_EQ(0, expr::reduce(expr::AGG_MIN, 0, 4, eval).value());
+
+  // the sum does not wrap around at 32 bits
+  expr::Accumulator acc(expr::AGG_SUM);
+  std::vector<int> big(4096, INT_MIN);
+  for (int i = 0; i < 3; i++) {
+    acc.add(big.data(), big.size());
+  }
+  ASSERT_EQ(int64_t(3 * 4096) * INT_MIN, acc.value());
+
+  // hist : small values in an array, others in a map
+  auto hist = expr::reduce(expr::AGG_HIST, 1000, 2,
+                           [](uint64_t begin, uint64_t end, int *values) {
+                             for (uint64_t i = begin; i < end; i++) {
+                               values[i - begin] = i % 3 ? int(i % 4) : -7;
+                             }
+                           }).histogram();
+  ASSERT_EQ(5u, hist.size());
+  ASSERT_EQ(-7, hist[0].first);
+  ASSERT_EQ(334u, hist[0].second);
+  uint64_t total = 0;
+  for (auto &itr : hist) {
+    total += itr.second;
+  }
+  ASSERT_EQ(1000u, total);
+}
+
+//-----------------------------------------------------------------------------
+TEST(capi, eval) {
+  ASSERT_EQ(1, expr_abi_version());
+  std::string src = "n = n + (pc == 0x10 && r0 < 0)";
+  expr_program *p = expr_compile(src.data(), src.size());
+  ASSERT_NE(nullptr, p);
+  ASSERT_EQ(3u, expr_slots(p));
+  ASSERT_STREQ("n", expr_slot_name(p, 0));
+  ASSERT_STREQ("r0", expr_slot_name(p, 2));
+  ASSERT_EQ(nullptr, expr_slot_name(p, 3));
+
+  int slots[3] = {5, 0x10, -1}; // default : slot order
+  int val = 0;
+  ASSERT_EQ(0, expr_eval(p, slots, &val));
+  ASSERT_EQ(6, val);
+  ASSERT_EQ(6, slots[0]);
+
+  // bound to a register file; assignments are written back
+  ASSERT_EQ(0, expr_bind(p, "pc", 0));
+  ASSERT_EQ(0, expr_bind(p, "r0", 4));
+  ASSERT_EQ(0, expr_bind(p, "n", 7));
+  ASSERT_EQ(-1, expr_bind(p, "r1", 1));
+  int regs[2][8] = {{0x10, 0, 0, 0, -3, 0, 0, 0}, {0x10, 0, 0, 0, 3, 0, 0, 9}};
+  int results[2];
+  ASSERT_EQ(2u, expr_eval_batch(p, &regs[0][0], 8, 2, results));
+  ASSERT_EQ(1, results[0]);
+  ASSERT_EQ(9, results[1]);
+  ASSERT_EQ(1, regs[0][7]);
+  ASSERT_EQ(-3, regs[0][4]);
+  expr_free(p);
+
+  // aggregates over records
+  src = "(flags >> 4) & 0xF";
+  p = expr_compile(src.data(), src.size());
+  int flags[100];
+  for (int i = 0; i < 100; i++) {
+    flags[i] = i;
+  }
+  long long agg = 0;
+  ASSERT_EQ(0, expr_aggregate(p, EXPR_COUNT, flags, 1, 100, 2, &agg));
+  ASSERT_EQ(100 - 16, agg);
+  ASSERT_EQ(0, expr_aggregate(p, EXPR_MAX, flags, 1, 100, 0, &agg));
+  ASSERT_EQ(6, agg);
+  ASSERT_EQ(0, expr_aggregate(p, EXPR_SUM, flags, 1, 100, 1, &agg));
+  ASSERT_EQ(16 * (1 + 2 + 3 + 4 + 5) + 4 * 6, agg);
+  ASSERT_EQ(-1, expr_aggregate(p, 99, flags, 1, 100, 1, &agg));
+  ASSERT_STREQ("unknown aggregate", expr_last_error());
+  unsigned long long counts[4] = {0, 0, 0, 0}, outside = 0;
+  ASSERT_EQ(0, expr_histogram(p, flags, 1, 100, 2, 1, 4, counts, &outside));
+  ASSERT_STREQ("", expr_last_error()); // cleared by a call that succeeds
+  ASSERT_EQ(16u + 16 + 4, outside);
+  ASSERT_EQ(16u, counts[0]);
+  ASSERT_EQ(16u, counts[3]);
+  expr_free(p);
+
+  ASSERT_EQ(nullptr, expr_compile("1 +", 3));
+  ASSERT_STRNE("", expr_last_error());
+  ASSERT_EQ(nullptr, expr_compile("1 = 2", 5));
+  expr_free(nullptr);
+
+  // failures : division by zero, overflow when checked
+  p = expr_compile("a / b + a", 9);
+  int ab[2] = {INT_MAX, 0};
+  val = 7;
+  ASSERT_EQ(-1, expr_eval(p, ab, &val));
+  ASSERT_STREQ("division by zero", expr_last_error());
+  ASSERT_EQ(7, val);
+  ab[1] = 1;
+  ASSERT_EQ(0, expr_eval(p, ab, &val));
+  ASSERT_EQ(-2, val);
+  ASSERT_STREQ("", expr_last_error());
+  int records[3][2] = {{4, 2}, {4, 0}, {4, 1}};
+  int values[3] = {-1, -1, -1};
+  ASSERT_EQ(1u, expr_eval_batch(p, &records[0][0], 2, 3, values));
+  ASSERT_STREQ("division by zero", expr_last_error());
+  ASSERT_EQ(6, values[0]);
+  ASSERT_EQ(-1, values[1]);
+  ASSERT_EQ(-1, values[2]);
+  expr_program *mod = expr_compile("n % d", 5); // divisor bound elsewhere
+  ASSERT_EQ(0, expr_bind(mod, "d", 0));
+  ASSERT_EQ(0, expr_bind(mod, "n", 1));
+  int divided[3][2] = {{7, 100}, {7, -15}, {3, 100}};
+  ASSERT_EQ(3u, expr_eval_batch(mod, &divided[0][0], 2, 3, values));
+  ASSERT_EQ(2, values[0]);
+  ASSERT_EQ(-1, values[1]);
+  ASSERT_EQ(1, values[2]);
+  ASSERT_EQ(0, expr_aggregate(mod, EXPR_SUM, &divided[0][0], 2, 3, 2, &agg));
+  ASSERT_EQ(2, agg);
+  expr_free(mod);
+  expr_program *q = expr_compile("a / b + a", 9);
+  expr_set_checked(p, 1); // this handle only
+  agg = 5;
+  ASSERT_EQ(-1, expr_aggregate(p, EXPR_SUM, ab, 0, 4, 2, &agg));
+  ASSERT_STREQ("overflow in 2147483647 + 2147483647", expr_last_error());
+  ASSERT_EQ(5, agg);
+  ASSERT_EQ(-1, expr_histogram(p, ab, 0, 4, 2, 0, 4, counts, &outside));
+  ASSERT_EQ(0, expr_eval(q, ab, &val));
+  ASSERT_EQ(-2, val);
+  expr_set_checked(p, 0);
+  ASSERT_EQ(0, expr_eval(p, ab, &val));
+  expr_free(p);
+  expr_free(q);
+}
+
+//-----------------------------------------------------------------------------
+// send requests to the server at path, shut down writing and read all
+// responses
+static std::string request(const std::string &path, const std::string &req) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  EXPECT_EQ(0, connect(fd, (sockaddr *)&addr, sizeof(addr)));
+  EXPECT_EQ((ssize_t)req.size(), write(fd, req.data(), req.size()));
+  shutdown(fd, SHUT_WR);
+  std::string res;
+  char buf[256];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    res.append(buf, n);
+  }
+  close(fd);
+  return res;
+}
+
+TEST(server, pipeline) {
+  std::string path = "/tmp/crepl_test_" + std::to_string(getpid()) + ".sock";
+  expr::SymbolTable symbols;
+  expr::Server server(path, symbols);
+  std::thread loop([&] { server.run(); });
+
+  ASSERT_EQ("2\nerror: unknown token when expecting an expression\n6\n"
+            "error: cannot assign to except for variables\n",
+            request(path, "a = 2\nx +\n\na * 3\r\n1 = 2\n"));
+  // later connections see the assignments; the last line needs no '\n'
+  ASSERT_EQ("3\n-1\n", request(path, "a = a + 1\n-a / 3"));
+  // a request that fails part-way leaves no assignments behind
+  ASSERT_EQ("error: division by zero\n3\n0\n",
+            request(path, "(a = 5) + (b = 1) / 0\na\nb"));
+
+  server.stop();
+  loop.join();
+  ASSERT_EQ(3, symbols["a"]);
+  auto &stats = server.stats();
+  ASSERT_EQ(3u, stats.connections);
+  ASSERT_EQ(9u, stats.requests);
+  ASSERT_EQ(9u, stats.misses);
+
+  ASSERT_ANY_THROW(expr::Server(std::string(200, 'x'), symbols));
+}
+
+//-----------------------------------------------------------------------------
+// output of the crepl built in the parent directory for input
+static std::string run_crepl(const std::string &args,
+                             const std::string &input) {
+  char path[] = "/tmp/crepl_batch_XXXXXX";
+  int fd = mkstemp(path);
+  EXPECT_EQ((ssize_t)input.size(), write(fd, input.data(), input.size()));
+  close(fd);
+  std::string cmd = "../crepl --batch " + std::string(path) + " " + args;
+  std::string output;
+  FILE *fp = popen(cmd.c_str(), "r");
+  char buf[4096];
+  size_t n;
+  while (fp && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    output.append(buf, n);
+  }
+  if (fp) {
+    pclose(fp);
+  }
+  unlink(path);
+  return output;
+}
+
+TEST(batch, parallel) {
+  if (access("../crepl", X_OK) != 0) {
+    GTEST_SKIP() << "crepl is not built";
+  }
+  // failing lines and short circuits leave the same symbols behind
+  std::string input = "a = 3\nb + a\nx / 0\n0 && y\n";
+  for (int i = 0; i < 200; i++) { // a run evaluated on every worker
+    std::string n = std::to_string(i);
+    input += "a + u" + n + "\nv" + n + " / 0\n0 && s" + n + "\na || t" + n +
+             "\nc ? 1 / 0 : m" + n + "\n";
+  }
+  input += ":p\n";
+  std::string sequential = run_crepl("", input);
+  ASSERT_NE(std::string::npos, sequential.find("b = 0\n"));
+  ASSERT_EQ(std::string::npos, sequential.find("x = 0\n"));
+  ASSERT_EQ(std::string::npos, sequential.find("y = 0\n"));
+  ASSERT_EQ(sequential, run_crepl("--parallel -j 4", input));
+}
+
+//-----------------------------------------------------------------------------
+TEST(completion, index) {
+  expr::SymbolTable symbols;
+  expr::SymbolIndex index;
+  for (auto name : {"reg", "r1", "r10", "rate", "%r1", "x"}) {
+    symbols[name] = 0;
+  }
+  index.update(symbols);
+  ASSERT_EQ(6u, index.size());
+  ASSERT_EQ((std::vector<std::string>{"r1", "r10", "rate", "reg"}),
+            index.complete("r"));
+  ASSERT_EQ((std::vector<std::string>{"r1", "r10"}), index.complete("r1"));
+  ASSERT_EQ((std::vector<std::string>{"%r1"}), index.complete("%"));
+  ASSERT_EQ(0u, index.complete("y").size());
+  ASSERT_EQ(2u, index.complete("", 2).size());
+
+  // assignments add symbols incrementally
+  expr::eval("r2 = ra = 1", symbols);
+  index.update(symbols);
+  ASSERT_EQ((std::vector<std::string>{"r1", "r10", "r2", "ra", "rate", "reg"}),
+            index.complete("r"));
+
+  // a cleared table is reindexed
+  symbols.clear();
+  for (int i = 0; i < 10; i++) {
+    symbols["v" + std::to_string(i)] = i;
+  }
+  index.update(symbols);
+  ASSERT_EQ(10u, index.size());
+  auto range = index.range("v");
+  ASSERT_EQ(10u, range.second - range.first);
+  ASSERT_EQ("v0", index.name(range.first));
+
+  // so is one that lost symbols to erase(), even with the same size and
+  // last symbol
+  symbols.erase(expr::interner().intern("v3"));
+  symbols.erase(expr::interner().intern("v9"));
+  symbols["w"] = 1;
+  symbols["v9"] = 9;
+  index.update(symbols);
+  ASSERT_EQ(10u, index.size());
+  ASSERT_EQ(9u, index.complete("v").size());
+  ASSERT_EQ((std::vector<std::string>{"w"}), index.complete("w"));
+
+  // and one whose transaction was aborted
+  symbols.begin();
+  symbols["x1"] = 1;
+  index.update(symbols);
+  symbols.abort();
+  symbols["y1"] = 1;
+  index.update(symbols);
+  ASSERT_EQ(0u, index.complete("x").size());
+  ASSERT_EQ(11u, index.size());
+}
+
+//-----------------------------------------------------------------------------
+TEST(symbol, bulk_eval) {
+  // a host that counts round trips
+  std::map<std::string, int> target = {{"pc", 0x1000}, {"sp", 64}};
+  int fetches = 0, stores = 0;
+  auto fetch = [&](const std::vector<std::string> &names, int *values) {
+    fetches++;
+    for (size_t i = 0; i < names.size(); i++) {
+      values[i] = target[names[i]];
+    }
+  };
+  auto store = [&](const std::vector<std::string> &names, const int *values) {
+    stores++;
+    for (size_t i = 0; i < names.size(); i++) {
+      target[names[i]] = values[i];
+    }
+  };
+
+  auto ast = expr::parser("pc == 0x1000 && sp > 32 && pc + sp + pc != 0");
+  expr::BulkEval cond(*ast);
+  ASSERT_EQ((std::vector<std::string>{"pc", "sp"}), cond.reads());
+  ASSERT_EQ(0u, cond.writes().size());
+  ASSERT_EQ(1, cond.eval(fetch, store));
+  ASSERT_EQ(1, fetches);
+  ASSERT_EQ(0, stores);
+
+  // assigned symbols are stored once, and only when they changed
+  ast = expr::parser("(hits += pc == 0x1000) + (sp -= 4) + (flag = 0)");
+  expr::BulkEval update(*ast);
+  ASSERT_EQ((std::vector<std::string>{"hits", "pc", "sp"}), update.reads());
+  ASSERT_EQ((std::vector<std::string>{"hits", "sp", "flag"}), update.writes());
+  ASSERT_EQ(4u, update.symbols().size());
+  fetches = 0;
+  ASSERT_EQ(1 + 60, update.eval(fetch, store));
+  ASSERT_EQ(1, fetches);
+  ASSERT_EQ(1, stores);
+  ASSERT_EQ(1, target["hits"]);
+  ASSERT_EQ(60, target["sp"]);
+
+  // a conditional assignment that does not run leaves the symbol alone
+  ast = expr::parser("sp < 0 ? (sp = 0) : sp");
+  expr::BulkEval clamp(*ast);
+  stores = 0;
+  ASSERT_EQ(60, clamp.eval(fetch, store));
+  ASSERT_EQ(0, stores);
+  ASSERT_EQ(60, target["sp"]);
+
+  ast = expr::parser("1 = 2");
+  ASSERT_ANY_THROW(expr::BulkEval bad(*ast));
+}
+
+//-----------------------------------------------------------------------------
+TEST(import, file) {
+  char path[] = "/tmp/crepl_import_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  std::string text = "name,value\n"
+                     "# comment\n"
+                     "a = 1\n"
+                     "  b=0x10\r\n"
+                     "\n"
+                     "c,-5,ignored\n"
+                     "\"d\", 0b101\n"
+                     "e = a + b * 2\n"
+                     "a = 2\n"
+                     "f = a\n"
+                     "g = 4294967295\n"
+                     "h,x\n"
+                     "i = (\n"
+                     "bits(b, 7, 4) == 1 ? (z = 1) : (z = 2)\n";
+  for (int i = 0; i < 20000; i++) {
+    text += "r" + std::to_string(i) + " = " + std::to_string(i) + "\n";
+  }
+  text += "last = r19999 + 1";
+  ASSERT_EQ((ssize_t)text.size(), write(fd, text.data(), text.size()));
+  close(fd);
+
+  expr::SymbolTable symbols;
+  auto r = expr::import_symbols(path, symbols, 4);
+  ASSERT_EQ(20005u, r.fast);
+  ASSERT_EQ(4u, r.evaluated);
+  ASSERT_EQ(3u, r.error_count);
+  ASSERT_EQ(3u, r.errors.size());
+  ASSERT_EQ(0u, r.errors[0].find("line 11: "));
+  ASSERT_EQ("line 12: invalid record 'h,x'", r.errors[1]);
+  ASSERT_EQ(0u, r.errors[2].find("line 13: "));
+  ASSERT_EQ(2, symbols["a"]);
+  ASSERT_EQ(16, symbols["b"]);
+  ASSERT_EQ(-5, symbols["c"]);
+  ASSERT_EQ(5, symbols["d"]);
+  ASSERT_EQ(33, symbols["e"]); // sees a and b defined above it
+  ASSERT_EQ(2, symbols["f"]);
+  ASSERT_EQ(1, symbols["z"]); // a built-in call, not a record
+  ASSERT_EQ(12345, symbols["r12345"]);
+  ASSERT_EQ(20000, symbols["last"]);
+
+  unlink(path);
+  ASSERT_ANY_THROW(expr::import_symbols(path, symbols, 4));
+}
+
+//-----------------------------------------------------------------------------
+TEST(format, integer) {
+  char buf[64];
+  auto str = [&](char *end) { return std::string(buf, end); };
+  char ref[64];
+
+  for (int val : {0, 1, 9, 10, 99, 100, 12345, -1, -10, 0x7FFFFFFF,
+                  (int)0x80000000, (int)0xdeadbeef}) {
+    snprintf(ref, sizeof(ref), "%d", val);
+    ASSERT_EQ(ref, str(expr::format_dec(buf, val)));
+    snprintf(ref, sizeof(ref), "0x%08x", val);
+    ASSERT_EQ(ref, str(expr::format_hex(buf, (uint32_t)val)));
+  }
+  for (uint64_t val : {0ull, 7ull, 4294967296ull, 18446744073709551615ull}) {
+    snprintf(ref, sizeof(ref), "%llu", (unsigned long long)val);
+    ASSERT_EQ(ref, str(expr::format_u64(buf, val)));
+  }
+  ASSERT_EQ("0b00000000000000000000000000000110",
+            str(expr::format_bin(buf, 6)));
+  ASSERT_EQ("0b10000000000000000000000000000001",
+            str(expr::format_bin(buf, 0x80000001u)));
+}
+
+//-----------------------------------------------------------------------------
+TEST(format, sink) {
+  FILE *fp = tmpfile();
+  ASSERT_NE(nullptr, fp);
+  {
+    expr::Sink out(fp, 16); // small buffer to exercise draining
+    for (int i = 0; i < 100; i++) {
+      out << "v" << i << '\n';
+    }
+    out.write(std::string(40, 'x'));
+  }
+  std::string expect;
+  for (int i = 0; i < 100; i++) {
+    expect += "v" + std::to_string(i) + "\n";
+  }
+  expect += std::string(40, 'x');
+
+  rewind(fp);
+  std::string actual;
+  char buf[256];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    actual.append(buf, len);
+  }
+  fclose(fp);
+  ASSERT_EQ(expect, actual);
+}
+
 //=============================================================================
 
 #if 1